@@ -28,11 +28,11 @@ void write_dmc_reg_1(uint8_t val); // $4011
 void write_dmc_reg_2(uint8_t val); // $4012
 void write_dmc_reg_3(uint8_t val); // $4013
 // IRQ line from DMC
-extern bool dmc_irq;
+extern THREAD_LOCAL bool dmc_irq;
 
 void write_frame_counter(uint8_t val); // $4017
 // IRQ line from frame counter
-extern bool frame_irq;
+extern THREAD_LOCAL bool frame_irq;
 
 // $4015
 uint8_t read_apu_status();
@@ -44,7 +44,33 @@ void init_apu_for_rom();
 void reset_apu();
 void set_apu_cold_boot_state();
 
+// Runs the APU for one CPU cycle
 void tick_apu();
 
+// Catch-up mode. Rather than having tick() run the APU every CPU cycle, the
+// cycles since the APU was last run are owed, and only run when something
+// could observe the APU: an access to $4000-$4017, a state transfer, a reset,
+// the end of the frame (for the audio), or a cycle that signals the CPU (the
+// frame IRQ, and DMC sample fetches, which stall the CPU and might raise the
+// DMC IRQ). sync_apu() posts the next such cycles as events (see scheduler.h)
+// that run it, so tick() does no APU work at all in between. Stretches of
+// cycles where the channels only count down their timers are skipped over in
+// one go, so the work done is proportional to the number of timer expirations
+// rather than the number of cycles.
+//
+// Without CATCH_UP_APU, tick() runs the APU one cycle at a time. That's the
+// reference for catch-up mode, which should give identical results.
+#ifdef CATCH_UP_APU
+// Runs the owed cycles
+void sync_apu();
+#else
+inline void sync_apu() {}
+#endif
+
 template<bool calculating_size, bool is_save>
 void transfer_apu_state(uint8_t *&buf);
+
+// Transfers the mixer bookkeeping that isn't part of the save state. Used to
+// switch between consoles (see emulator.h).
+template<bool calculating_size, bool is_save>
+void transfer_apu_context(uint8_t *&buf);
@@ -3,11 +3,20 @@
 void init_audio_for_rom();
 void deinit_audio_for_rom();
 
-// Sets the instantaneous signal level
-void set_audio_signal_level(int16_t level);
+// Transfers the resampling buffer and the current signal level. Used to switch
+// between consoles (see emulator.h).
+template<bool calculating_size, bool is_save>
+void transfer_audio_context(uint8_t *&buf);
+
+// Sets the instantaneous signal level, starting at CPU cycle 'time' within the
+// frame. The times passed in must not decrease within a frame. If 'fast' is
+// true, the step is synthesized with lower quality (see FAST_TRI_NOISE_AUDIO
+// in the Makefile).
+void set_audio_signal_level(int16_t level, unsigned time, bool fast = false);
 // Resamples and buffers the audio generated during one (video) frame
 void end_audio_frame();
 // Moves up to 'len' samples from the audio buffer to 'dst'. In case of
 // underflow, moves all remaining samples and zeroes the remainder of 'dst' (as
-// required by SDL2).
+// required by SDL2). Called from the audio thread. It doesn't need to be
+// synchronized with the emulation thread.
 void read_samples(int16_t *dst, size_t len);
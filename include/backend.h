@@ -0,0 +1,86 @@
+// Interface between the emulation core and the video, audio, and input
+// backend. Implemented by sdl_backend.cpp, and by headless_backend.cpp in
+// HEADLESS builds (which pass the output on to the sinks in 'sink_fns'
+// instead).
+
+// Video
+
+// Frame buffer geometry, including the padding on the left and right
+#define NES_PPU_W 282
+#define NES_PPU_H 240
+#define NES_PPU_OFFSET 15
+
+void put_pixel(int x, unsigned y, uint32_t color);
+// Puts the 'n' pixels in 'colors' at (x, y), (x + 1, y), ...
+void put_pixels(int x, unsigned y, uint32_t const *colors, unsigned n);
+void draw_frame();
+// Called at the start of each frame. Returning false means the frame won't be
+// displayed or recorded, and lets the PPU skip producing pixels for it. It
+// still does everything with side effects (sprite evaluation, sprite zero
+// hits, and the address bus activity mappers watch), and draw_frame() is still
+// called at the end of the frame. The frame buffer keeps its old contents.
+// Wanted frames come out identical to those of a run that skips no frames.
+bool want_frame();
+
+// Audio
+
+int const sample_rate = 44100;
+
+// Stop and start audio playback, returns old state.
+int audio_pause(bool value);
+
+// Input and events
+
+enum game_inputs {
+    I_A,
+    I_B,
+    I_SELECT,
+    I_START,
+    I_UP,
+    I_DOWN,
+    I_LEFT,
+    I_RIGHT,
+    I_COUNT,
+};
+
+enum global_inputs {
+    IG_RESET,
+    IG_COUNT,
+};
+
+extern THREAD_LOCAL bool controller_inputs[4][I_COUNT];
+extern THREAD_LOCAL bool global_inputs[IG_COUNT];
+
+// Protect 'controller_inputs' and 'global_inputs' from concurrent access by
+// the emulation thread and the backend
+void lock_input();
+void unlock_input();
+
+void handle_ui_keys();
+
+#ifdef HEADLESS
+// Receivers for the output of a headless build. Unset (null) sinks discard
+// the output.
+struct Sink_fns {
+    // Called at the end of each frame with the NES_PPU_W*NES_PPU_H frame
+    // buffer
+    void (*video)(uint32_t const *frame);
+    // Called at the start of each frame. Returning false skips producing the
+    // pixels for the frame (see want_frame()). Null means all frames are
+    // wanted.
+    bool (*want_frame)();
+    // Called at the end of each frame with the resampled audio for the frame
+    void (*audio)(int16_t const *samples, size_t n_samples);
+};
+
+extern THREAD_LOCAL Sink_fns sink_fns;
+
+// Clears the frame buffer, so that a new console doesn't start out with the
+// last frame from the previous console on the thread
+void clear_frame_buffer();
+
+// Transfers the contents of the frame buffer, so that switching between
+// consoles in the middle of a frame works (see emulator.h)
+template<bool calculating_size, bool is_save>
+void transfer_backend_context(uint8_t *&buf);
+#endif
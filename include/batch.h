@@ -0,0 +1,24 @@
+// Batch runner for HEADLESS builds
+//
+// Runs the jobs listed in a manifest file in parallel, on one worker thread
+// per core. Each line of the manifest describes a job as
+//
+//   <ROM file> <input file> <frames> <expected hash>
+//
+// where the input file is an input movie (see input_movie.h) that is played
+// back from its starting point. Frames past the end of the movie get no
+// input. '-' as the input file means no input, and '-' as the expected hash
+// means the hash is only reported. Fields are separated by whitespace, and can
+// be put in double quotes to include whitespace or '#', as in
+//
+//   "roms/Super Mario Bros.nes" - 600 -
+//
+// Blank lines and everything after a '#' outside of quotes are ignored.
+//
+// The hash is a 64-bit FNV-1a hash of all the video and audio output from the
+// job, printed in hexadecimal. A job whose ROM or input file can't be loaded
+// gets an error in its result line instead, and the other jobs still run.
+
+// Runs all jobs in 'manifest_filename' and prints the results. Returns true if
+// all jobs ran and those with an expected hash produced it.
+bool run_batch(char const *manifest_filename);
@@ -35,6 +35,16 @@ void blip_add_delta( blip_t*, unsigned int clock_time, int delta );
 /** Same as blip_add_delta(), but uses faster, lower-quality synthesis. */
 void blip_add_delta_fast( blip_t*, unsigned int clock_time, int delta );
 
+/** Adds count deltas, each at the corresponding clock time. Same result as
+calling blip_add_delta() for each, but quicker, as the step kernel is applied
+with SIMD instructions where available. */
+void blip_add_deltas( blip_t*, const unsigned int clock_times [],
+		const int deltas [], int count );
+
+/** Same as blip_add_deltas(), but uses blip_add_delta_fast() synthesis. */
+void blip_add_deltas_fast( blip_t*, const unsigned int clock_times [],
+		const int deltas [], int count );
+
 /** Length of time frame, in clocks, needed to make sample_count additional
 samples available. */
 int blip_clocks_needed( const blip_t*, int sample_count );
@@ -34,6 +34,16 @@ extern char const *program_name; // argv[0]
 bool is_pow_2_or_0(unsigned n);
 uint8_t rev_byte(uint8_t n);
 
+// 64-bit FNV-1a hash. Chain calls by passing the result of the previous call
+// as 'hash', starting from 'fnv_offset_basis'.
+uint64_t const fnv_offset_basis = UINT64_C(14695981039346656037);
+uint64_t fnv_1a(uint64_t hash, void const *data, size_t len);
+
+// Little-endian integers in file formats. put_u32() returns the position
+// after the integer.
+uint8_t *put_u32(uint8_t *p, uint32_t val);
+uint32_t get_u32(uint8_t const *p);
+
 template<typename T>
 T const &min(T const &x, T const &y) {
     return x < y ? x : y;
@@ -81,6 +91,15 @@ char (&array_len_helper(T (&)[N]))[N];
 // Returns the contents of file 'filename'. Buffer freed by caller.
 uint8_t *get_file_buffer(char const *filename, size_t &size_out);
 
+// Like get_file_buffer(), but returns null with 'errno' set on failure rather
+// than exiting
+uint8_t *try_get_file_buffer(char const *filename, size_t &size_out);
+
+// Writes 'size' bytes from 'buf' to 'filename'. The data goes into a temporary
+// file that is then renamed, so that a failed write doesn't destroy the old
+// file. Returns false with 'errno' set on failure.
+bool write_file_safely(char const *filename, void const *buf, size_t size);
+
 // Initializes each element of an array to a given value. Verifies that the
 // argument is an array.
 template<typename T, size_t N>
@@ -103,11 +122,22 @@ T *alloc_array_init(size_t size, T const&val) {
 // Frees a pointer and sets it to null, making null equivalent to not
 // allocated, memory errors easier to debug, and the pointer safe to re-free
 template<typename T>
-void free_array_set_null(T *p) {
+void free_array_set_null(T *&p) {
     delete [] p;
     p = 0;
 }
 
+// Used on the variables that make up the state of the emulated console. In
+// HEADLESS builds, each thread gets its own copy of the console, so that
+// several consoles can be run in parallel from different threads (see
+// emulator.h). Other builds run a single console, parts of which (e.g. the
+// controller inputs) are shared with the backend thread.
+#ifdef HEADLESS
+#  define THREAD_LOCAL __thread
+#else
+#  define THREAD_LOCAL
+#endif
+
 #ifdef OPTIMIZING
 #  define UNREACHABLE __builtin_unreachable();
 #else
@@ -7,5 +7,7 @@ uint8_t read_controller(unsigned n);
 // ports
 void write_controller_strobe(bool strobe);
 
+void set_controller_cold_boot_state();
+
 template<bool calculating_size, bool is_save>
 void transfer_controller_state(uint8_t *&buf);
@@ -3,23 +3,32 @@
 // http://wiki.nesdev.com/w/index.php/CPU
 
 #ifdef ENABLE_CORRUPTION
-extern unsigned int corrupt_chance;
+extern THREAD_LOCAL unsigned int corrupt_chance;
 #endif
 
 // Current CPU read/write state. Needed to get the timing for APU DMC sample
 // loading right (tested by the sprdma_and_dmc_dma tests).
-extern bool cpu_is_reading;
+extern THREAD_LOCAL bool cpu_is_reading;
 
 // Last value put on the CPU data bus. Used to implement open bus reads.
-extern uint8_t cpu_data_bus;
+extern THREAD_LOCAL uint8_t cpu_data_bus;
 
 // Offset in CPU cycles within the current frame. Used for audio generation.
-extern unsigned frame_offset;
+extern THREAD_LOCAL unsigned frame_offset;
+
+// Number of CPU cycles run since power-on. Not part of the save state, so
+// keeps counting forward across state loads.
+extern THREAD_LOCAL uint64_t cpu_cycle;
 
 // Runs the PPU and APU for one CPU cycle. Has external linkage so we can use
 // it while the CPU is halted during DMA.
 void tick();
 
+// Returns the number of tick()s until 'n' more PPU dots have been run (or
+// owed, in catch-up mode). Takes the extra dot every fifth cycle on PAL into
+// account.
+unsigned cycles_till_ppu_dots(unsigned n);
+
 // Also used outside the CPU core to load DMC samples - hence the external
 // linkage
 uint8_t read_mem(uint16_t addr);
@@ -31,14 +40,31 @@ void set_cart_irq(bool s);
 void set_dmc_irq(bool s);
 void set_frame_irq(bool s);
 
-// Starts emulation by issuing a RESET interrupt and entering the emulation
-// loop
+// Puts the CPU, PPU, and APU in their power-up state and issues a RESET
+// interrupt
+void power_on();
+
+// Powers on and runs the emulation loop until end_emulation() is called
 void run();
 
+// Like run(), but without powering on first. Lets the console be put in some
+// other state after power_on(), e.g. the start of an input movie.
+void emulate_until_end();
+
+// Runs the emulation loop until the end of the current frame (or until
+// end_emulation() is called). Assumes power_on() has been called.
+void emulate_frame();
+
+// Runs the emulation loop for at least 'n' CPU cycles, stopping at the first
+// instruction boundary after that, once the events due there have been
+// handled
+void emulate_cycles(unsigned n);
+
 // These functions inform the CPU emulation code of various events, which are
-// handled at the next instruction boundary. Handling events at instruction
-// boundaries simplifies state transfers as the current location within the CPU
-// emulation loop is part of the state.
+// posted as CPU events (see scheduler.h) and handled at the next instruction
+// boundary. Handling events at instruction boundaries simplifies state
+// transfers as the current location within the CPU emulation loop is part of
+// the state. They must be called from the thread running the console.
 
 // Signaled at the end of the visible portion of the frame
 void frame_completed();
@@ -46,24 +72,28 @@ void frame_completed();
 void soft_reset();
 // Signaled if emulation should end
 void end_emulation();
+// Signaled when the debugger is attached or detached (see dbg_attached()), to
+// switch between the CPU loops with and without debugger hooks
+void debugger_attachment_changed();
 
 template<bool calculating_size, bool is_save>
 void transfer_cpu_state(uint8_t *&buf);
 
+template<bool calculating_size, bool is_save>
+void transfer_cpu_context(uint8_t *&buf);
+
 // Debugging
 
-extern uint8_t ram[0x800];
-extern uint16_t pc;
-extern uint8_t a, s, x, y;
+extern THREAD_LOCAL uint8_t ram[0x800];
+extern THREAD_LOCAL uint16_t pc;
+extern THREAD_LOCAL uint8_t a, s, x, y;
 
-extern unsigned zn;
+extern THREAD_LOCAL unsigned zn;
 
-extern bool carry;
-extern bool irq_disable;
-extern bool decimal;
-extern bool overflow;
+extern THREAD_LOCAL bool carry;
+extern THREAD_LOCAL bool irq_disable;
+extern THREAD_LOCAL bool decimal;
+extern THREAD_LOCAL bool overflow;
 
-extern uint8_t *wram_6000_page;
+extern THREAD_LOCAL uint8_t *wram_6000_page;
 
-extern bool pending_irq;
-extern bool pending_nmi;
@@ -1,9 +1,43 @@
 #ifndef DBG_H
 #define DBG_H
 
+#ifdef HEADLESS
+// The debugger needs SDL. Headless builds always resume execution.
+inline int reset_debugger(void) { return 0; }
+inline int dbg_log_instruction(void) { return 1; }
+inline bool dbg_attached(void) { return false; }
+inline void dbg_watch_read(uint16_t, uint8_t) {}
+inline void dbg_watch_write(uint16_t, uint8_t) {}
+#else
 int reset_debugger(void);
 int set_debugger_vis(bool vis);
 
+extern bool show_debugger;
+// Set while the debugger is stepping or has breakpoints or watchpoints set
+extern bool dbg_hooked;
+
+// True while the debugger is attached, meaning it's shown, stepping, or has
+// breakpoints or watchpoints set. The CPU only runs the version of its loop
+// that calls dbg_log_instruction() before each instruction then.
+inline bool dbg_attached(void) { return show_debugger || dbg_hooked; }
+
 //returns 1 if execution may resume and 0 otherwise.
 int dbg_log_instruction(void);
+
+// Memory watchpoints. read_mem(), write_mem(), and the zero page and stack
+// fast paths in cpu.cpp report each CPU access here.
+// The lookup only happens while watchpoints are set.
+extern bool dbg_watchpoints_set;
+void dbg_watchpoint_access(uint16_t addr, uint8_t val, bool is_write);
+
+inline void dbg_watch_read(uint16_t addr, uint8_t val) {
+    if (dbg_watchpoints_set)
+        dbg_watchpoint_access(addr, val, false);
+}
+
+inline void dbg_watch_write(uint16_t addr, uint8_t val) {
+    if (dbg_watchpoints_set)
+        dbg_watchpoint_access(addr, val, true);
+}
+#endif
 #endif
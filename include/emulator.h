@@ -0,0 +1,68 @@
+// Emulator instances, for running several independent consoles in one process
+//
+// The emulation core keeps the console in global variables (made thread-local
+// in HEADLESS builds), so each thread has a single "active" console at a time.
+// An Emulator holds a console while it isn't active on its thread: its save
+// state along with its context (the ROM and the buffers allocated for it, and
+// a few bits of state that aren't part of save states). run_frame() and step()
+// switch the given Emulator in before running it, which is cheap compared to
+// emulating a frame.
+//
+// An Emulator can be moved to another thread once the thread that last ran it
+// has switched in a different Emulator (or exited run_branches()), but it must
+// not be used from two threads at once. Consoles on different threads run in
+// parallel (HEADLESS builds only).
+//
+// The sinks in 'sink_fns' and the controller inputs belong to the thread
+// rather than the Emulator. Set them up before running an Emulator. Don't mix
+// Emulators with load_rom()/run() on the same thread.
+
+struct Emulator;
+
+// Loads the ROM in 'filename' and powers on a new console. init_apu() and
+// init_mappers() must have been called first.
+Emulator *new_emulator(char const *filename);
+
+// Like new_emulator(), but for the 'size'-byte ROM image 'buf' already read
+// from 'filename'. If the image can't be loaded, returns null with 'error' set
+// rather than exiting, and the caller keeps 'buf'. Otherwise the console takes
+// over 'buf'.
+Emulator *new_emulator(char const *filename, uint8_t *buf, size_t size,
+                       char const *&error);
+
+// Creates a new console that is a copy of 'emu' in its current state, for
+// trying out different inputs from the same starting point. The two share the
+// ROM image, which is read-only, and are otherwise independent. As with
+// loading a save state, audio output from the fork starts out empty. The fork
+// is left switched out, so that it can be run on any thread.
+Emulator *fork_emulator(Emulator *emu);
+
+// Frees the console and the resources associated with its ROM. A movie being
+// recorded (see input_movie.h) is written out first.
+void delete_emulator(Emulator *emu);
+
+// Runs the console until the end of the current frame
+void run_frame(Emulator *emu);
+
+// Runs the console for at least 'n_cycles' CPU cycles, stopping at the first
+// instruction boundary after that (or at end_emulation()). Returns the number
+// of cycles actually run.
+unsigned step(Emulator *emu, unsigned n_cycles);
+
+#ifdef HEADLESS
+struct Branch {
+    Emulator      *emu;
+    // The buttons pressed on controller 1 in each frame, with bit n set if
+    // button n (see 'game_inputs' in backend.h) is pressed
+    uint8_t const *inputs;
+    // Set by run_branches() to the FNV-1a hash of CPU RAM after the last
+    // frame
+    uint64_t       ram_digest;
+};
+
+// Runs 'n_frames' frames on each branch, with the inputs from the branch.
+// The branches are run in parallel, on one worker thread per core, and must
+// have different Emulators. No frames are rendered, and the sinks in
+// 'sink_fns' are not called.
+void run_branches(Branch *branches, unsigned n_branches, unsigned n_frames);
+#endif
@@ -1,11 +1,18 @@
 void init_input();
 
+// No buttons are pressed at power-on. The backend's inputs take effect at the
+// end of the first frame.
+void set_input_cold_boot_state();
+
 void calc_controller_state();
 uint8_t get_button_states(unsigned n);
 
 // For rewind to work properly across resets, the reset button needs to be
 // treated as just another key whose state is saved along with the rest
-extern bool reset_pushed;
+extern THREAD_LOCAL bool reset_pushed;
 
 template<bool calculating_size, bool is_save>
 void transfer_input_state(uint8_t *&buf);
+
+template<bool calculating_size, bool is_save>
+void transfer_input_context(uint8_t *&buf);
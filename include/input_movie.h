@@ -0,0 +1,48 @@
+// Input movies: the controller inputs for each frame, along with presses of
+// the reset button, recorded from a starting point (power-on or a save state).
+// Playing a movie back reproduces the session exactly, with no backend input
+// needed, which makes movies usable for headless regression tests (see
+// batch.h). Not to be confused with movie.h, which records video.
+//
+// The movie state belongs to the console (see emulator.h).
+
+enum Movie_mode {
+    MOVIE_OFF,
+    MOVIE_RECORDING,
+    MOVIE_PLAYING,
+};
+
+extern THREAD_LOCAL Movie_mode movie_mode;
+
+void init_input_movie_for_rom();
+
+// Starts recording the inputs of the console into a movie that stop_movie()
+// writes to 'filename'. If 'from_power_on' is true, the console is powered on
+// first. Otherwise, the movie starts from the current state, which is saved in
+// the movie.
+void start_movie_recording(char const *filename, bool from_power_on);
+
+// Loads the movie in 'filename' and puts the console in its starting state.
+// Until the movie ends, its inputs replace those from the backend.
+void start_movie_playback(char const *filename);
+
+// Like start_movie_playback(), but returns an error message rather than
+// exiting if the movie can't be loaded, or null if successful
+char const *try_start_movie_playback(char const *filename);
+
+// Stops recording or playback. A movie being recorded is written out. On
+// failure to write it, prints a message and returns false.
+bool stop_movie();
+
+// Called by calc_controller_state() once per frame while a movie is playing.
+// Sets 'buttons' (in the format returned by get_button_states()) and 'reset'
+// from the next frame of the movie. Returns false and stops playback if the
+// movie has ended.
+bool get_movie_frame(uint8_t buttons[2], bool &reset);
+
+// Called by calc_controller_state() once per frame while a movie is being
+// recorded
+void record_movie_frame(uint8_t const buttons[2], bool reset);
+
+template<bool calculating_size, bool is_save>
+void transfer_input_movie_context(uint8_t *&buf);
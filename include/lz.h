@@ -0,0 +1,22 @@
+// Fast LZ77 compression in the style of LZ4, used for save state files
+//
+// The compressed data is a sequence of
+//
+//   <token> [<literal length>] <literals> [<offset> [<match length>]]
+//
+// where the high nibble of the token is the number of literals and the low
+// nibble the match length minus four. A nibble of 15 means more length bytes
+// follow, each adding 0-255 and the last one being less than 255. The offset
+// is two bytes, little-endian. The last sequence has only literals.
+
+// Worst-case compressed size for 'len' bytes of input
+size_t lz_max_compressed_size(size_t len);
+
+// Compresses 'len' bytes from 'in' into 'out', which must have room for
+// lz_max_compressed_size(len) bytes. Returns the compressed size.
+size_t lz_compress(uint8_t const *in, size_t len, uint8_t *out);
+
+// Decompresses the 'in_len' bytes at 'in' into 'out'. Returns false unless
+// that produces exactly 'out_len' bytes. Never reads or writes out of bounds,
+// even for corrupt data.
+bool lz_decompress(uint8_t const *in, size_t in_len, uint8_t *out, size_t out_len);
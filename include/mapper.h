@@ -1,12 +1,21 @@
 // Common mapper-related functionality
 
+// Range of CPU addresses
+struct Cpu_window {
+    uint16_t first, last;
+};
+
 // Table of mapper-specific functions
 extern struct Mapper_fns {
     void    (*init)();
 
-    // Reacting to CPU reads and writes
+    // Reacting to CPU reads and writes. write() only sees writes within the
+    // mapper's write windows, which are made up of whole 256-byte pages (see
+    // the CPU memory map below).
     uint8_t (*read)(uint16_t addr);
     void    (*write)(uint8_t val, uint16_t addr);
+    Cpu_window write_windows[2];
+    unsigned   n_write_windows;
 
     // For mappers with custom nametable mirroring modes (e.g., MMC5)
     uint8_t (*read_nt)(uint16_t addr);
@@ -22,6 +31,24 @@ extern struct Mapper_fns {
     size_t  (*load_state)(uint8_t*&);
 } mapper_fns_table[256];
 
+// ppu_tick_callback for mappers that don't snoop on the PPU. Lets the PPU know
+// that it can run ahead of the CPU.
+void nop_ppu_tick_callback();
+
+// The PPU loop is specialized for these, so that the hooks can be inlined into
+// it (see ppu.cpp)
+void    mapper_4_ppu_tick_callback();
+void    mapper_5_ppu_tick_callback();
+uint8_t mapper_5_read_nt(uint16_t addr);
+void    mapper_9_ppu_tick_callback();
+void    mapper_10_ppu_tick_callback();
+
+// MMC3 clocks its scanline counter when A12 of the PPU address bus is high
+// and was last high at least this many PPU cycles earlier. The PPU predicts
+// these rises in catch-up mode, so that it can run ahead of the CPU for MMC3
+// too (see ppu.cpp).
+unsigned const mmc3_min_a12_rise_diff = 16;
+
 void init_mappers();
 
 //
@@ -46,7 +73,7 @@ void set_prg_32k_bank(unsigned bank);
 void set_prg_16k_bank(unsigned n, int bank, bool is_ram = false);
 void set_prg_8k_bank (unsigned n, int bank, bool is_ram = false);
 
-extern uint8_t *chr_pages[8];
+extern THREAD_LOCAL uint8_t *chr_pages[8];
 
 void set_chr_8k_bank(unsigned bank);
 void set_chr_4k_bank(unsigned n, unsigned bank);
@@ -55,12 +82,54 @@ void set_chr_1k_bank(unsigned n, unsigned bank);
 
 // 8 KB page mapped at $6000-$7FFF. Used for extra work RAM (WRAM) and/or
 // saving (SRAM). MMC5 can remap this.
-extern uint8_t *wram_6000_page;
+extern THREAD_LOCAL uint8_t *wram_6000_page;
 
 void set_wram_6000_bank(unsigned bank);
 
+//
+// CPU memory map
+//
+// One entry per 256-byte page of the CPU address space. Pages backed by
+// memory (RAM, WRAM, and PRG) point straight at it, so that read_mem() and
+// write_mem_inst() access them with a single load or store. Other pages go
+// through a handler. The set_prg_*() and set_wram_6000_bank() functions keep
+// the map up to date.
+//
+
+enum Cpu_page_handler {
+    // Open bus for reads. Writes are ignored (e.g. PRG ROM).
+    PAGE_NONE,
+    // PPU registers ($2000-$3FFF)
+    PAGE_PPU,
+    // APU and controller registers ($4000-$401F), followed by cartridge space
+    PAGE_IO,
+    // Cartridge space below WRAM ($4100-$5FFF)
+    PAGE_CART,
+};
+
+struct Cpu_page {
+    // Start of the page for direct reads and writes, or null if accesses go
+    // through the handler
+    uint8_t  *read;
+    uint8_t  *write;
+    // Direct writes set 'dirty_mask' in 'dirty_word', in the dirty-page
+    // bitmap of the region (see save_states.h)
+    uint64_t *dirty_word;
+    uint64_t  dirty_mask;
+    uint8_t   read_handler;
+    uint8_t   write_handler;
+    // True if the page is in one of the mapper's write windows
+    bool      mapper_write;
+};
+
+extern THREAD_LOCAL Cpu_page cpu_pages[256];
+
+// Builds the map from scratch. Needed when the RAM or the dirty-page bitmaps
+// move, i.e. when a ROM is loaded and when switching between consoles.
+void init_cpu_mem_map();
+
 // Updating this will require updating mirroring_to_str as well
-extern enum Mirroring {
+extern THREAD_LOCAL enum Mirroring {
     HORIZONTAL      = 0,
     VERTICAL        = 1,
     ONE_SCREEN_LOW  = 2,
@@ -72,6 +141,11 @@ extern enum Mirroring {
 
 void set_mirroring(Mirroring m);
 
+// Transfers the memory mappings and mirroring mode. Used to switch between
+// consoles (see emulator.h).
+template<bool calculating_size, bool is_save>
+void transfer_mapper_context(uint8_t *&buf);
+
 // Helper macros for declaring mapper state that needs to be included in save
 // states.
 //
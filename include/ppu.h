@@ -8,30 +8,53 @@
 
 // Nametable memory of variable size, initialized when loading the ROM. 2 KB is
 // built in, and the cart can provide an extra 2 KB (though this is rare).
-extern uint8_t *ciram;
+extern THREAD_LOCAL uint8_t *ciram;
 
 // The number of the last line in the frame, at the end of the VBlank interval.
 // Differs between PAL and NTSC.
-extern unsigned prerender_line;
+extern THREAD_LOCAL unsigned prerender_line;
 
 // Optimization - always equals show_bg || show_sprites
-extern bool rendering_enabled;
+extern THREAD_LOCAL bool rendering_enabled;
 
 // PPU cycles run so far. Used as a general-purpose timestamp.
-extern uint64_t ppu_cycle;
+extern THREAD_LOCAL uint64_t ppu_cycle;
 
 // Current position within the frame
-extern unsigned dot, scanline;
+extern THREAD_LOCAL unsigned dot, scanline;
 
 // VRAM address currently being output. Some mappers (e.g., MMC3) snoop on
 // this.
-extern unsigned ppu_addr_bus;
+extern THREAD_LOCAL unsigned ppu_addr_bus;
 
 void init_ppu_for_rom();
 
-// These use different timings corresponding to the TV standard
-void tick_ntsc_ppu();
-void tick_pal_ppu();
+// Runs the PPU for 'n' dots. Points to a version of the PPU loop specialized
+// for the TV standard and for the mapper's PPU hooks, picked by
+// init_ppu_for_rom().
+extern THREAD_LOCAL void (*run_ppu_dots)(unsigned n);
+
+// Catch-up mode. Rather than having tick() run the PPU dot by dot, the dots
+// are tallied in ppu_dots_owed and only run when something could observe the
+// PPU: an access to $2000-$2007 or OAM DMA, a CHR bank or mirroring change, a
+// state transfer, a reset, or a dot that signals the CPU (frame completion and
+// the VBlank NMI). sync_ppu() posts events (see scheduler.h) that run it for
+// the cycles where the owed dots reach lower bounds on the number of dots
+// until the next such dots. For mappers that snoop on the PPU each dot, the
+// mapper's event is posted for each CPU cycle. MMC3 is an exception: the dots
+// where its IRQ counter could be clocked are predicted, and the mapper's event
+// is posted for those.
+//
+// Without CATCH_UP_PPU, tick() runs the PPU each CPU cycle. That's the
+// reference for catch-up mode, which should give identical results.
+#ifdef CATCH_UP_PPU
+extern THREAD_LOCAL unsigned ppu_dots_owed;
+
+// Runs the owed dots
+void sync_ppu();
+#else
+inline void sync_ppu() {}
+#endif
 
 // n = 0...7 corresponds to $2000-$2007
 uint8_t read_ppu_reg(unsigned n);
@@ -1,33 +1,77 @@
 // Loading and unloading of ROM files
 
 // Points to the start of the PRG data within the ROM image
-extern uint8_t *prg_base;
-extern unsigned prg_16k_banks;
+extern THREAD_LOCAL uint8_t *prg_base;
+extern THREAD_LOCAL unsigned prg_16k_banks;
 
 // Points to the start of the CHR data within the ROM image, or to a
 // dynamically allocated buffer if the cart uses RAM for CHR
-extern uint8_t *chr_base;
-extern unsigned chr_8k_banks;
-extern bool chr_is_ram;
+extern THREAD_LOCAL uint8_t *chr_base;
+extern THREAD_LOCAL unsigned chr_8k_banks;
+extern THREAD_LOCAL bool chr_is_ram;
 
 // Points to a dynamically allocated buffer for SRAM/WRAM. We usually have to
 // assume the cart has SRAM/WRAM due to iNES ickiness.
-extern uint8_t *wram_base;
-extern unsigned wram_8k_banks;
+extern THREAD_LOCAL uint8_t *wram_base;
+extern THREAD_LOCAL unsigned wram_8k_banks;
 
 // True if this is a PAL ROM
-extern bool is_pal;
+extern THREAD_LOCAL bool is_pal;
 
 // If true, the mapper has bus conflicts and does not shut off ROM output for
 // writes to the $8000+ range. This results in an AND between the written value
 // and the value in ROM. Cybernoid depends on this being emulated.
-extern bool has_bus_conflicts;
+extern THREAD_LOCAL bool has_bus_conflicts;
 
-extern Mapper_fns mapper_fns;
+extern THREAD_LOCAL Mapper_fns mapper_fns;
+
+// Filename the ROM was loaded from
+extern THREAD_LOCAL char *rom_filename;
+// iNES mapper number
+extern THREAD_LOCAL unsigned mapper_nr;
+// MD5 digest of the PRG ROM. Identifies the game.
+extern THREAD_LOCAL uint8_t prg_md5[16];
 
 // Loads a ROM file. If 'print_info' is true, information about the cart is
 // printed to stdout.
 void load_rom(char const *filename, bool print_info);
 
-// Frees resources associated with the ROM
+// Loads the 'size'-byte ROM image 'buf', read from 'filename'. Returns an error
+// message if the image can't be loaded, or null if successful, in which case
+// the console takes over 'buf'. load_rom() above exits on the same errors.
+char const *load_rom(char const *filename, uint8_t *buf, size_t size,
+                     bool print_info);
+
+// A reference to the ROM image of a console. Lets the same ROM be loaded into
+// another console without reading the file again (see fork_emulator()). The
+// image is never written after loading, so the consoles share it, even across
+// threads.
+struct Rom_ref {
+    uint8_t    *buf;
+    size_t      size;
+    unsigned   *refs;
+    char const *filename;
+};
+
+// Returns a new reference to the ROM image of the active console. The console
+// must not be unloaded before the reference is passed to load_rom(), as
+// 'filename' belongs to it.
+Rom_ref ref_rom();
+
+// Loads the ROM image in 'ref' into the console, taking over the reference
+void load_rom(Rom_ref const &ref, bool print_info);
+
+// Puts the cart back in the state it was loaded in: the mapper is
+// reinitialized, and WRAM, CHR RAM, and nametable memory are cleared.
+// power_on() leaves the cart alone, much like how battery-backed WRAM keeps
+// its contents across power cycles on real hardware.
+void reset_cart();
+
+// Frees resources associated with the ROM. The ROM image is freed along with
+// the last reference to it.
 void unload_rom();
+
+// Transfers the ROM information above along with the pointers to the buffers
+// allocated for the ROM. Used to switch between consoles (see emulator.h).
+template<bool calculating_size, bool is_save>
+void transfer_rom_context(uint8_t *&buf);
@@ -3,9 +3,108 @@
 void init_save_states_for_rom();
 void deinit_save_states_for_rom();
 
-// Plain old save state. Not related to rewinding.
-void save_state();
-void load_state();
+// Saves the state of the entire system to or loads it from 'buf'. Returns the
+// size of the state in bytes. Passing <true, false> only calculates the size.
+//
+// This always copies all of the state and leaves the dirty-page tracking
+// below alone, which is what restoring a console saved with save_snapshot()
+// together with its context needs. Use load_snapshot() to load other states.
+template<bool calculating_size, bool is_save>
+size_t transfer_system_state(uint8_t *buf);
+
+//
+// Dirty-page tracking
+//
+// The large memory regions in the save state (CPU RAM, WRAM, CHR RAM, and
+// CIRAM) are split into 256-byte pages. Writes mark the page as dirty in a
+// per-region bitmap. Each snapshot gets an ID and clears the bitmaps,
+// remembering for each page the last snapshot in which it was dirty. A buffer
+// that holds an earlier snapshot of the same console can then be brought up
+// to date by copying just the pages written since, and vice versa.
+//
+// Zero page and the stack are written too often to be worth tracking. Their
+// pages are always treated as dirty.
+//
+
+enum Dirty_region {
+    DIRTY_RAM,
+    DIRTY_WRAM,
+    DIRTY_CHR_RAM,
+    DIRTY_CIRAM,
+    N_DIRTY_REGIONS
+};
+
+unsigned const dirty_page_shift = 8;
+unsigned const dirty_page_size  = 1 << dirty_page_shift;
+
+struct Dirty_pages {
+    // Bit n%64 of bits[n/64] is set if page n has been written since the last
+    // snapshot
+    uint64_t *bits;
+    // ID of the last snapshot taken while page n was dirty, or 0 if none
+    uint64_t *last_dirty;
+    size_t    n_pages;
+    // Offset of the region within the save state. Set when calculating the
+    // state size.
+    size_t    state_offset;
+};
+
+extern THREAD_LOCAL Dirty_pages dirty_pages[N_DIRTY_REGIONS];
+
+// Marks the page containing byte 'offset' of 'region' as dirty
+inline void mark_page_dirty(Dirty_region region, size_t offset) {
+    size_t const page = offset >> dirty_page_shift;
+    dirty_pages[region].bits[page/64] |= UINT64_C(1) << (page%64);
+}
+
+// Marks all pages as dirty. Used when memory is initialized.
+void mark_all_pages_dirty();
+
+// Returns the bitmap of pages in 'region' written since the last snapshot (in
+// the format of Dirty_pages::bits), and the number of pages in 'n_pages'
+uint64_t const *get_dirty_pages(Dirty_region region, size_t &n_pages);
+
+// Transfers 'len' bytes at 'mem' (one of the regions) like TRANSFER_P(),
+// copying only the needed pages in save_snapshot() and load_snapshot()
+template<bool calculating_size, bool is_save>
+void transfer_pages(uint8_t *mem, size_t len, Dirty_region region, uint8_t *&buf);
+
+#define TRANSFER_PAGES(x, len, region) \
+  transfer_pages<calculating_size, is_save>(x, len, region, buf);
+
+// Saves a snapshot of the system to 'buf', which holds the snapshot with ID
+// 'buf_id', or anything if 'buf_id' is 0. Returns the ID of the new snapshot.
+uint64_t save_snapshot(uint8_t *buf, uint64_t buf_id);
+
+// Loads the snapshot with ID 'buf_id' from 'buf'. 'buf_id' must have been
+// returned by save_snapshot() for the current console, or be 0 if unknown, in
+// which case all of the state is loaded.
+void load_snapshot(uint8_t *buf, uint64_t buf_id);
+
+// Transfers the save state and rewind buffers. Used to switch between consoles
+// (see emulator.h).
+template<bool calculating_size, bool is_save>
+void transfer_save_states_context(uint8_t *&buf);
+
+// Plain old save states, saved to files (see save_states.cpp for the format).
+// Not related to rewinding. On failure, these print a message and return
+// false.
+bool save_state_file(char const *filename);
+bool load_state_file(char const *filename);
+
+// Same as above, but with the save state file in memory. Used to embed states
+// in input movies (see input_movie.h). save_state_to_buf() returns the file in
+// a new buffer that is freed by the caller, or null on failure.
+// load_state_from_buf() returns an error message, or null if successful, and
+// prints nothing.
+uint8_t *save_state_to_buf(size_t &size);
+char const *load_state_from_buf(uint8_t const *buf, size_t size);
+
+// Numbered save state slots. Slot n for a ROM is stored in
+// "<ROM filename>.state<n>".
+unsigned const n_state_slots = 10;
+bool save_state(unsigned slot);
+bool load_state(unsigned slot);
 
 #ifdef INCLUDE_REWIND
 // Called once per frame to implementing rewinding. If 'do_rewind' is true, we
@@ -21,7 +120,7 @@ unsigned get_frame_len();
 #ifdef INCLUDE_REWIND
 // True if the current frame should appear to run in reverse (e.g., w.r.t.
 // audio)
-extern bool is_backwards_frame;
+extern THREAD_LOCAL bool is_backwards_frame;
 #else
 #define is_backwards_frame 0
 #endif
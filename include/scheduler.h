@@ -0,0 +1,98 @@
+// Timestamped events. Everything that has to happen at a particular CPU cycle
+// and that tick() or the CPU loop would otherwise have to check for each
+// cycle or instruction is posted here with the cycle (a 'cpu_cycle' value) it
+// is due on. This includes interrupt delivery, frame ends, OAM DMA, resets,
+// and the deadlines by which the catch-up modes have to sync the PPU and APU
+// to see the dots and cycles that signal the CPU (see ppu.h and apu.h): the
+// VBlank NMI, the frame counter and DMC IRQs, DMC DMA, and the mapper's view
+// of the PPU. tick() and the CPU loop then only compare 'cpu_cycle' against
+// the earliest due cycle.
+//
+// There are only a few kinds of events, each scheduled at most once, so this
+// is a fixed table with one slot per kind rather than a general event queue.
+// Scheduling an event again moves it.
+//
+// There are two kinds of events:
+//
+//  - Sync events, handled at the end of the tick() for their cycle. An event
+//    scheduled for a cycle that has already passed is handled at the next
+//    tick(). Sync events due on the same cycle are handled in the order they
+//    are listed below.
+//
+//  - CPU events, handled by the CPU at the first instruction boundary where
+//    'cpu_cycle' has reached their cycle. All the CPU events that are due are
+//    handled there, in the order they are listed below rather than in cycle
+//    order, which gives the order the hardware does things in at the end of
+//    an instruction (e.g. OAM DMA before an interrupt that was polled before
+//    the $4014 write).
+//
+// The events belong to the console (see emulator.h).
+
+enum Event {
+    // Sync events. These run sync_ppu() and sync_apu() in the catch-up modes.
+
+    // 240:0, where the PPU completes the frame (see EVENT_FRAME_END)
+    EVENT_PPU_FRAME_END,
+    // 241:1, where the PPU sets the VBlank flag and might assert NMI
+    EVENT_PPU_VBLANK,
+    // The next dot where the mapper could clock its IRQ counter from the PPU
+    // address bus (MMC3), or every cycle for mappers that snoop on the PPU
+    EVENT_MAPPER_SYNC,
+    // The cycle where the APU frame counter sets the frame IRQ
+    EVENT_FRAME_IRQ,
+    // The cycle where the DMC fetches its next sample byte. That stalls the
+    // CPU and might set the DMC IRQ.
+    EVENT_DMC_DMA,
+    // Each cycle while a DMC sample fetch is in progress
+    EVENT_APU_SYNC,
+
+    // CPU events
+
+    // A write to $4014 starts OAM DMA
+    EVENT_OAM_DMA,
+    // Interrupt polling (see poll_for_interrupt()) detected NMI or IRQ. The
+    // next "instruction" executed is the interrupt sequence.
+    EVENT_NMI,
+    EVENT_IRQ,
+    // The PPU completed a frame. Presents the frame and the audio, reads
+    // input, etc.
+    EVENT_FRAME_END,
+    // Soft reset, including the delayed resets test ROMs ask for
+    EVENT_RESET,
+    // Just makes the CPU check dbg_attached()
+    EVENT_DEBUGGER_ATTACHMENT,
+    // Makes the CPU loop return. Kept last so that everything else that is due
+    // is handled first.
+    EVENT_END_EMULATION,
+
+    N_EVENTS
+};
+
+// First CPU event. The events before it are sync events.
+Event const FIRST_CPU_EVENT = EVENT_OAM_DMA;
+
+// Cycle of the earliest scheduled sync event, or UINT64_MAX if there are none
+extern THREAD_LOCAL uint64_t next_event_cycle;
+
+// Cycle of the earliest scheduled CPU event, or UINT64_MAX if there are none
+extern THREAD_LOCAL uint64_t next_cpu_event_cycle;
+
+// Schedules 'event' for 'cycle', replacing any earlier scheduling of it
+void schedule_event(Event event, uint64_t cycle);
+void cancel_event(Event event);
+
+// Returns the cycle 'event' is scheduled for, or UINT64_MAX if it isn't
+uint64_t event_cycle(Event event);
+
+// Handles the sync events due by 'cpu_cycle'. Called from tick().
+void run_due_events();
+
+// Returns the first CPU event in the order above that is due by 'cpu_cycle',
+// or N_EVENTS if there is none. The CPU cancels it and handles it.
+Event first_due_cpu_event();
+
+// Cancels all events. Used at power-on, when 'cpu_cycle' starts over.
+void clear_events();
+
+template<bool calculating_size, bool is_save>
+void transfer_scheduler_context(uint8_t *&buf);
@@ -1,6 +1,8 @@
 // vi:sw=2
 // Video, audio, and input backend. Uses SDL2.
 
+#include "backend.h"
+
 #include <SDL.h>
 
 void init_sdl();
@@ -12,42 +14,6 @@ void sdl_thread();
 // Called from the emulation thread to cause the SDL thread to exit
 void exit_sdl_thread();
 
-// Video
-
-void put_pixel(int x, unsigned y, uint32_t color);
-void draw_frame();
-
-// Audio
-
-int const sample_rate = 44100;
-
-// Protect the audio buffer from concurrent access by the emulation thread and
-// SDL
-void lock_audio();
-void unlock_audio();
-
-// Stop and start audio playback in SDL, returns old state.
-int audio_pause(bool value);
-
-// Input and events
-
-enum game_inputs {
-  I_A,
-  I_B,
-  I_SELECT,
-  I_START,
-  I_UP,
-  I_DOWN,
-  I_LEFT,
-  I_RIGHT,
-  I_COUNT,
-};
-
-enum global_inputs {
-  IG_RESET,
-  IG_COUNT,
-};
-
 enum debug_inputs {
   ID_TOGGLE,
   ID_TOGGLE_NOINPUT,
@@ -69,12 +35,8 @@ enum debug_inputs {
   ID_COUNT,
 };
 
-extern bool controller_inputs[4][I_COUNT];
-extern bool global_inputs[IG_COUNT];
 extern bool debug_inputs[ID_COUNT];
 
-void handle_ui_keys();
-
 extern SDL_mutex *event_lock;
 //extern Uint8 const *keys;
 
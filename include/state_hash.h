@@ -0,0 +1,34 @@
+// Digests of the console state, for checking that runs are deterministic and
+// that replays (e.g. of an input movie on a different build) stay in sync.
+// The digest covers the entire save state: CPU registers and RAM, PPU
+// registers, OAM, palettes, and nametables, the APU, the mapper, etc.
+//
+// The large memory regions are hashed per 256-byte page, and only pages
+// written since the last digest are rehashed (see the dirty-page tracking in
+// save_states.h), so taking a digest every frame is cheap. The hash is fast
+// and not cryptographic.
+//
+// The hashing state belongs to the console (see emulator.h).
+
+void init_state_hash_for_rom();
+
+// Returns a digest of the current state of the console. Needs
+// start_state_hashing() to have been called.
+uint64_t state_digest();
+
+// Starts hashing the state at the end of every frame. If 'log_filename' is
+// non-null, the digests are written to it, one per line as 16 hex digits. If
+// 'ref_filename' is non-null, the digests are compared against the ones in
+// it, in the same format, and emulation ends at the first frame that differs.
+void start_state_hashing(char const *log_filename, char const *ref_filename);
+
+// Stops hashing. Returns false if the state diverged from the reference.
+bool stop_state_hashing();
+
+extern THREAD_LOCAL bool hashing_frames;
+
+// Called at the end of each frame while 'hashing_frames' is set
+void hash_frame_state();
+
+template<bool calculating_size, bool is_save>
+void transfer_state_hash_context(uint8_t *&buf);
@@ -1,13 +1,24 @@
-extern double cpu_clock_rate;
-extern double ppu_clock_rate;
-extern double ppu_fps;
+extern THREAD_LOCAL double cpu_clock_rate;
+extern THREAD_LOCAL double ppu_clock_rate;
+extern THREAD_LOCAL double ppu_fps;
 
 void init_timing();
 void init_timing_for_rom();
 
+// Returns the time in seconds from a monotonic clock. For measuring how long
+// things take.
+double get_seconds();
+
 // Sleeps until the end of the frame if we manage to emulate it faster than
 // realtime (which should hopefully be the case)
 void sleep_till_end_of_frame();
 
+// Emulation speed as a multiple of the normal speed, with 0 meaning unlimited
+// (no frame pacing). Values other than 1 are used for fast-forwarding. Set on
+// the emulation thread. The rendering thread reads it with __atomic_load_n().
+extern unsigned speed_multiplier;
+// Speed used while fast-forwarding (2, 4, or 0)
+extern unsigned fast_forward_speed;
+
 // Hack to get a C++03 compile-time constant
 unsigned const pal_milliframes_per_second = 50007;
@@ -6,11 +6,12 @@
 #include "mapper.h"
 #include "ppu.h"
 #include "rom.h"
+#include "scheduler.h"
 
 // Clock used by the APU and DMA circuitry, parts of which tick at half the CPU
 // frequency. Whether the initial tick is high or low seems to be random. The
 // name apu_clk1 is from Visual 2A03.
-static bool apu_clk1_is_high;
+static THREAD_LOCAL bool apu_clk1_is_high;
 
 //
 // OAM (sprite data) DMA
@@ -19,7 +20,7 @@ static bool apu_clk1_is_high;
 
 // Current OAM DMA state. Needed to get the timing for APU DMC sample loading
 // right (tested by the sprdma_and_dmc_dma tests).
-static enum OAM_DMA_state {
+static THREAD_LOCAL enum OAM_DMA_state {
     OAM_DMA_IN_PROGRESS = 0,
     OAM_DMA_IN_PROGRESS_3RD_TO_LAST_TICK,
     OAM_DMA_IN_PROGRESS_LAST_TICK,
@@ -27,6 +28,8 @@ static enum OAM_DMA_state {
 } oam_dma_state;
 
 void do_oam_dma(uint8_t addr) {
+    sync_apu();
+
     // We get either WDTTT... or WDDTTT... where W is the write cycle, D a
     // dummy cycle, and T a transfer cycle (there's 512 of them). The extra
     // dummy cycle occurs if the write cycle has apu_clk1 low.
@@ -66,10 +69,22 @@ void do_oam_dma(uint8_t addr) {
 
 // Set when the output level of any channel changes. Lets us skip the mixing
 // step most of the time.
-static bool channel_updated;
+static THREAD_LOCAL bool channel_updated;
 
 void begin_audio_frame() { channel_updated = true; }
 
+#ifdef CATCH_UP_APU
+// Position within the frame (see frame_offset) of the cycle being run by
+// tick_apu(), which lags behind frame_offset by the owed cycles
+static THREAD_LOCAL unsigned apu_time;
+
+// Called after anything that might move the next cycle that signals the CPU
+static void schedule_apu_sync();
+static void schedule_apu_sync_in(unsigned n);
+#else
+static void schedule_apu_sync() {}
+#endif
+
 // Length counter look-up table
 uint8_t const len_table[] = {
   10, 254, 20,  2, 40,  4, 80,  6, 160,  8, 60, 10, 14, 12, 26, 14,
@@ -79,7 +94,7 @@ uint8_t const len_table[] = {
 // Pulse channels
 //
 
-static struct Pulse {
+static THREAD_LOCAL struct Pulse {
     // Range 0-15
     // (Potentially) affected by
     //   - volume updates,
@@ -147,6 +162,8 @@ static void update_pulse_output_level(unsigned n) {
 }
 
 void write_pulse_reg_0(unsigned n, uint8_t val) {
+    sync_apu();
+
     pulse[n].duty              = val >> 6;
     pulse[n].halt_len_loop_env = val & 0x20;
     pulse[n].const_vol         = val & 0x10;
@@ -156,6 +173,8 @@ void write_pulse_reg_0(unsigned n, uint8_t val) {
 }
 
 void write_pulse_reg_1(unsigned n, uint8_t val) {
+    sync_apu();
+
     pulse[n].sweep_enabled = val & 0x80;
     pulse[n].sweep_period  = (val >> 4) & 7;
     pulse[n].sweep_negate  = val & 8;
@@ -168,6 +187,8 @@ void write_pulse_reg_1(unsigned n, uint8_t val) {
 }
 
 void write_pulse_reg_2(unsigned n, uint8_t val) {
+    sync_apu();
+
     pulse[n].period = (pulse[n].period & ~0x0FF) | val;
 
     update_sweep_target_period(n);
@@ -175,6 +196,8 @@ void write_pulse_reg_2(unsigned n, uint8_t val) {
 }
 
 void write_pulse_reg_3(unsigned n, uint8_t val) {
+    sync_apu();
+
     if (pulse[n].enabled)
         pulse[n].len_cnt = len_table[val >> 3];
     pulse[n].period = (pulse[n].period & ~0x700) | ((val & 7) << 8);
@@ -202,32 +225,38 @@ static void clock_pulse_generator(unsigned n) {
 
 // Range 0-15, premultiplied by 3 for mixing. Affected only by waveform
 // position updates.
-static unsigned tri_output_level;
+static THREAD_LOCAL unsigned tri_output_level;
 
-static bool     tri_enabled;
+static THREAD_LOCAL bool     tri_enabled;
 
-static unsigned tri_period;
-static unsigned tri_period_cnt;
+static THREAD_LOCAL unsigned tri_period;
+static THREAD_LOCAL unsigned tri_period_cnt;
 
-static unsigned tri_waveform_pos;
+static THREAD_LOCAL unsigned tri_waveform_pos;
 
-static unsigned tri_len_cnt;
-static bool     tri_halt_flag;
+static THREAD_LOCAL unsigned tri_len_cnt;
+static THREAD_LOCAL bool     tri_halt_flag;
 
-static unsigned tri_lin_cnt_load;
-static unsigned tri_lin_cnt;
-static bool     tri_lin_cnt_reload_flag;
+static THREAD_LOCAL unsigned tri_lin_cnt_load;
+static THREAD_LOCAL unsigned tri_lin_cnt;
+static THREAD_LOCAL bool     tri_lin_cnt_reload_flag;
 
 void write_triangle_reg_0(uint8_t val) {
+    sync_apu();
+
     tri_halt_flag    = val & 0x80;
     tri_lin_cnt_load = val & 0x7F;
 }
 
 void write_triangle_reg_1(uint8_t val) {
+    sync_apu();
+
     tri_period = (tri_period & ~0x0FF) | val;
 }
 
 void write_triangle_reg_2(uint8_t val) {
+    sync_apu();
+
     tri_lin_cnt_reload_flag = true;
     if (tri_enabled)
         tri_len_cnt = len_table[val >> 3];
@@ -264,21 +293,21 @@ static void clock_triangle_generator() {
 //   - volume updates,
 //   - Length counter updates,
 //   - and shift reg value
-static unsigned noise_output_level;
-
-static bool     noise_enabled;
-
-static bool     noise_halt_len_loop_env;
-static bool     noise_const_vol;
-static unsigned noise_vol;
-static unsigned noise_feedback_bit;
-static unsigned noise_period;
-static unsigned noise_period_cnt;
-static unsigned noise_len_cnt;
-static unsigned noise_shift_reg;
-static bool     noise_env_start_flag;
-static unsigned noise_env_vol;
-static unsigned noise_env_div_cnt;
+static THREAD_LOCAL unsigned noise_output_level;
+
+static THREAD_LOCAL bool     noise_enabled;
+
+static THREAD_LOCAL bool     noise_halt_len_loop_env;
+static THREAD_LOCAL bool     noise_const_vol;
+static THREAD_LOCAL unsigned noise_vol;
+static THREAD_LOCAL unsigned noise_feedback_bit;
+static THREAD_LOCAL unsigned noise_period;
+static THREAD_LOCAL unsigned noise_period_cnt;
+static THREAD_LOCAL unsigned noise_len_cnt;
+static THREAD_LOCAL unsigned noise_shift_reg;
+static THREAD_LOCAL bool     noise_env_start_flag;
+static THREAD_LOCAL unsigned noise_env_vol;
+static THREAD_LOCAL unsigned noise_env_div_cnt;
 
 static void update_noise_output_level() {
     unsigned const prev_output_level = noise_output_level;
@@ -294,6 +323,8 @@ static void update_noise_output_level() {
 
 // $400C
 void write_noise_reg_0(uint8_t val) {
+    sync_apu();
+
     noise_halt_len_loop_env = val & 0x20;
     noise_const_vol         = val & 0x10;
     noise_vol               = val & 0x0F;
@@ -305,16 +336,20 @@ uint16_t const ntsc_noise_periods[] =
   { 4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068 };
 uint16_t const pal_noise_periods[]  =
   { 4, 8, 14, 30, 60, 88, 118, 148, 188, 236, 354, 472, 708,  944, 1890, 3778 };
-static uint16_t const *noise_periods;
+static THREAD_LOCAL uint16_t const *noise_periods;
 
 // $400E
 void write_noise_reg_1(uint8_t val) {
+    sync_apu();
+
     noise_feedback_bit = (val & 0x80) ? 6 : 1;
     noise_period       = noise_periods[val & 0x0F];
 }
 
 // $400F
 void write_noise_reg_2(uint8_t val) {
+    sync_apu();
+
     if (noise_enabled) {
         noise_len_cnt = len_table[val >> 3];
         update_noise_output_level();
@@ -322,10 +357,14 @@ void write_noise_reg_2(uint8_t val) {
     noise_env_start_flag = true;
 }
 
-static void clock_noise_generator() {
+static void step_noise_shift_reg() {
     // Only the lowest bit from 'feedback' is used
     unsigned const feedback = (noise_shift_reg >> noise_feedback_bit) ^ noise_shift_reg;
     noise_shift_reg = (feedback << 14) | (noise_shift_reg >> 1);
+}
+
+static void clock_noise_generator() {
+    step_noise_shift_reg();
     update_noise_output_level();
 }
 
@@ -335,52 +374,58 @@ static void clock_noise_generator() {
 
 // Range 0-127
 // Counter value directly determines output level
-static unsigned dmc_counter;
+static THREAD_LOCAL unsigned dmc_counter;
 
 // Set by the last sample byte being loaded, unless inhibited or looping is set
 // Cleared by
 //  * the reset signal,
 //  * writing $4015,
 //  * and clearing the IRQ enable flag in $4010
-bool            dmc_irq;
+THREAD_LOCAL bool            dmc_irq;
 // $4010
-static bool     dmc_irq_enabled;
-static bool     dmc_loop_sample;
-static unsigned dmc_period;
-static unsigned dmc_period_cnt;
+static THREAD_LOCAL bool     dmc_irq_enabled;
+static THREAD_LOCAL bool     dmc_loop_sample;
+static THREAD_LOCAL unsigned dmc_period;
+static THREAD_LOCAL unsigned dmc_period_cnt;
 
 // $4012, missing the implied "| 0x8000" that puts it into ROM
-static unsigned dmc_sample_start_addr;
+static THREAD_LOCAL unsigned dmc_sample_start_addr;
 // $4013
-static unsigned dmc_sample_len;
+static THREAD_LOCAL unsigned dmc_sample_len;
 
-static uint8_t  dmc_sample_buffer;
-static bool     dmc_sample_buffer_has_data;
-static uint8_t  dmc_shift_reg;
-static bool     dpcm_active;
+static THREAD_LOCAL uint8_t  dmc_sample_buffer;
+static THREAD_LOCAL bool     dmc_sample_buffer_has_data;
+static THREAD_LOCAL uint8_t  dmc_shift_reg;
+static THREAD_LOCAL bool     dpcm_active;
 
 // True while a sample byte is being loaded, to prevent recursion in
 // load_dmc_sample_byte(). This also mirrors how the hardware behaves.
-static bool     dmc_loading_sample_byte;
+static THREAD_LOCAL bool     dmc_loading_sample_byte;
 
-static unsigned dmc_sample_cur_addr; // 15 bits wide
-static unsigned dmc_bytes_remaining;
-static unsigned dmc_bits_remaining;
+static THREAD_LOCAL unsigned dmc_sample_cur_addr; // 15 bits wide
+static THREAD_LOCAL unsigned dmc_bytes_remaining;
+static THREAD_LOCAL unsigned dmc_bits_remaining;
 
 uint16_t const ntsc_dmc_periods[] =
  { 428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106,  84,  72,  54 };
 uint16_t const pal_dmc_periods[] =
  { 398, 354, 316, 298, 276, 236, 210, 198, 176, 148, 132, 118,  98,  78,  66,  50 };
-static uint16_t const *dmc_periods;
+static THREAD_LOCAL uint16_t const *dmc_periods;
 
 void write_dmc_reg_0(uint8_t val) {
+    sync_apu();
+
     if (!(dmc_irq_enabled = val & 0x80))
         set_dmc_irq(false);
     dmc_loop_sample = val & 0x40;
     dmc_period      = dmc_periods[val & 0x0F];
+
+    schedule_apu_sync();
 }
 
 void write_dmc_reg_1(uint8_t val) {
+    sync_apu();
+
     unsigned const old_dmc_counter = dmc_counter;
 
     dmc_counter = val & 0x7F;
@@ -390,10 +435,14 @@ void write_dmc_reg_1(uint8_t val) {
 }
 
 void write_dmc_reg_2(uint8_t val) {
+    sync_apu();
+
     dmc_sample_start_addr = 0x4000 | (val << 6);
 }
 
 void write_dmc_reg_3(uint8_t val) {
+    sync_apu();
+
     dmc_sample_len = (val << 4) + 1;
 }
 
@@ -418,6 +467,11 @@ static void load_dmc_sample_byte() {
     // cpu_data_bus = dmc_sample_buffer;
 
     dmc_loading_sample_byte = true;
+#ifdef CATCH_UP_APU
+    // Run the APU along with the stalled CPU during the fetch, the same as
+    // when running cycle by cycle
+    schedule_apu_sync_in(1);
+#endif
     unsigned const delay =
       (oam_dma_state != OAM_DMA_NOT_IN_PROGRESS) ?
         oam_dma_delay[oam_dma_state] :
@@ -438,6 +492,8 @@ static void load_dmc_sample_byte() {
             if (dmc_irq_enabled)
                 set_dmc_irq(true);
     }
+
+    schedule_apu_sync();
 }
 
 static void clock_dmc() {
@@ -477,13 +533,13 @@ static void clock_dmc() {
 //  * the reset signal,
 //  * setting the inhibit IRQ flag,
 //  * and reading $4015
-bool        frame_irq;
+THREAD_LOCAL bool        frame_irq;
 
-static enum Frame_counter_mode { FOUR_STEP = 0, FIVE_STEP = 1 } frame_counter_mode;
-static bool inhibit_frame_irq;
-static unsigned frame_counter_clock;
+static THREAD_LOCAL enum Frame_counter_mode { FOUR_STEP = 0, FIVE_STEP = 1 } frame_counter_mode;
+static THREAD_LOCAL bool inhibit_frame_irq;
+static THREAD_LOCAL unsigned frame_counter_clock;
 
-static unsigned delayed_frame_timer_reset;
+static THREAD_LOCAL unsigned delayed_frame_timer_reset;
 
 // Quarter frame
 static void clock_env_and_tri_lin() {
@@ -582,6 +638,8 @@ static void clock_len_and_sweep() {
 }
 
 void write_frame_counter(uint8_t val) {
+    sync_apu();
+
     frame_counter_mode = (Frame_counter_mode)(val >> 7);
     if ((inhibit_frame_irq = val & 0x40))
         set_frame_irq(false);
@@ -595,6 +653,8 @@ void write_frame_counter(uint8_t val) {
         clock_env_and_tri_lin();
         clock_len_and_sweep();
     }
+
+    schedule_apu_sync();
 }
 
 // The frame IRQ is set during three consecutive CPU ticks at the end of the
@@ -670,14 +730,63 @@ static void clock_frame_counter_generic() {
     }
 }
 
-// Points to the correct instantiated version for NTSC/PAL
-static void (*clock_frame_counter)();
+#ifdef CATCH_UP_APU
+
+// Returns the number of cycles until the next cycle on which
+// clock_frame_counter() does something besides incrementing
+// frame_counter_clock, or, if 'irq_only' is true, until the next cycle on
+// which it sets the frame IRQ. Returns UINT_MAX if there is no such cycle.
+template<unsigned T1, unsigned T2, unsigned T3, unsigned T4, unsigned T5>
+static unsigned frame_counter_cycles_till_generic(bool irq_only) {
+    // Cycle by cycle while a reset is pending
+    if (delayed_frame_timer_reset > 0)
+        return 1;
+
+    unsigned const clock = frame_counter_clock;
+
+    if (frame_counter_mode == FOUR_STEP) {
+        if (irq_only && inhibit_frame_irq)
+            return UINT_MAX;
+        if (!irq_only) {
+            if (clock < T1 + 1) return T1 + 1 - clock;
+            if (clock < T2 + 1) return T2 + 1 - clock;
+            if (clock < T3 + 1) return T3 + 1 - clock;
+        }
+        if (clock < T4) return T4 - clock;
+        // T4 + 1 and the wraparound at T4 + 2
+        if (clock < T4 + 2) return 1;
+    }
+    else {
+        if (irq_only)
+            return UINT_MAX;
+        if (clock < T1 + 1) return T1 + 1 - clock;
+        if (clock < T2 + 1) return T2 + 1 - clock;
+        if (clock < T3 + 1) return T3 + 1 - clock;
+        if (clock < T5 + 1) return T5 + 1 - clock;
+        // The wraparound at T5 + 2
+        if (clock < T5 + 2) return 1;
+    }
+
+    // Past the wraparound point (after a switch from five-step mode), where
+    // the counter just keeps counting
+    return UINT_MAX;
+}
+
+#endif
+
+// Point to the correct instantiated versions for NTSC/PAL
+static THREAD_LOCAL void (*clock_frame_counter)();
+#ifdef CATCH_UP_APU
+static THREAD_LOCAL unsigned (*frame_counter_cycles_till)(bool irq_only);
+#endif
 
 //
 // Status
 //
 
 uint8_t read_apu_status() {
+    sync_apu();
+
     uint8_t const res =
       (dmc_irq                   << 7) |
       (frame_irq                 << 6) |
@@ -694,6 +803,8 @@ uint8_t read_apu_status() {
 }
 
 void write_apu_status(uint8_t val) {
+    sync_apu();
+
     for (unsigned n = 0; n < 2; ++n) {
         if (!(pulse[n].enabled = val & (1 << n))) {
             pulse[n].len_cnt = 0;
@@ -726,6 +837,8 @@ void write_apu_status(uint8_t val) {
                 load_dmc_sample_byte();
         }
     }
+
+    schedule_apu_sync();
 }
 
 //
@@ -737,6 +850,15 @@ void write_apu_status(uint8_t val) {
 static float pulse_mixer_table[31];
 static float tri_noi_dmc_mixer_table[203];
 
+#ifdef FAST_TRI_NOISE_AUDIO
+// Pulse and DMC levels as of the last mixing. Level changes that come from
+// the triangle and noise channels alone are synthesized with the cheaper
+// method. Those channels change the most often (the noise channel up to every
+// few cycles), and the extra aliasing is hard to hear on them.
+static THREAD_LOCAL unsigned mixed_pulse_level;
+static THREAD_LOCAL unsigned mixed_dmc_counter;
+#endif
+
 void init_apu() {
     // http://wiki.nesdev.com/w/index.php/APU_Mixer
 
@@ -761,6 +883,10 @@ void init_apu_for_rom() {
     if (is_pal) {
         clock_frame_counter =
           clock_frame_counter_generic<2*4156, 2*8313, 2*12469, 2*16626, 2*20782>;
+#ifdef CATCH_UP_APU
+        frame_counter_cycles_till =
+          frame_counter_cycles_till_generic<2*4156, 2*8313, 2*12469, 2*16626, 2*20782>;
+#endif
 
         dmc_periods         = pal_dmc_periods;
         noise_periods       = pal_noise_periods;
@@ -768,6 +894,10 @@ void init_apu_for_rom() {
     else {
         clock_frame_counter =
           clock_frame_counter_generic<2*3728, 2*7456, 2*11185, 2*14914, 2*18640>;
+#ifdef CATCH_UP_APU
+        frame_counter_cycles_till =
+          frame_counter_cycles_till_generic<2*3728, 2*7456, 2*11185, 2*14914, 2*18640>;
+#endif
 
         dmc_periods         = ntsc_dmc_periods;
         noise_periods       = ntsc_noise_periods;
@@ -821,24 +951,198 @@ void tick_apu() {
     //
 
     if (channel_updated) {
+        unsigned const pulse_level = pulse[0].output_level + pulse[1].output_level;
         // Possible optimization: Could use integer math and prebias here
         int const signal_level =
           INT16_MIN +
-            (pulse_mixer_table[pulse[0].output_level + pulse[1].output_level] +
+            (pulse_mixer_table[pulse_level] +
              tri_noi_dmc_mixer_table[tri_output_level + noise_output_level +
                                      dmc_counter])*(INT16_MAX - INT16_MIN);
         assert(signal_level <= INT16_MAX);
-        set_audio_signal_level(signal_level);
+
+#ifdef FAST_TRI_NOISE_AUDIO
+        // If the pulse and DMC levels are unchanged, the change came from the
+        // triangle and noise channels alone
+        bool const fast = pulse_level == mixed_pulse_level &&
+                          dmc_counter == mixed_dmc_counter;
+        mixed_pulse_level = pulse_level;
+        mixed_dmc_counter = dmc_counter;
+#else
+        bool const fast = false;
+#endif
+
+#ifdef CATCH_UP_APU
+        set_audio_signal_level(signal_level, apu_time, fast);
+#else
+        set_audio_signal_level(signal_level, frame_offset, fast);
+#endif
 
         channel_updated = false;
     }
+
+#ifdef CATCH_UP_APU
+    ++apu_time;
+#endif
+}
+
+#ifdef CATCH_UP_APU
+
+//
+// Catch-up mode (see apu.h)
+//
+
+// Value of cpu_cycle that the APU has been run up to. The cycles after it are
+// owed.
+static THREAD_LOCAL uint64_t apu_synced_cycle;
+
+// Number of sync_apu() calls in progress. Greater than one while a DMC sample
+// fetch in a cycle being run ticks the CPU.
+static THREAD_LOCAL unsigned apu_sync_depth;
+
+// Schedules a sync for when 'n' cycles are owed
+static void schedule_apu_sync_in(unsigned n) {
+    schedule_event(EVENT_APU_SYNC, apu_synced_cycle + n);
+}
+
+// Posts the cycles that signal the CPU, which are the ones that set the frame
+// IRQ and the ones that fetch a DMC sample byte
+static void schedule_apu_sync() {
+    // Keep in step with tick() while a sample fetch stalls the CPU or cycles
+    // are being run
+    if (dmc_loading_sample_byte || apu_sync_depth > 0) {
+        schedule_apu_sync_in(1);
+        cancel_event(EVENT_FRAME_IRQ);
+        cancel_event(EVENT_DMC_DMA);
+        return;
+    }
+
+    cancel_event(EVENT_APU_SYNC);
+    schedule_event(EVENT_FRAME_IRQ,
+                   apu_synced_cycle + frame_counter_cycles_till(true));
+    if (dmc_bytes_remaining > 0)
+        schedule_event(EVENT_DMC_DMA, apu_synced_cycle + dmc_period_cnt +
+                                      (dmc_bits_remaining - 1)*dmc_period);
+    else
+        cancel_event(EVENT_DMC_DMA);
+}
+
+// The channels below are silent if their timers expiring can't change their
+// output levels. Their timers are then run in closed form rather than being
+// treated as events. Whatever could make them audible again happens on a
+// register write or a frame counter clock, which are both sync points.
+
+static bool pulse_is_silent(unsigned n) {
+    return pulse[n].len_cnt == 0                 ||
+           pulse[n].period < 8                   ||
+           pulse[n].sweep_target_period > 0x7FF  ||
+           (pulse[n].const_vol ? pulse[n].vol : pulse[n].env_vol) == 0;
+}
+
+static bool tri_is_silent() {
+    // The inverse of the condition in clock_triangle_generator()
+    return tri_len_cnt == 0 || tri_lin_cnt == 0 ||
+           tri_period <= 1  || tri_period > 0x7FD;
+}
+
+static bool noise_is_silent() {
+    return noise_len_cnt == 0 ||
+           (noise_const_vol ? noise_vol : noise_env_vol) == 0;
+}
+
+static bool dmc_is_silent() {
+    // Expirations just cycle dmc_bits_remaining, with nothing to output or
+    // fetch
+    return !dpcm_active && !dmc_sample_buffer_has_data &&
+           dmc_bytes_remaining == 0;
+}
+
+// Returns the number of upcoming cycles on which tick_apu() would only count
+// down timers (and step silent channels), which can be run in one go with
+// skip_apu_cycles()
+static unsigned apu_idle_cycles() {
+    if (channel_updated)
+        return 0;
+
+    unsigned res = frame_counter_cycles_till(false) - 1;
+    // The pulse timers count on every other cycle, on the ones where apu_clk1
+    // goes low
+    for (unsigned n = 0; n < 2; ++n)
+        if (!pulse_is_silent(n))
+            res = min(res, 2*pulse[n].period_cnt - apu_clk1_is_high - 1);
+    if (!tri_is_silent())
+        res = min(res, tri_period_cnt   - 1);
+    if (!noise_is_silent())
+        res = min(res, noise_period_cnt - 1);
+    if (!dmc_is_silent())
+        res = min(res, dmc_period_cnt   - 1);
+
+    return res;
+}
+
+// Counts down the timer 'cnt', which reloads with 'period', 'n' times.
+// Returns the number of times it expired.
+static unsigned run_timer(unsigned &cnt, unsigned period, unsigned n) {
+    if (n < cnt) {
+        cnt -= n;
+        return 0;
+    }
+    unsigned const after_first = n - cnt;
+    cnt = period - after_first % period;
+    return 1 + after_first/period;
+}
+
+static void skip_apu_cycles(unsigned n) {
+    unsigned const pulse_clocks = apu_clk1_is_high ? (n + 1)/2 : n/2;
+    for (unsigned i = 0; i < 2; ++i)
+        pulse[i].waveform_pos =
+          (pulse[i].waveform_pos +
+           run_timer(pulse[i].period_cnt, pulse[i].period + 1, pulse_clocks)) % 8;
+    if (n & 1)
+        apu_clk1_is_high = !apu_clk1_is_high;
+
+    run_timer(tri_period_cnt, tri_period + 1, n);
+
+    for (unsigned i = run_timer(noise_period_cnt, noise_period + 1, n); i > 0; --i)
+        step_noise_shift_reg();
+
+    run_timer(dmc_bits_remaining, 8, run_timer(dmc_period_cnt, dmc_period, n));
+
+    frame_counter_clock += n;
+
+    apu_time += n;
+}
+
+void sync_apu() {
+    // Nested calls (from the ticks in a DMC sample fetch) continue from where
+    // the outer call is
+    unsigned n = cpu_cycle - apu_synced_cycle;
+    if (apu_sync_depth++ == 0)
+        apu_time = frame_offset - n;
+
+    // Cleared up front, as DMC sample fetches tick() and sync recursively
+    apu_synced_cycle = cpu_cycle;
+    schedule_apu_sync();
+
+    while (n > 0) {
+        unsigned const n_idle = min(n - 1, apu_idle_cycles());
+        skip_apu_cycles(n_idle);
+        tick_apu();
+        n -= n_idle + 1;
+    }
+
+    --apu_sync_depth;
+    schedule_apu_sync();
 }
 
+#endif
+
 //
 // Initialization and resetting
 //
 
 void reset_apu() {
+    sync_apu();
+
     // Things explicitly initialized by the reset signal, derived from tracing
     // the _res node in Visual 2A03
 
@@ -912,6 +1216,8 @@ void reset_apu() {
     // Avoids a pop due to a sudden volume change when the triangle starts
     // playing
     tri_output_level = tri_waveform_steps[tri_waveform_pos];
+
+    schedule_apu_sync();
 }
 
 void set_apu_cold_boot_state() {
@@ -966,6 +1272,21 @@ void set_apu_cold_boot_state() {
     frame_counter_mode = FOUR_STEP;
     inhibit_frame_irq  = false;
 
+    // Mixer
+
+    channel_updated = false;
+#ifdef FAST_TRI_NOISE_AUDIO
+    // Makes the first level change use the high-quality synthesis
+    mixed_pulse_level = mixed_dmc_counter = UINT_MAX;
+#endif
+
+#ifdef CATCH_UP_APU
+    // Catch-up mode
+
+    apu_synced_cycle = cpu_cycle;
+    apu_sync_depth   = 0;
+#endif
+
     // Reset signal takes care of the rest
     reset_apu();
 }
@@ -976,6 +1297,9 @@ void set_apu_cold_boot_state() {
 
 template<bool calculating_size, bool is_save>
 void transfer_apu_state(uint8_t *&buf) {
+    if (!calculating_size && is_save)
+        sync_apu();
+
     TRANSFER(apu_clk1_is_high)
     TRANSFER(oam_dma_state)
 
@@ -1060,6 +1384,24 @@ void transfer_apu_state(uint8_t *&buf) {
     TRANSFER(inhibit_frame_irq)
     TRANSFER(frame_counter_clock)
     TRANSFER(delayed_frame_timer_reset)
+
+#ifdef CATCH_UP_APU
+    if (!calculating_size && !is_save) {
+        // Any owed cycles belong to the state being replaced
+        apu_synced_cycle = cpu_cycle;
+        apu_sync_depth   = 0;
+        schedule_apu_sync();
+    }
+#endif
+}
+
+template<bool calculating_size, bool is_save>
+void transfer_apu_context(uint8_t *&buf) {
+    TRANSFER(channel_updated)
+#ifdef FAST_TRI_NOISE_AUDIO
+    TRANSFER(mixed_pulse_level)
+    TRANSFER(mixed_dmc_counter)
+#endif
 }
 
 // Explicit instantiations
@@ -1070,3 +1412,10 @@ template void transfer_apu_state<true, false>(uint8_t*&);
 template void transfer_apu_state<false, true>(uint8_t*&);
 // Loading state from buffer
 template void transfer_apu_state<false, false>(uint8_t*&);
+
+// Calculating context size
+template void transfer_apu_context<true, false>(uint8_t*&);
+// Saving context to buffer
+template void transfer_apu_context<false, true>(uint8_t*&);
+// Loading context from buffer
+template void transfer_apu_context<false, false>(uint8_t*&);
@@ -1,138 +1,104 @@
 #include "common.h"
 
 #include "audio.h"
+#include "backend.h"
 #include "cpu.h"
 #include "blip_buf.h"
 #include "save_states.h"
-#include "sdl_backend.h"
 #include "timing.h"
 
+#ifndef HEADLESS
+
 //
 // Audio ring buffer
 //
+// Single-producer/single-consumer and lock-free: the emulation thread only
+// writes samples and moves write_pos, and the audio callback only reads
+// samples and moves read_pos. The positions count samples from the start and
+// are masked to get buffer indices, which works since the buffer length is a
+// power of two. A full buffer is told apart from an empty one by the
+// positions being a buffer length apart rather than equal.
+//
+// Each side publishes its position with a release store after it's done with
+// the samples, and loads the other side's position with an acquire load before
+// touching them. That way neither side can see samples that haven't been
+// written yet or overwrite samples that haven't been read yet.
 
 // Make room for 1/6th seconds of delay
 static int16_t buf[GE_POW_2(sample_rate/6)];
-// Indices from start_index up to but not including end_index (modulo wrapping)
-// contain samples
-static size_t start_index = 0, end_index = 0;
-// True if the last operation was a read. Indicates whether
-// start_index == end_index means the buffer is full or empty.
-static bool prev_op_was_read = true;
+static size_t const buf_mask = ARRAY_LEN(buf) - 1;
 
-void read_samples(int16_t *dst, size_t len) {
-    assert(start_index < ARRAY_LEN(buf));
+static size_t read_pos, write_pos;
 
-    // Move samples from the ring buffer to 'dst' by memcpy()ing contiguous
-    // segments
+// Copies 'len' samples from 'src' to the ring buffer, starting at position
+// 'pos'. 'len' must not exceed the free space.
+static void copy_to_ring(size_t pos, int16_t const *src, size_t len) {
+    size_t const i         = pos & buf_mask;
+    size_t const first_len = min(len, ARRAY_LEN(buf) - i);
+    memcpy(buf + i, src, sizeof(*buf)*first_len);
+    memcpy(buf, src + first_len, sizeof(*buf)*(len - first_len));
+}
 
-    // How many contiguous bytes are available...?
+// Copies 'len' samples from the ring buffer to 'dst', starting at position
+// 'pos'. 'len' must not exceed the number of samples in the buffer.
+static void copy_from_ring(size_t pos, int16_t *dst, size_t len) {
+    size_t const i         = pos & buf_mask;
+    size_t const first_len = min(len, ARRAY_LEN(buf) - i);
+    memcpy(dst, buf + i, sizeof(*buf)*first_len);
+    memcpy(dst + first_len, buf, sizeof(*buf)*(len - first_len));
+}
 
-    size_t contig_avail;
-    if ((start_index == end_index && !prev_op_was_read) || start_index > end_index)
-        contig_avail = ARRAY_LEN(buf) - start_index;
-    else
-        contig_avail = end_index - start_index;
+void read_samples(int16_t *dst, size_t len) {
+    size_t const pos   = read_pos;
+    size_t const avail = __atomic_load_n(&write_pos, __ATOMIC_ACQUIRE) - pos;
+    size_t const n     = min(len, avail);
 
-    prev_op_was_read = true;
+    copy_from_ring(pos, dst, n);
+    __atomic_store_n(&read_pos, pos + n, __ATOMIC_RELEASE);
 
-    if (contig_avail >= len) {
-        // ...as many as we need. Copy it all in one go.
-        memcpy(dst, buf + start_index, sizeof(*buf)*len);
-        start_index = (start_index + len) % ARRAY_LEN(buf);
-    }
-    else {
-        // ... less than we need. Copy the contiguous segment first.
-        memcpy(dst, buf + start_index, sizeof(*buf)*contig_avail);
-        len -= contig_avail;
-        assert(len > 0);
-        // Move past the contiguous segment - possibly to index 0
-        start_index = (start_index + contig_avail) % ARRAY_LEN(buf);
-        assert(start_index <= end_index);
-        // How many contiguous bytes are available now...?
-        size_t const avail = end_index - start_index;
-        if (avail >= len) {
-            // ...as many as we need. Copy the rest.
-            memcpy(dst + contig_avail, buf + start_index, sizeof(*buf)*len);
-            start_index += len;
-            assert(start_index <= end_index);
-        }
-        else {
-            // ...less than we need. Copy as much as we can and zero-fill
-            // the rest of the output buffer, as required by SDL2.
-            memcpy(dst + contig_avail, buf + start_index, sizeof(*buf)*avail);
-            memset(dst + contig_avail + avail, 0, sizeof(*buf)*(len - avail));
-            assert(start_index + avail == end_index);
-            start_index = end_index;
+    if (n < len) {
+        // Zero-fill the rest of the output buffer, as required by SDL2
+        memset(dst + n, 0, sizeof(*buf)*(len - n));
 #ifndef RUN_TESTS
-            printf("audio buffer underflow by %zu!\n",len - avail);
+        printf("audio buffer underflow by %zu!\n", len - n);
 #endif
-        }
     }
 }
 
 // Writes up to 'len' samples from 'src' to the ring buffer. In case of
-// overflow, writes as many samples as possible and returns 'false'.
+// overflow, writes as many samples as possible and drops the rest.
 static void write_samples(int16_t const *src, size_t len) {
-    // Copy samples from 'src' to the ring buffer by memcpy()ing contiguous
-    // segments
-
-    // How many contiguous bytes are available...?
-
-    size_t contig_avail;
-    if (start_index < end_index || (start_index == end_index && prev_op_was_read))
-        contig_avail = ARRAY_LEN(buf) - end_index;
-    else
-        contig_avail = start_index - end_index;
+    size_t const pos  = write_pos;
+    size_t const free =
+      ARRAY_LEN(buf) - (pos - __atomic_load_n(&read_pos, __ATOMIC_ACQUIRE));
+    size_t const n    = min(len, free);
 
-    prev_op_was_read = false;
+    copy_to_ring(pos, src, n);
+    __atomic_store_n(&write_pos, pos + n, __ATOMIC_RELEASE);
 
-    if (contig_avail >= len) {
-        // ...as many as we need. Copy it all in one go.
-        memcpy(buf + end_index, src, sizeof(*buf)*len);
-        end_index = (end_index + len) % ARRAY_LEN(buf);
-    }
-    else {
-        // ...less than we need. Fill the contiguous segment first.
-        memcpy(buf + end_index, src, sizeof(*buf)*contig_avail);
-        len -= contig_avail;
-        assert(len > 0);
-        // Move past the contiguous segment - possibly to index 0
-        end_index = (end_index + contig_avail) % ARRAY_LEN(buf);
-        assert(end_index <= start_index);
-        // How many contiguous bytes are available now...?
-        size_t const avail = start_index - end_index;
-        if (avail >= len) {
-            // ...as many as we need. Copy the rest.
-            memcpy(buf + end_index, src + contig_avail, sizeof(*buf)*len);
-            end_index += len;
-            assert(end_index <= start_index);
-        }
-        else {
-            // ...less than we need. Copy as much as we can and drop the
-            // rest.
-            memcpy(buf + end_index, src + contig_avail, sizeof(*buf)*avail);
-            assert(end_index + avail == start_index);
-            end_index = start_index;
 #ifndef RUN_TESTS
-            puts("audio buffer overflow!");
+    if (n < len)
+        puts("audio buffer overflow!");
 #endif
-        }
-    }
 }
 
 // Returns the fill level of the ring buffer as a double in the range 0.0-1.0.
+// Only called from the emulation thread, so write_pos can be read directly.
 static double fill_level() {
-    double const data_len = (end_index - start_index) % ARRAY_LEN(buf);
+    double const data_len =
+      write_pos - __atomic_load_n(&read_pos, __ATOMIC_ACQUIRE);
     return data_len/ARRAY_LEN(buf);
 }
 
+#endif // HEADLESS
+
 //
 // Initialization, resampling, and buffer management
 //
 
-static blip_t *blip;
+static THREAD_LOCAL blip_t *blip;
 
+#ifndef HEADLESS
 // We try to keep the internal audio buffer 50% full for maximum protection
 // against under- and overflow. To maintain that level, we adjust the playback
 // rate slightly depending on the current buffer fill level. This sets the
@@ -145,19 +111,47 @@ double const max_adjust = 0.015;
 // level.
 static bool playback_started;
 
+// While fast-forwarding, the audio is resampled to a proportionally lower
+// rate, which time-compresses it (it plays back sped up) and keeps the buffer
+// fill level steady. At unlimited speed, the actual speed isn't known, so we
+// assume this and drop the audio for frames that would go over the target
+// fill level by too much.
+unsigned const unlimited_audio_speed = 8;
+
+static unsigned audio_speed() {
+    return speed_multiplier ? speed_multiplier : unlimited_audio_speed;
+}
+#endif
+
 // Leave some extra room in the buffer to allow audio to be slowed down. Assume
 // PAL, which gives a slightly larger buffer than NTSC. (The expression is
 // equivalent to 1.3*sample_rate/frames_per_second, but a compile-time constant
 // in C++03.)
 // TODO: Make dependent on max_adjust.
-static int16_t blip_samples[1300*sample_rate/pal_milliframes_per_second];
-
-void set_audio_signal_level(int16_t level) {
-    // TODO: Do something to reduce the initial pop here?
-    static int16_t previous_signal_level = 0;
+static THREAD_LOCAL int16_t blip_samples[1300*sample_rate/pal_milliframes_per_second];
+
+// Level from the previous set_audio_signal_level() call
+// TODO: Do something to reduce the initial pop here?
+static THREAD_LOCAL int16_t previous_signal_level = 0;
+
+// Deltas are collected and handed to blip_buf in batches, which lets it apply
+// the step kernels with SIMD instructions and keeps its code and tables in
+// the cache. There is one batch per synthesis quality.
+static THREAD_LOCAL struct Delta_batch {
+    unsigned n;
+    unsigned times[1024];
+    int      deltas[1024];
+} hq_deltas, fast_deltas;
+
+static void flush_deltas() {
+    blip_add_deltas(blip, hq_deltas.times, hq_deltas.deltas, hq_deltas.n);
+    blip_add_deltas_fast(blip, fast_deltas.times, fast_deltas.deltas,
+                         fast_deltas.n);
+    hq_deltas.n = fast_deltas.n = 0;
+}
 
-    unsigned time  = frame_offset;
-    int      delta = level - previous_signal_level;
+void set_audio_signal_level(int16_t level, unsigned time, bool fast) {
+    int delta = level - previous_signal_level;
 
     if (is_backwards_frame) {
         // Flip deltas and add them from the end of the frame to reverse audio.
@@ -184,7 +178,11 @@ void set_audio_signal_level(int16_t level) {
         time  = get_frame_len() - time;
         delta = -delta;
     }
-    blip_add_delta(blip, time, delta);
+    Delta_batch &batch = fast ? fast_deltas : hq_deltas;
+    batch.times[batch.n]  = time;
+    batch.deltas[batch.n] = delta;
+    if (++batch.n == ARRAY_LEN(batch.times))
+        flush_deltas();
 
     previous_signal_level = level;
 }
@@ -199,17 +197,20 @@ void end_audio_frame() {
 
     // Bring the signal level at the end of the frame to zero as outlined in
     // set_audio_signal_level()
-    set_audio_signal_level(0);
+    set_audio_signal_level(0, frame_offset);
 
+    flush_deltas();
     blip_end_frame(blip, frame_offset);
 
+#ifndef HEADLESS
     if (playback_started) {
         // Fudge playback rate by an amount proportional to the difference
         // between the desired and current buffer fill levels to try to steer
         // towards it
 
         double const fudge_factor = 1.0 + 2*max_adjust*(0.5 - fill_level());
-        blip_set_rates(blip, cpu_clock_rate, sample_rate*fudge_factor);
+        blip_set_rates(blip, cpu_clock_rate,
+                       sample_rate*fudge_factor/audio_speed());
     }
     else {
         if (fill_level() >= 0.5) {
@@ -217,6 +218,7 @@ void end_audio_frame() {
             playback_started = true;
         }
     }
+#endif
 
     int const n_samples = blip_read_samples(blip, blip_samples, ARRAY_LEN(blip_samples), 0);
     // We expect to read all samples from blip_buf. If something goes wrong and
@@ -233,19 +235,45 @@ void end_audio_frame() {
     add_movie_audio_frame(blip_samples, n_samples);
 #endif
 
-    // Save the samples to the audio ring buffer
-
-    lock_audio();
-    write_samples(blip_samples, n_samples);
-    unlock_audio();
+#ifdef HEADLESS
+    if (sink_fns.audio)
+        sink_fns.audio(blip_samples, n_samples);
+#else
+    // Save the samples to the audio ring buffer. This never waits on the
+    // audio thread.
+    if (!(speed_multiplier == 0 && fill_level() > 0.75))
+        write_samples(blip_samples, n_samples);
+#endif
 }
 
 void init_audio_for_rom() {
     // Maximum number of unread samples the buffer can hold
     blip = blip_new(sample_rate/10);
     blip_set_rates(blip, cpu_clock_rate, sample_rate);
+    previous_signal_level = 0;
+    hq_deltas.n = fast_deltas.n = 0;
 }
 
 void deinit_audio_for_rom() {
     blip_delete(blip);
 }
+
+template<bool calculating_size, bool is_save>
+void transfer_audio_context(uint8_t *&buf) {
+    // The batches go into the outgoing console's buffer rather than the
+    // context. That leaves them empty for the incoming console.
+    if (!calculating_size && is_save)
+        flush_deltas();
+
+    TRANSFER(blip)
+    TRANSFER(previous_signal_level)
+}
+
+// Explicit instantiations
+
+// Calculating context size
+template void transfer_audio_context<true, false>(uint8_t*&);
+// Saving context to buffer
+template void transfer_audio_context<false, true>(uint8_t*&);
+// Loading context from buffer
+template void transfer_audio_context<false, false>(uint8_t*&);
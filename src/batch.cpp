@@ -0,0 +1,267 @@
+#include "common.h"
+
+#include "backend.h"
+#include "batch.h"
+#include "emulator.h"
+#include "input_movie.h"
+#include "timing.h"
+
+#include <pthread.h>
+
+struct Job {
+    // Point into the manifest buffer
+    char const   *rom_filename;
+    char const   *input_filename; // Input movie. Null if none.
+    unsigned long n_frames;
+    bool          has_expected_hash;
+    uint64_t      expected_hash;
+
+    // Results
+    uint64_t      hash;
+    double        seconds;
+    // Set if the job couldn't be run, along with the ROM or input file it was
+    // due to
+    char const   *error;
+    char const   *error_filename;
+};
+
+// Contents of the manifest file, with the tokens null-terminated in place
+static char     *manifest;
+static Job      *jobs;
+static unsigned  n_jobs;
+
+// Index of the next job to run. Workers grab jobs by incrementing it
+// atomically, so a worker that finishes early just moves on to the next job
+// and the load stays balanced without any further coordination.
+static unsigned  next_job;
+
+//
+// Hashing
+//
+
+// The job running on the current worker thread. Used by the sinks.
+static THREAD_LOCAL Job *cur_job;
+
+static void hash_frame(uint32_t const *frame) {
+    cur_job->hash =
+      fnv_1a(cur_job->hash, frame, sizeof(uint32_t)*NES_PPU_W*NES_PPU_H);
+}
+
+static void hash_audio(int16_t const *samples, size_t n_samples) {
+    cur_job->hash = fnv_1a(cur_job->hash, samples, sizeof(int16_t)*n_samples);
+}
+
+//
+// Manifest parsing
+//
+
+// Returns the next field in the manifest line at 'p' and null-terminates it in
+// place, or returns null if there are no more fields. Fields are separated by
+// whitespace. Double quotes around a field allow it to contain whitespace and
+// '#'. A '#' outside of quotes starts a comment that runs to the end of the
+// line. Sets 'error' and returns null for an unterminated quote.
+static char *next_field(char *&p, char const *&error) {
+    while (*p == ' ' || *p == '\t' || *p == '\r')
+        ++p;
+
+    if (*p == '\0' || *p == '#')
+        return 0;
+
+    char *field;
+    if (*p == '"') {
+        field = ++p;
+        if (!(p = strchr(p, '"'))) {
+            error = "unterminated quote";
+            return 0;
+        }
+        *p++ = '\0';
+    }
+    else {
+        field = p;
+        p += strcspn(p, " \t\r#");
+        if (*p == '#')
+            // The rest of the line is a comment. Cutting it off here makes
+            // the next call return null.
+            *p = '\0';
+        else if (*p != '\0')
+            *p++ = '\0';
+    }
+
+    return field;
+}
+
+// Splits 'manifest' into lines and fields and fills in 'jobs'
+static void parse_manifest(char const *filename) {
+    size_t size;
+    uint8_t *file_buf = get_file_buffer(filename, size);
+    fail_if(!(manifest = new (std::nothrow) char[size + 1]),
+      "failed to allocate %zu-byte buffer for manifest", size + 1);
+    memcpy(manifest, file_buf, size);
+    manifest[size] = '\0';
+    free_array_set_null(file_buf);
+
+    // Upper bound on the number of jobs
+    unsigned max_jobs = 1;
+    for (size_t i = 0; i < size; ++i)
+        if (manifest[i] == '\n')
+            ++max_jobs;
+    fail_if(!(jobs = new (std::nothrow) Job[max_jobs]),
+      "failed to allocate job list for %u lines", max_jobs);
+
+    char *line_save;
+    unsigned line_nr = 0;
+    for (char *line = strtok_r(manifest, "\n", &line_save); line;
+         line = strtok_r(0, "\n", &line_save)) {
+        ++line_nr;
+
+        char *tokens[4];
+        unsigned n_tokens = 0;
+        char const *error = 0;
+        for (char *token = next_field(line, error); token;
+             token = next_field(line, error)) {
+            fail_if(n_tokens == ARRAY_LEN(tokens),
+              "%s:%u: too many fields (expected <ROM file> <input file> "
+              "<frames> <expected hash>)", filename, line_nr);
+            tokens[n_tokens++] = token;
+        }
+        fail_if(error, "%s:%u: %s", filename, line_nr, error);
+
+        if (n_tokens == 0)
+            // Blank line or comment
+            continue;
+
+        fail_if(n_tokens != ARRAY_LEN(tokens),
+          "%s:%u: too few fields (expected <ROM file> <input file> "
+          "<frames> <expected hash>)", filename, line_nr);
+
+        Job &job = jobs[n_jobs++];
+
+        job.rom_filename = tokens[0];
+
+        job.input_filename = strcmp(tokens[1], "-") ? tokens[1] : 0;
+
+        char *end;
+        job.n_frames = strtoul(tokens[2], &end, 0);
+        fail_if(*end != '\0' || job.n_frames == 0,
+          "%s:%u: invalid frame count '%s'", filename, line_nr, tokens[2]);
+
+        job.has_expected_hash = strcmp(tokens[3], "-");
+        if (job.has_expected_hash) {
+            job.expected_hash = strtoull(tokens[3], &end, 16);
+            fail_if(*end != '\0',
+              "%s:%u: invalid hash '%s'", filename, line_nr, tokens[3]);
+        }
+    }
+
+    fail_if(n_jobs == 0, "no jobs in '%s'", filename);
+}
+
+//
+// Running jobs
+//
+
+static bool job_passed(Job const &job) {
+    return !job.error &&
+           (!job.has_expected_hash || job.hash == job.expected_hash);
+}
+
+static void run_job(Job &job) {
+    cur_job  = &job;
+    job.hash = fnv_offset_basis;
+
+    double const start_time = get_seconds();
+
+    // Errors that can be blamed on the job are reported in its result line
+    // rather than exiting
+    size_t rom_size;
+    uint8_t *rom = try_get_file_buffer(job.rom_filename, rom_size);
+    Emulator *emu = 0;
+    if (!rom)
+        job.error = strerror(errno);
+    else if (!(emu = new_emulator(job.rom_filename, rom, rom_size, job.error)))
+        free_array_set_null(rom);
+
+    if (!emu)
+        job.error_filename = job.rom_filename;
+    else {
+        if (job.input_filename &&
+            (job.error = try_start_movie_playback(job.input_filename)))
+            job.error_filename = job.input_filename;
+        else
+            for (unsigned long i = 0; i < job.n_frames; ++i)
+                run_frame(emu);
+        delete_emulator(emu);
+    }
+
+    job.seconds = get_seconds() - start_time;
+
+    // A single printf() per job keeps the output from different workers from
+    // getting interleaved within lines
+    if (job.error) {
+        printf("%-40s ERROR: '%s': %s\n",
+               job.rom_filename, job.error_filename, job.error);
+        return;
+    }
+    printf("%-40s %7lu frames %8.3f s %8.1f FPS  %016" PRIx64 "%s\n",
+           job.rom_filename, job.n_frames, job.seconds,
+           job.n_frames/job.seconds, job.hash,
+           !job.has_expected_hash ? "" :
+             job_passed(job) ? "  OK" : "  MISMATCH");
+}
+
+static void *worker(void*) {
+    sink_fns.video = hash_frame;
+    sink_fns.audio = hash_audio;
+
+    for (;;) {
+        unsigned const job_i = __sync_fetch_and_add(&next_job, 1);
+        if (job_i >= n_jobs)
+            break;
+        run_job(jobs[job_i]);
+    }
+
+    return 0;
+}
+
+bool run_batch(char const *manifest_filename) {
+    parse_manifest(manifest_filename);
+
+    long const n_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned const n_workers = min<unsigned>(n_cores > 0 ? n_cores : 1, n_jobs);
+
+    pthread_t *workers = new (std::nothrow) pthread_t[n_workers];
+    fail_if(!workers, "failed to allocate %u worker threads", n_workers);
+
+    double const start_time = get_seconds();
+
+    for (unsigned i = 0; i < n_workers; ++i) {
+        int const res = pthread_create(&workers[i], 0, worker, 0);
+        errno_val_fail_if(res != 0, res, "failed to create worker thread");
+    }
+    for (unsigned i = 0; i < n_workers; ++i) {
+        int const res = pthread_join(workers[i], 0);
+        errno_val_fail_if(res != 0, res, "failed to join worker thread");
+    }
+
+    double const elapsed = get_seconds() - start_time;
+
+    unsigned long total_frames = 0;
+    unsigned n_failed = 0;
+    for (unsigned i = 0; i < n_jobs; ++i) {
+        if (!jobs[i].error)
+            total_frames += jobs[i].n_frames;
+        if (!job_passed(jobs[i]))
+            ++n_failed;
+    }
+
+    printf("Ran %u jobs (%u failed) on %u threads in %.3f seconds "
+           "(%lu frames, %.1f FPS in total)\n",
+           n_jobs, n_failed, n_workers, elapsed, total_frames,
+           total_frames/elapsed);
+
+    free_array_set_null(workers);
+    free_array_set_null(jobs);
+    free_array_set_null(manifest);
+
+    return n_failed == 0;
+}
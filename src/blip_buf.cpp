@@ -7,6 +7,10 @@
 #include <string.h>
 #include <stdlib.h>
 
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
 /* Library Copyright (C) 2003-2009 Shay Green. This library is free software;
 you can redistribute it and/or modify it under the terms of the GNU Lesser
 General Public License as published by the Free Software Foundation; either
@@ -330,7 +334,6 @@ void blip_add_delta( blip_t* m, unsigned time, int delta )
 	out [15] += in[0]*delta + in[0-half_width]*delta2;
 }
 
-/*
 void blip_add_delta_fast( blip_t* m, unsigned time, int delta )
 {
 	unsigned fixed = (unsigned) ((time * m->factor + m->offset) >> pre_shift);
@@ -339,10 +342,91 @@ void blip_add_delta_fast( blip_t* m, unsigned time, int delta )
 	int interp = fixed >> (frac_bits - delta_bits) & (delta_unit - 1);
 	int delta2 = delta * interp;
 
-	// Fails if buffer size was exceeded
+	/* Fails if buffer size was exceeded */
 	assert( out <= &SAMPLES( m ) [m->size + end_frame_extra] );
 
 	out [7] += delta * delta_unit - delta2;
 	out [8] += delta2;
 }
-*/
+
+#ifdef __SSE2__
+
+/* Reverses the order of the eight 16-bit elements in v */
+static __m128i reverse_epi16( __m128i v )
+{
+	v = _mm_shuffle_epi32( v, _MM_SHUFFLE( 1, 0, 3, 2 ) );
+	v = _mm_shufflelo_epi16( v, _MM_SHUFFLE( 0, 1, 2, 3 ) );
+	return _mm_shufflehi_epi16( v, _MM_SHUFFLE( 0, 1, 2, 3 ) );
+}
+
+/* Adds kernel_pairs*delta_pair to the four samples at out, where kernel_pairs
+holds pairs of 16-bit kernel values and delta_pair the pair of 16-bit deltas
+they are multiplied by */
+static void add_madd( buf_t* out, __m128i kernel_pairs, __m128i delta_pair )
+{
+	__m128i* const p = (__m128i*) out;
+	_mm_storeu_si128( p, _mm_add_epi32( _mm_loadu_si128( p ),
+			_mm_madd_epi16( kernel_pairs, delta_pair ) ) );
+}
+
+#endif
+
+void blip_add_deltas( blip_t* m, const unsigned times [], const int deltas [], int count )
+{
+	int i;
+	for ( i = 0; i < count; ++i )
+	{
+		#ifdef __SSE2__
+			int delta = deltas [i];
+
+			/* The kernel is applied with 16-bit multiplies, which give exactly
+			the same result as blip_add_delta() as long as delta fits. delta and
+			delta2 below are never larger in magnitude than the original
+			delta. */
+			if ( (short) delta == delta )
+			{
+				unsigned fixed = (unsigned) ((times [i] * m->factor + m->offset) >> pre_shift);
+				buf_t* out = SAMPLES( m ) + m->avail + (fixed >> frac_bits);
+
+				int const phase_shift = frac_bits - phase_bits;
+				int phase = fixed >> phase_shift & (phase_count - 1);
+				short const* in  = bl_step [phase];
+				short const* rev = bl_step [phase_count - phase];
+
+				int interp = fixed >> (phase_shift - delta_bits) & (delta_unit - 1);
+				int delta2 = (delta * interp) >> delta_bits;
+				delta -= delta2;
+
+				/* Fails if buffer size was exceeded */
+				assert( out <= &SAMPLES( m ) [m->size + end_frame_extra] );
+
+				{
+					/* The same kernel values as in blip_add_delta(), with the
+					ones multiplied by delta and delta2 interleaved */
+					__m128i const fwd  = _mm_loadu_si128( (__m128i const*) in );
+					__m128i const fwd2 = _mm_loadu_si128( (__m128i const*) (in + half_width) );
+					__m128i const bwd  = reverse_epi16( _mm_loadu_si128( (__m128i const*) rev ) );
+					__m128i const bwd2 = reverse_epi16( _mm_loadu_si128( (__m128i const*) (rev - half_width) ) );
+
+					__m128i const delta_pair =
+						_mm_set1_epi32( (int) (((unsigned) delta2 << 16) | (delta & 0xFFFF)) );
+
+					add_madd( out +  0, _mm_unpacklo_epi16( fwd, fwd2 ), delta_pair );
+					add_madd( out +  4, _mm_unpackhi_epi16( fwd, fwd2 ), delta_pair );
+					add_madd( out +  8, _mm_unpacklo_epi16( bwd, bwd2 ), delta_pair );
+					add_madd( out + 12, _mm_unpackhi_epi16( bwd, bwd2 ), delta_pair );
+				}
+				continue;
+			}
+		#endif
+
+		blip_add_delta( m, times [i], deltas [i] );
+	}
+}
+
+void blip_add_deltas_fast( blip_t* m, const unsigned times [], const int deltas [], int count )
+{
+	int i;
+	for ( i = 0; i < count; ++i )
+		blip_add_delta_fast( m, times [i], deltas [i] );
+}
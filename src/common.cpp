@@ -1,7 +1,9 @@
 #include "common.h"
 
 #include <execinfo.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <sys/stat.h>
 
 //
 // General utility functions
@@ -11,6 +13,27 @@ bool is_pow_2_or_0(unsigned n) {
     return !(n & (n - 1));
 }
 
+uint64_t fnv_1a(uint64_t hash, void const *data, size_t len) {
+    uint64_t const fnv_prime = UINT64_C(1099511628211);
+
+    uint8_t const *const bytes = (uint8_t const*)data;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= bytes[i];
+        hash *= fnv_prime;
+    }
+    return hash;
+}
+
+uint8_t *put_u32(uint8_t *p, uint32_t val) {
+    for (unsigned i = 0; i < 4; ++i)
+        *p++ = val >> 8*i;
+    return p;
+}
+
+uint32_t get_u32(uint8_t const *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
 uint8_t rev_byte(uint8_t n) {
     static uint8_t const rev_table[] = {
       0x00, 0x80, 0x40, 0xC0, 0x20, 0xA0, 0x60, 0xE0, 0x10, 0x90, 0x50, 0xD0, 0x30, 0xB0, 0x70, 0xF0,
@@ -58,6 +81,66 @@ uint8_t *get_file_buffer(char const *filename, size_t &size_out) {
     return file_buf;
 }
 
+uint8_t *try_get_file_buffer(char const *filename, size_t &size_out) {
+    int const fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        return 0;
+
+    uint8_t *file_buf = 0;
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        goto end;
+
+    if (!(file_buf = new (std::nothrow) uint8_t[st.st_size])) {
+        errno = ENOMEM;
+        goto end;
+    }
+
+    for (size_t n_read = 0; n_read < size_t(st.st_size); ) {
+        ssize_t const res = read(fd, file_buf + n_read, st.st_size - n_read);
+        if (res <= 0) {
+            if (res == 0)
+                // Truncated while reading
+                errno = EIO;
+            free_array_set_null(file_buf);
+            goto end;
+        }
+        n_read += res;
+    }
+    size_out = st.st_size;
+
+end:
+    int const saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return file_buf;
+}
+
+bool write_file_safely(char const *filename, void const *buf, size_t size) {
+    char *tmp_filename = new (std::nothrow) char[strlen(filename) + 5];
+    if (!tmp_filename) {
+        errno = ENOMEM;
+        return false;
+    }
+    sprintf(tmp_filename, "%s.tmp", filename);
+
+    FILE *const file = fopen(tmp_filename, "wb");
+    bool ok = file && fwrite(buf, 1, size, file) == size;
+    if (file && fclose(file) == EOF)
+        ok = false;
+    if (ok)
+        ok = rename(tmp_filename, filename) == 0;
+    if (!ok) {
+        // Keep the errno from the failed operation
+        int const saved_errno = errno;
+        remove(tmp_filename);
+        errno = saved_errno;
+    }
+
+    free_array_set_null(tmp_filename);
+    return ok;
+}
+
 //
 // Error reporting
 //
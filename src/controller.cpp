@@ -4,11 +4,11 @@
 #include "cpu.h"
 #include "input.h"
 
-static uint8_t controller_bits[2];
+static THREAD_LOCAL uint8_t controller_bits[2];
 
 // Set by writing $4016:0. When enabled, the shift registers in the controllers
 // are initialized from the buttons (level triggered).
-static bool strobe_latch;
+static THREAD_LOCAL bool strobe_latch;
 
 uint8_t read_controller(unsigned n) {
     // Results for standard controller:
@@ -38,6 +38,11 @@ void write_controller_strobe(bool strobe) {
     strobe_latch = strobe;
 }
 
+void set_controller_cold_boot_state() {
+    init_array(controller_bits, (uint8_t)0);
+    strobe_latch = false;
+}
+
 template<bool calculating_size, bool is_save>
 void transfer_controller_state(uint8_t *&buf) {
     TRANSFER(controller_bits)
@@ -8,6 +8,7 @@
 
 #include "apu.h"
 #include "audio.h"
+#include "backend.h"
 #include "controller.h"
 #include "cpu.h"
 #include "dbg.h"
@@ -20,56 +21,47 @@
 #endif
 #include "rom.h"
 #include "save_states.h"
-#include "sdl_backend.h"
+#include "scheduler.h"
+#include "state_hash.h"
 #include "timing.h"
 
 //
 // Event signaling
 //
 
-// Set true when an event needs to be handled at the next instruction boundary.
-// Avoids having to check them all for each instruction. This includes
-// interrupts, end-of-frame operations, state transfers, (soft) reset, and
-// shutdown.
-static bool pending_event;
+// These post CPU events (see scheduler.h) for the current cycle, which
+// run_instructions() handles at the next instruction boundary
 
-static bool pending_end_emulation;
-static bool pending_frame_completion;
-static bool pending_reset;
+void end_emulation()   { schedule_event(EVENT_END_EMULATION, cpu_cycle); }
+void frame_completed() { schedule_event(EVENT_FRAME_END, cpu_cycle); }
+void soft_reset()      { schedule_event(EVENT_RESET, cpu_cycle); }
 
-void end_emulation()   { pending_event = pending_end_emulation = true; }
-void frame_completed() { pending_event = pending_frame_completion = true; }
-void soft_reset()      { pending_event = pending_reset = true; }
+void debugger_attachment_changed() {
+	schedule_event(EVENT_DEBUGGER_ATTACHMENT, cpu_cycle);
+}
 
-// Set true if interrupt polling detects a pending IRQ or NMI. The next
-// "instruction" executed is the interrupt sequence.
-bool pending_irq;
-bool pending_nmi;
+// Page written to $4014, for EVENT_OAM_DMA
+static THREAD_LOCAL uint8_t oam_dma_page;
 
 #ifdef ENABLE_CORRUPTION
-static bool corrupt_now;
-unsigned int randcorrupt = 0;
-unsigned int corrupt_chance = 0;
-#endif
-
-#ifdef RUN_TESTS
-// The system is soft-reset when this goes from 1 to 0. Used by test ROMs.
-static unsigned ticks_till_reset;
+static THREAD_LOCAL bool corrupt_now;
+THREAD_LOCAL unsigned int randcorrupt = 0;
+THREAD_LOCAL unsigned int corrupt_chance = 0;
 #endif
 
 //
 // RAM, registers, status flags, and misc. state
 //
 
-uint8_t ram[0x800];
+THREAD_LOCAL uint8_t ram[0x800];
 
 // Possible optimization: Making some of the variables a natural size for the
 // implementation architecture might be faster. CPU emulation is already
 // relatively speedy though, and we wouldn't get automatic wrapping.
 
 // Registers
-uint16_t pc;
-uint8_t a, s, x, y;
+THREAD_LOCAL uint16_t pc;
+THREAD_LOCAL uint8_t a, s, x, y;
 
 // Status flags
 
@@ -82,28 +74,30 @@ uint8_t a, s, x, y;
 // Having zn & 0x100 also indicate that the negative flag is set allows the two
 // flags to be set separately, which is required by the BIT instruction and
 // when pulling flags from the stack.
-unsigned zn;
+THREAD_LOCAL unsigned zn;
 
-bool carry;
-bool irq_disable;
-bool decimal;
-bool overflow;
+THREAD_LOCAL bool carry;
+THREAD_LOCAL bool irq_disable;
+THREAD_LOCAL bool decimal;
+THREAD_LOCAL bool overflow;
 
 // The byte after the opcode byte. Always fetched, so factoring out the fetch
 // saves logic.
-static uint8_t op_1;
+static THREAD_LOCAL uint8_t op_1;
 
-bool cpu_is_reading;
-uint8_t cpu_data_bus;
+THREAD_LOCAL bool cpu_is_reading;
+THREAD_LOCAL uint8_t cpu_data_bus;
 
 //
 // PPU and APU interface
 //
 
-unsigned frame_offset;
+THREAD_LOCAL unsigned frame_offset;
+
+THREAD_LOCAL uint64_t cpu_cycle;
 
 // Down counter for adding an extra PPU tick for PAL
-static unsigned pal_extra_tick;
+static THREAD_LOCAL unsigned pal_extra_tick;
 
 void tick() {
 	// For NTSC, there are exactly three PPU ticks per CPU cycle. For PAL the
@@ -111,29 +105,50 @@ void tick() {
 	// call. (This isn't perfect, but about as good as we can do without getting
 	// into super-obscure hardware behavior, including PPU half-ticks and analog
 	// effects.)
-	if (is_pal) {
-		if (--pal_extra_tick == 0) {
-			pal_extra_tick = 5;
-			tick_pal_ppu();
-		}
-		tick_pal_ppu();
-		tick_pal_ppu();
-		tick_pal_ppu();
+#ifdef CATCH_UP_PPU
+	// The dots are run later by sync_ppu() (see ppu.h)
+	ppu_dots_owed += 3;
+	if (is_pal && --pal_extra_tick == 0) {
+		pal_extra_tick = 5;
+		++ppu_dots_owed;
 	}
-	else {
-		tick_ntsc_ppu();
-		tick_ntsc_ppu();
-		tick_ntsc_ppu();
+#else
+	if (is_pal && --pal_extra_tick == 0) {
+		pal_extra_tick = 5;
+		run_ppu_dots(4);
 	}
+	else
+		run_ppu_dots(3);
+#endif
 
+	// In catch-up mode, the APU cycles are run later by sync_apu() (see
+	// apu.h)
+#ifndef CATCH_UP_APU
 	tick_apu();
-
-#ifdef RUN_TESTS
-	if (ticks_till_reset > 0 && --ticks_till_reset == 0)
-		pending_reset = true;
 #endif
 
 	++frame_offset;
+	// Done last, so that the dots and cycles owed to the PPU and APU end at
+	// this cycle when their events run
+	if (++cpu_cycle >= next_event_cycle)
+		run_due_events();
+}
+
+unsigned cycles_till_ppu_dots(unsigned n) {
+	if (!is_pal)
+		return (n + 2)/3;
+
+	// Every five cycles add 16 dots, whatever the phase of pal_extra_tick
+	unsigned res = 5*(n/16);
+	n %= 16;
+	for (unsigned extra_tick = pal_extra_tick; n > 0; ++res)
+		if (--extra_tick == 0) {
+			extra_tick = 5;
+			n -= min(n, 4u);
+		}
+		else
+			n -= min(n, 3u);
+	return res;
 }
 
 //
@@ -158,32 +173,35 @@ uint8_t read_mem(uint16_t addr) {
 
 	uint8_t res;
 
-	switch (addr) {
-		case 0x0000 ... 0x1FFF: res = ram[addr & 0x7FF];      break;
-		case 0x2000 ... 0x3FFF: res = read_ppu_reg(addr & 7); break;
-		case 0x4015           : res = read_apu_status();      break;
-		case 0x4016           : res = read_controller(0);     break;
-		case 0x4017           : res = read_controller(1);     break;
-		case 0x4018 ... 0x5FFF: res = mapper_fns.read(addr);  break; // General enough?
-		case 0x6000 ... 0x7FFF:
-					// WRAM/SRAM. Returns open bus if none present.
-					res = wram_6000_page ? wram_6000_page[addr & 0x1FFF] : cpu_data_bus;
-					break;
-		case 0x8000 ... 0xFFFF: res = read_prg(addr);         break;
-		default:                res = cpu_data_bus;           break; // Open bus
-	}
+	// RAM, WRAM, and PRG are read directly through the memory map
+	Cpu_page const &page = cpu_pages[addr >> 8];
+	if (page.read)
+		res = page.read[addr & 0xFF];
+	else
+		switch (page.read_handler) {
+			case PAGE_PPU: res = read_ppu_reg(addr & 7); break;
+			case PAGE_IO:
+				switch (addr) {
+					case 0x4015           : res = read_apu_status();      break;
+					case 0x4016           : res = read_controller(0);     break;
+					case 0x4017           : res = read_controller(1);     break;
+					case 0x4018 ... 0x40FF: res = mapper_fns.read(addr);  break; // General enough?
+					default:                res = cpu_data_bus;           break; // Open bus
+				}
+				break;
+			case PAGE_CART: res = mapper_fns.read(addr); break;
+			// Open bus, e.g. $6000-$7FFF without WRAM
+			default:        res = cpu_data_bus;          break;
+		}
 
 	cpu_data_bus = res;
+	dbg_watch_read(addr, res);
 	return res;
 }
 
-void write_mem_inst(uint8_t val, uint16_t addr) {
-	// this function is used by the debugger to modify memory instantly.
-
+// Writes to the APU and controller registers, at $4000-$401F
+static void write_io_reg(uint8_t val, uint16_t addr) {
 	switch (addr) {
-		case 0x0000 ... 0x1FFF: ram[addr & 0x7FF] = val;      break;
-		case 0x2000 ... 0x3FFF: write_ppu_reg(val, addr & 7); break;
-
 		case 0x4000: write_pulse_reg_0(0, val); break;
 		case 0x4001: write_pulse_reg_1(0, val); break;
 		case 0x4002: write_pulse_reg_2(0, val); break;
@@ -207,35 +225,50 @@ void write_mem_inst(uint8_t val, uint16_t addr) {
 		case 0x4012: write_dmc_reg_2(val); break;
 		case 0x4013: write_dmc_reg_3(val); break;
 
-		case 0x4014: do_oam_dma(val); break;
+		case 0x4014:
+			// The CPU is halted for the DMA on its next read, which is
+			// after the instruction
+			oam_dma_page = val;
+			schedule_event(EVENT_OAM_DMA, cpu_cycle);
+			break;
 
 		case 0x4015: write_apu_status(val);            break;
 		case 0x4016: write_controller_strobe(val & 1); break;
 		case 0x4017: write_frame_counter(val);         break;
+	}
+}
+
+void write_mem_inst(uint8_t val, uint16_t addr) {
+	// this function is used by the debugger to modify memory instantly.
 
-		case 0x6000 ... 0x7FFF:
-			     // SRAM/WRAM/PRG RAM
 #ifdef RUN_TESTS
-			     // blargg's test ROMs write the test status to $6000 and a
-			     // corresponding text string to $6004
-			     if (addr == 0x6000) {
-				     if (val < 0x80)
-					     report_status_and_end_test(val, (char*)wram_6000_page + 4);
-				     else if (val == 0x81)
-					     // Wait 150 ms before resetting
-					     ticks_till_reset = 0.15*cpu_clock_rate;
-			     }
+	// blargg's test ROMs write the test status to $6000 and a corresponding
+	// text string to $6004
+	if (addr == 0x6000 && wram_6000_page) {
+		if (val < 0x80)
+			report_status_and_end_test(val, (char*)wram_6000_page + 4);
+		else if (val == 0x81)
+			// Wait 150 ms before resetting
+			schedule_event(EVENT_RESET,
+			               cpu_cycle + (uint64_t)(0.15*cpu_clock_rate));
+	}
 #endif
-			     if (wram_6000_page) wram_6000_page[addr & 0x1FFF] = val;
-			     break;
 
-		case 0x8000 ... 0xFFFF: write_prg(addr, val); break;
+	// RAM, WRAM, and PRG RAM are written directly through the memory map
+	Cpu_page const &page = cpu_pages[addr >> 8];
+	if (page.write) {
+		page.write[addr & 0xFF] = val;
+		*page.dirty_word |= page.dirty_mask;
 	}
+	else
+		switch (page.write_handler) {
+			case PAGE_PPU: write_ppu_reg(val, addr & 7); break;
+			case PAGE_IO:  write_io_reg(val, addr);      break;
+		}
 
-	// An alternative to letting the mapper see all writes would be to have
-	// separate functions for common address ranges that trigger mapper
-	// operations
-	mapper_fns.write(val, addr);
+	// Only writes within the mapper's write windows are passed on to it
+	if (page.mapper_write)
+		mapper_fns.write(val, addr);
 }
 
 static void write_mem(uint8_t val, uint16_t addr) {
@@ -247,6 +280,7 @@ static void write_mem(uint8_t val, uint16_t addr) {
 	cpu_data_bus = val;
 
 	write_mem_inst(val,addr);
+	dbg_watch_write(addr, val);
 }
 
 //
@@ -457,16 +491,32 @@ static void branch_if(bool cond) {
 }
 
 
+// Direct RAM access for the zero page and stack fast paths below, which skip
+// read_mem() and write_mem(). Accesses are still reported to the debugger's
+// watchpoints.
+
+static uint8_t read_ram(uint16_t addr) {
+	uint8_t const val = ram[addr];
+	dbg_watch_read(addr, val);
+	return val;
+}
+
+static void write_ram(uint8_t val, uint16_t addr) {
+	ram[addr] = val;
+	dbg_watch_write(addr, val);
+}
+
+
 // Stack manipulation
 
 static void push(uint8_t val) {
 	write_tick();
-	ram[0x100 + s--] = val;
+	write_ram(val, 0x100 + s--);
 }
 
 static uint8_t pull() {
 	read_tick();
-	return ram[0x100 + ++s];
+	return read_ram(0x100 + ++s);
 }
 
 static void push_flags(bool with_break_bit_set) {
@@ -520,7 +570,7 @@ static void pull_flags() {
 		read_tick(); /* Write back unmodified value */ \
 		poll_for_interrupt();                          \
 		write_tick();                                  \
-		ram[op_1] = fn(ram[op_1]);                     \
+		write_ram(fn(read_ram(op_1)), op_1);           \
 	} while(0)
 
 #define ZERO_X_RMW(fn)                                  \
@@ -532,7 +582,7 @@ static void pull_flags() {
 		read_tick(); /* Write back unmodified value */  \
 		poll_for_interrupt();                           \
 		write_tick();                                   \
-		ram[addr] = fn(ram[addr]);                      \
+		write_ram(fn(read_ram(addr)), addr);            \
 	} while(0)
 
 //
@@ -548,7 +598,7 @@ static uint8_t get_zero_op() {
 	++pc;
 	poll_for_interrupt();
 	read_tick();
-	return ram[op_1];
+	return read_ram(op_1);
 }
 
 static uint8_t get_zero_xy_op(uint8_t index) {
@@ -556,16 +606,18 @@ static uint8_t get_zero_xy_op(uint8_t index) {
 	read_tick(); // Read from address, add index
 	poll_for_interrupt();
 	read_tick();
-	return ram[(op_1 + index) & 0xFF];
+	return read_ram((op_1 + index) & 0xFF);
 }
 
-// Writing zero page never has side effects, so we can optimize a bit
+// Writing zero page never has side effects, so we can optimize a bit. Zero
+// page (like the stack) is always treated as dirty by the dirty-page tracking
+// in save_states.h, so writes to it aren't tracked.
 
 static void zero_write(uint8_t val) {
 	++pc;
 	poll_for_interrupt();
 	write_tick();
-	ram[op_1] = val;
+	write_ram(val, op_1);
 }
 
 static void zero_xy_write(uint8_t val, uint8_t index) {
@@ -573,7 +625,7 @@ static void zero_xy_write(uint8_t val, uint8_t index) {
 	read_tick(); // Read from address and add x to it
 	poll_for_interrupt();
 	write_tick();
-	ram[(op_1 + index) & 0xFF] = val;
+	write_ram(val, (op_1 + index) & 0xFF);
 }
 
 
@@ -633,7 +685,8 @@ static uint16_t get_ind_x_addr() {
 	read_tick(); // Fetch effective address low
 	read_tick(); // Fetch effective address high
 	uint8_t const zero_addr = op_1 + x;
-	return (ram[(zero_addr + 1) & 0xFF] << 8) | ram[zero_addr];
+	uint8_t const low = read_ram(zero_addr);
+	return (read_ram((zero_addr + 1) & 0xFF) << 8) | low;
 }
 
 static uint8_t get_ind_x_op() {
@@ -656,7 +709,8 @@ static uint16_t get_addr_from_zero_page() {
 	++pc;
 	read_tick(); // Fetch effective address low
 	read_tick(); // Fetch effective address high
-	return (ram[(op_1 + 1) & 0xFF] << 8) | ram[op_1];
+	uint8_t const low = read_ram(op_1);
+	return (read_ram((op_1 + 1) & 0xFF) << 8) | low;
 }
 
 // (Indirect),Y address fetching for write and read-modify-write instructions
@@ -702,13 +756,13 @@ static void unoff_addr_write(uint16_t addr, uint8_t val, uint8_t index) {
 //
 
 // IRQ from mapper hardware on the cart
-static bool cart_irq;
+static THREAD_LOCAL bool cart_irq;
 
 // The OR of all IRQ sources. Updated in update_irq_status().
-static bool irq_line;
+static THREAD_LOCAL bool irq_line;
 
 // Set true when a falling edge occurs on the NMI input
-static bool nmi_asserted;
+static THREAD_LOCAL bool nmi_asserted;
 
 static void update_irq_status() {
 	irq_line = cart_irq || dmc_irq || frame_irq;
@@ -795,10 +849,10 @@ static void poll_for_interrupt() {
 	// This behavior has been confirmed in Visual 6502.
 	if (nmi_asserted) {
 		nmi_asserted = false;
-		pending_event = pending_nmi = true;
+		schedule_event(EVENT_NMI, cpu_cycle);
 	}
 	else if (irq_line && !irq_disable)
-		pending_event = pending_irq = true;
+		schedule_event(EVENT_IRQ, cpu_cycle);
 }
 
 // Defined in tables.c. Indexed by opcode.
@@ -811,539 +865,679 @@ extern uint8_t const polls_irq_after_first_cycle[256];
 static void set_cpu_cold_boot_state();
 static void reset_cpu();
 
-// See pending_event
-static void process_pending_events() {
-	if (pending_nmi) {
-		pending_nmi = false;
-		do_interrupt(Int_NMI);
-	}
-
-	if (pending_irq) {
-		pending_irq = false;
-		do_interrupt(Int_IRQ);
-	}
+// Set when a frame is completed. Lets emulate_frame() stop at the end of the
+// frame.
+static THREAD_LOCAL bool frame_was_completed;
 
-	if (pending_frame_completion) {
-		pending_frame_completion = false;
-
-		// Run tests as fast as we can
-#ifndef RUN_TESTS
-		sleep_till_end_of_frame();
+static void end_frame() {
+	// Run tests and headless builds as fast as we can
+#if !defined(RUN_TESTS) && !defined(HEADLESS)
+	sleep_till_end_of_frame();
 #endif
-		draw_frame();
-		end_audio_frame();
-		begin_audio_frame();
-		calc_controller_state();
-		handle_ui_keys();
-
-		frame_offset = 0;
+	draw_frame();
+	sync_apu();
+	end_audio_frame();
+	begin_audio_frame();
+	calc_controller_state();
+	handle_ui_keys();
+	if (hashing_frames)
+		hash_frame_state();
+
+	frame_offset = 0;
+	frame_was_completed = true;
+}
+
+// Handles the CPU events (see scheduler.h) that are due at this instruction
+// boundary. Handlers can tick() and post more events, which are handled too if
+// they are due. Returns true if emulation was ended.
+static bool run_due_cpu_events() {
+	for (Event event; (event = first_due_cpu_event()) != N_EVENTS;) {
+		cancel_event(event);
+
+		switch (event) {
+		case EVENT_OAM_DMA:   do_oam_dma(oam_dma_page); break;
+		case EVENT_NMI:       do_interrupt(Int_NMI);    break;
+		case EVENT_IRQ:       do_interrupt(Int_IRQ);    break;
+		case EVENT_FRAME_END: end_frame();              break;
+
+		case EVENT_RESET:
+			// Reset the APU and PPU first since they should tick during the
+			// CPU's reset sequence
+			reset_apu();
+			reset_ppu();
+			reset_cpu();
+			break;
+
+		// run_instructions() checks dbg_attached() after this
+		case EVENT_DEBUGGER_ATTACHMENT: break;
+
+		case EVENT_END_EMULATION: return true;
+
+		default: UNREACHABLE
+		}
 	}
 
-	if (pending_reset) {
-		pending_reset = false;
-
-		// Reset the APU and PPU first since they should tick during the
-		// CPU's reset sequence
-		reset_apu();
-		reset_ppu();
-		reset_cpu();
-	}
+	return false;
 }
 
-void run() {
-	set_apu_cold_boot_state();
+void power_on() {
+	// Memory might get initialized below
+	mark_all_pages_dirty();
+
+	// The CPU goes first, as it restarts 'cpu_cycle', which the APU and PPU
+	// schedule events relative to
 	set_cpu_cold_boot_state();
+	set_apu_cold_boot_state();
 	set_ppu_cold_boot_state();
+	set_controller_cold_boot_state();
+	set_input_cold_boot_state();
 
 	init_timing();
 
 	do_interrupt(Int_reset);
+}
+
+// Label for the handler for 'name' in run_instructions(). The handlers are
+// entered by jumping through a table of label addresses (GCC's "labels as
+// values") rather than through a switch on the opcode, which skips the range
+// check for the switch.
+#define OP(name) op_##name
+
+// Runs instructions until 'cpu_cycle' reaches 'end_cycle', until emulation is
+// ended, or - if 'stop_at_frame_end' is true - until a frame is completed.
+// Also returns if the debugger is attached or detached, so that emulate() can
+// switch to the other version of the loop. Returns false in that case. All of
+// these are checked at instruction boundaries.
+//
+// The version with 'debugging' false has no debugger hooks, so that the
+// debugger costs nothing per instruction while it's not in use.
+template<bool debugging>
+static bool run_instructions(uint64_t end_cycle, bool stop_at_frame_end) {
+	// Handler for each opcode, in opcode order (generated from opcodes.h)
+	static void *const handlers[256] = {
+		/* 00 */ &&op_BRK,         &&op_ORA_IND_X,   &&op_KI0,         &&op_SLO_IND_X,
+		/* 04 */ &&op_NO0_ZERO,    &&op_ORA_ZERO,    &&op_ASL_ZERO,    &&op_SLO_ZERO,
+		/* 08 */ &&op_PHP,         &&op_ORA_IMM,     &&op_ASL_ACC,     &&op_AN0_IMM,
+		/* 0C */ &&op_NOP_ABS,     &&op_ORA_ABS,     &&op_ASL_ABS,     &&op_SLO_ABS,
+		/* 10 */ &&op_BPL,         &&op_ORA_IND_Y,   &&op_KI1,         &&op_SLO_IND_Y,
+		/* 14 */ &&op_NO0_ZERO_X,  &&op_ORA_ZERO_X,  &&op_ASL_ZERO_X,  &&op_SLO_ZERO_X,
+		/* 18 */ &&op_CLC,         &&op_ORA_ABS_Y,   &&op_NO0,         &&op_SLO_ABS_Y,
+		/* 1C */ &&op_NO0_ABS_X,   &&op_ORA_ABS_X,   &&op_ASL_ABS_X,   &&op_SLO_ABS_X,
+		/* 20 */ &&op_JSR_ABS,     &&op_AND_IND_X,   &&op_KI2,         &&op_RLA_IND_X,
+		/* 24 */ &&op_BIT_ZERO,    &&op_AND_ZERO,    &&op_ROL_ZERO,    &&op_RLA_ZERO,
+		/* 28 */ &&op_PLP,         &&op_AND_IMM,     &&op_ROL_ACC,     &&op_AN1_IMM,
+		/* 2C */ &&op_BIT_ABS,     &&op_AND_ABS,     &&op_ROL_ABS,     &&op_RLA_ABS,
+		/* 30 */ &&op_BMI,         &&op_AND_IND_Y,   &&op_KI3,         &&op_RLA_IND_Y,
+		/* 34 */ &&op_NO1_ZERO_X,  &&op_AND_ZERO_X,  &&op_ROL_ZERO_X,  &&op_RLA_ZERO_X,
+		/* 38 */ &&op_SEC,         &&op_AND_ABS_Y,   &&op_NO1,         &&op_RLA_ABS_Y,
+		/* 3C */ &&op_NO1_ABS_X,   &&op_AND_ABS_X,   &&op_ROL_ABS_X,   &&op_RLA_ABS_X,
+		/* 40 */ &&op_RTI,         &&op_EOR_IND_X,   &&op_KI4,         &&op_SRE_IND_X,
+		/* 44 */ &&op_NO1_ZERO,    &&op_EOR_ZERO,    &&op_LSR_ZERO,    &&op_SRE_ZERO,
+		/* 48 */ &&op_PHA,         &&op_EOR_IMM,     &&op_LSR_ACC,     &&op_ALR_IMM,
+		/* 4C */ &&op_JMP_ABS,     &&op_EOR_ABS,     &&op_LSR_ABS,     &&op_SRE_ABS,
+		/* 50 */ &&op_BVC,         &&op_EOR_IND_Y,   &&op_KI5,         &&op_SRE_IND_Y,
+		/* 54 */ &&op_NO2_ZERO_X,  &&op_EOR_ZERO_X,  &&op_LSR_ZERO_X,  &&op_SRE_ZERO_X,
+		/* 58 */ &&op_CLI,         &&op_EOR_ABS_Y,   &&op_NO2,         &&op_SRE_ABS_Y,
+		/* 5C */ &&op_NO2_ABS_X,   &&op_EOR_ABS_X,   &&op_LSR_ABS_X,   &&op_SRE_ABS_X,
+		/* 60 */ &&op_RTS,         &&op_ADC_IND_X,   &&op_KI6,         &&op_RRA_IND_X,
+		/* 64 */ &&op_NO2_ZERO,    &&op_ADC_ZERO,    &&op_ROR_ZERO,    &&op_RRA_ZERO,
+		/* 68 */ &&op_PLA,         &&op_ADC_IMM,     &&op_ROR_ACC,     &&op_ARR_IMM,
+		/* 6C */ &&op_JMP_IND,     &&op_ADC_ABS,     &&op_ROR_ABS,     &&op_RRA_ABS,
+		/* 70 */ &&op_BVS,         &&op_ADC_IND_Y,   &&op_KI7,         &&op_RRA_IND_Y,
+		/* 74 */ &&op_NO3_ZERO_X,  &&op_ADC_ZERO_X,  &&op_ROR_ZERO_X,  &&op_RRA_ZERO_X,
+		/* 78 */ &&op_SEI,         &&op_ADC_ABS_Y,   &&op_NO3,         &&op_RRA_ABS_Y,
+		/* 7C */ &&op_NO3_ABS_X,   &&op_ADC_ABS_X,   &&op_ROR_ABS_X,   &&op_RRA_ABS_X,
+		/* 80 */ &&op_NO0_IMM,     &&op_STA_IND_X,   &&op_NO1_IMM,     &&op_SAX_IND_X,
+		/* 84 */ &&op_STY_ZERO,    &&op_STA_ZERO,    &&op_STX_ZERO,    &&op_SAX_ZERO,
+		/* 88 */ &&op_DEY,         &&op_NO2_IMM,     &&op_TXA,         &&op_XAA_IMM,
+		/* 8C */ &&op_STY_ABS,     &&op_STA_ABS,     &&op_STX_ABS,     &&op_SAX_ABS,
+		/* 90 */ &&op_BCC,         &&op_STA_IND_Y,   &&op_KI8,         &&op_AXA_IND_Y,
+		/* 94 */ &&op_STY_ZERO_X,  &&op_STA_ZERO_X,  &&op_STX_ZERO_Y,  &&op_SAX_ZERO_Y,
+		/* 98 */ &&op_TYA,         &&op_STA_ABS_Y,   &&op_TXS,         &&op_TAS_ABS_Y,
+		/* 9C */ &&op_SAY_ABS_X,   &&op_STA_ABS_X,   &&op_XAS_ABS_Y,   &&op_AXA_ABS_Y,
+		/* A0 */ &&op_LDY_IMM,     &&op_LDA_IND_X,   &&op_LDX_IMM,     &&op_LAX_IND_X,
+		/* A4 */ &&op_LDY_ZERO,    &&op_LDA_ZERO,    &&op_LDX_ZERO,    &&op_LAX_ZERO,
+		/* A8 */ &&op_TAY,         &&op_LDA_IMM,     &&op_TAX,         &&op_ATX_IMM,
+		/* AC */ &&op_LDY_ABS,     &&op_LDA_ABS,     &&op_LDX_ABS,     &&op_LAX_ABS,
+		/* B0 */ &&op_BCS,         &&op_LDA_IND_Y,   &&op_KI9,         &&op_LAX_IND_Y,
+		/* B4 */ &&op_LDY_ZERO_X,  &&op_LDA_ZERO_X,  &&op_LDX_ZERO_Y,  &&op_LAX_ZERO_Y,
+		/* B8 */ &&op_CLV,         &&op_LDA_ABS_Y,   &&op_TSX,         &&op_LAS_ABS_Y,
+		/* BC */ &&op_LDY_ABS_X,   &&op_LDA_ABS_X,   &&op_LDX_ABS_Y,   &&op_LAX_ABS_Y,
+		/* C0 */ &&op_CPY_IMM,     &&op_CMP_IND_X,   &&op_NO3_IMM,     &&op_DCP_IND_X,
+		/* C4 */ &&op_CPY_ZERO,    &&op_CMP_ZERO,    &&op_DEC_ZERO,    &&op_DCP_ZERO,
+		/* C8 */ &&op_INY,         &&op_CMP_IMM,     &&op_DEX,         &&op_AXS_IMM,
+		/* CC */ &&op_CPY_ABS,     &&op_CMP_ABS,     &&op_DEC_ABS,     &&op_DCP_ABS,
+		/* D0 */ &&op_BNE,         &&op_CMP_IND_Y,   &&op_K10,         &&op_DCP_IND_Y,
+		/* D4 */ &&op_NO4_ZERO_X,  &&op_CMP_ZERO_X,  &&op_DEC_ZERO_X,  &&op_DCP_ZERO_X,
+		/* D8 */ &&op_CLD,         &&op_CMP_ABS_Y,   &&op_NO4,         &&op_DCP_ABS_Y,
+		/* DC */ &&op_NO4_ABS_X,   &&op_CMP_ABS_X,   &&op_DEC_ABS_X,   &&op_DCP_ABS_X,
+		/* E0 */ &&op_CPX_IMM,     &&op_SBC_IND_X,   &&op_NO4_IMM,     &&op_ISC_IND_X,
+		/* E4 */ &&op_CPX_ZERO,    &&op_SBC_ZERO,    &&op_INC_ZERO,    &&op_ISC_ZERO,
+		/* E8 */ &&op_INX,         &&op_SBC_IMM,     &&op_NOP,         &&op_SB2_IMM,
+		/* EC */ &&op_CPX_ABS,     &&op_SBC_ABS,     &&op_INC_ABS,     &&op_ISC_ABS,
+		/* F0 */ &&op_BEQ,         &&op_SBC_IND_Y,   &&op_K11,         &&op_ISC_IND_Y,
+		/* F4 */ &&op_NO5_ZERO_X,  &&op_SBC_ZERO_X,  &&op_INC_ZERO_X,  &&op_ISC_ZERO_X,
+		/* F8 */ &&op_SED,         &&op_SBC_ABS_Y,   &&op_NO5,         &&op_ISC_ABS_Y,
+		/* FC */ &&op_NO5_ABS_X,   &&op_SBC_ABS_X,   &&op_INC_ABS_X,   &&op_ISC_ABS_X,
+	};
 
 	for (;;) {
 
-		if (pending_event) {
-			pending_event = false;
-			process_pending_events();
+		// The events due at this boundary are handled before stopping, so
+		// that none are left half-done between calls (e.g. a $4014 write
+		// without its DMA)
+		if (cpu_cycle >= next_cpu_event_cycle) {
+			if (run_due_cpu_events() ||
+			    (stop_at_frame_end && frame_was_completed))
+				return true;
 
-			if (pending_end_emulation)
-				break;
+			if (dbg_attached() != debugging)
+				return false;
 		}
 
-		if (dbg_log_instruction())
-		{
+		if (cpu_cycle >= end_cycle)
+			break;
 
-			uint8_t const opcode = read_mem(pc++);
-			if (polls_irq_after_first_cycle[opcode])
-				poll_for_interrupt();
-			op_1 = read_mem(pc);
+		// dbg_log_instruction() returns false while the debugger is stepping
+		if (debugging && !dbg_log_instruction()) {
+			sleep_till_end_of_frame();
+			draw_frame();
+			handle_ui_keys();
+			continue;
+		}
 
-			// http://eli.thegreenplace.net/2012/07/12/computed-goto-for-efficient-dispatch-tables/
-			// could possibly speed this up a bit (also,
-			// https://www.cs.tcd.ie/David.Gregg/papers/toplas05.pdf). CPU
-			// emulation seems to account for less than 5% of the runtime though,
-			// so it might not be worth uglifying the code for
+		uint8_t const opcode = read_mem(pc++);
+		if (polls_irq_after_first_cycle[opcode])
+			poll_for_interrupt();
+		op_1 = read_mem(pc);
 
 #ifdef ENABLE_CORRUPTION
-			if (corrupt_chance) {
+		// Only costs the rand() calls while corruption is on
+		if (corrupt_chance) {
 			randcorrupt = (unsigned int)rand();
 			corrupt_now = ((unsigned int)rand() < corrupt_chance);
-			} else {randcorrupt = 0; corrupt_chance = 0;}
+		} else {randcorrupt = 0; corrupt_chance = 0;}
 #endif
 
-			switch (opcode) {
+		goto *handlers[opcode];
 
-				//
-				// Accumulator or implied addressing
-				//
+		// The handlers 'break' out of this loop when they're done
+		do {
 
-				case BRK:
-					++pc;
-					do_interrupt(Int_BRK);
-					break;
+			//
+			// Accumulator or implied addressing
+			//
 
-				case RTI:
-					read_tick(); // Corresponds to incrementing s
-					pull_flags();
-					pc = pull();
-					poll_for_interrupt();
-					pc |= pull() << 8;
-					break;
+			OP(BRK):
+				++pc;
+				do_interrupt(Int_BRK);
+				break;
 
-				case RTS:
-					{
-						read_tick(); // Corresponds to incrementing s
-						uint8_t const pc_low = pull();
-						pc = ((pull() << 8) | pc_low) + 1;
-						poll_for_interrupt();
-						read_tick(); // Increment PC
-					}
-					break;
+			OP(RTI):
+				read_tick(); // Corresponds to incrementing s
+				pull_flags();
+				pc = pull();
+				poll_for_interrupt();
+				pc |= pull() << 8;
+				break;
 
-				case PHA:
+			OP(RTS):
+				{
+					read_tick(); // Corresponds to incrementing s
+					uint8_t const pc_low = pull();
+					pc = ((pull() << 8) | pc_low) + 1;
 					poll_for_interrupt();
-					push(a);
-					break;
+					read_tick(); // Increment PC
+				}
+				break;
 
-				case PHP:
-					poll_for_interrupt();
-					push_flags(true);
-					break;
+			OP(PHA):
+				poll_for_interrupt();
+				push(a);
+				break;
 
-				case PLA:
-					read_tick(); // Corresponds to incrementing s
-					poll_for_interrupt();
-					zn = a = pull();
-					break;
+			OP(PHP):
+				poll_for_interrupt();
+				push_flags(true);
+				break;
 
-				case PLP:
-					read_tick(); // Corresponds to incrementing s
-					poll_for_interrupt();
-					pull_flags();
-					break;
+			OP(PLA):
+				read_tick(); // Corresponds to incrementing s
+				poll_for_interrupt();
+				zn = a = pull();
+				break;
+
+			OP(PLP):
+				read_tick(); // Corresponds to incrementing s
+				poll_for_interrupt();
+				pull_flags();
+				break;
 
-				case ASL_ACC: a = asl(a); break;
-				case LSR_ACC: a = lsr(a); break;
-				case ROL_ACC: a = rol(a); break;
-				case ROR_ACC: a = ror(a); break;
+			OP(ASL_ACC): a = asl(a); break;
+			OP(LSR_ACC): a = lsr(a); break;
+			OP(ROL_ACC): a = rol(a); break;
+			OP(ROR_ACC): a = ror(a); break;
 
 #ifdef ENABLE_CORRUPTION
-				case CLC: carry       = false ^ corrupt_now; break;
+			OP(CLC): carry       = false ^ corrupt_now; break;
 #else
-				case CLC: carry       = false; break;
+			OP(CLC): carry       = false; break;
 #endif
-				case CLD: decimal     = false; break;
-				case CLI: irq_disable = false; break;
-				case CLV: overflow    = false; break;
+			OP(CLD): decimal     = false; break;
+			OP(CLI): irq_disable = false; break;
+			OP(CLV): overflow    = false; break;
 #ifdef ENABLE_CORRUPTION
-				case SEC: carry       = true ^ corrupt_now; break;
+			OP(SEC): carry       = true ^ corrupt_now; break;
 #else
-				case SEC: carry       = true; break;
+			OP(SEC): carry       = true; break;
 #endif
-				case SED: decimal     = true;  break;
-				case SEI: irq_disable = true;  break;
-
-				case DEX: zn = --x; break;
-				case DEY: zn = --y; break;
-				case INX: zn = ++x; break;
-				case INY: zn = ++y; break;
-
-				case TAX: zn = x = a; break;
-				case TAY: zn = y = a; break;
-				case TSX: zn = x = s; break;
-				case TXA: zn = a = x; break;
-				case TXS:      s = x; break;
-				case TYA: zn = a = y; break;
-
-					  // The "official" NOP and various unofficial NOPs with
-					  // accumulator/implied addressing
-				case NOP: case NO0: case NO1: case NO2: case NO3: case NO4: case NO5:
-					  break;
-
-					  //
-					  // Immediate addressing
-					  //
-
-				case ADC_IMM: adc(op_1);     ++pc; break;
-				case ALR_IMM: alr(op_1);     ++pc; break; // Unofficial
-				case AN0_IMM: anc(op_1);     ++pc; break; // Unofficial
-				case AN1_IMM: anc(op_1);     ++pc; break; // Unofficial
-				case AND_IMM: and_(op_1);    ++pc; break;
-				case ARR_IMM: arr(op_1);     ++pc; break; // Unofficial
-				case ATX_IMM: atx(op_1);     ++pc; break; // Unofficial
-				case AXS_IMM: axs(op_1);     ++pc; break; // Unofficial
-				case CMP_IMM: comp(a, op_1); ++pc; break;
-				case CPX_IMM: comp(x, op_1); ++pc; break;
-				case CPY_IMM: comp(y, op_1); ++pc; break;
-				case EOR_IMM: eor(op_1);     ++pc; break;
-				case LDA_IMM: lda(op_1);     ++pc; break;
-				case LDX_IMM: ldx(op_1);     ++pc; break;
-				case LDY_IMM: ldy(op_1);     ++pc; break;
-				case ORA_IMM: ora(op_1);     ++pc; break;
-				case SB2_IMM: // Unofficial, same as SBC
-				case SBC_IMM: sbc(op_1);     ++pc; break;
-				case XAA_IMM: xaa(op_1);     ++pc; break; // Unofficial
-
-					      // Unofficial NOPs with immediate addressing
-				case NO0_IMM: case NO1_IMM: case NO2_IMM: case NO3_IMM: case NO4_IMM:
-					      ++pc;
-					      break;
-
-					      //
-					      // Absolute addressing
-					      //
-
-				case JMP_ABS:
-					      poll_for_interrupt();
-					      pc = (read_mem(pc + 1) << 8) | op_1;
-					      break;
-
-				case JSR_ABS:
-					      ++pc;
-
-					      read_tick(); // Internal operation
-
-					      push(pc >> 8);
-					      push(pc & 0xFF);
-
-					      poll_for_interrupt();
-					      pc = (read_mem(pc) << 8) | op_1;
-					      break;
-
-					      // Read instructions
-
-				case ADC_ABS: adc(get_abs_op());     break;
-				case AND_ABS: and_(get_abs_op());    break;
-				case BIT_ABS: bit(get_abs_op());     break;
-				case CMP_ABS: comp(a, get_abs_op()); break;
-				case CPX_ABS: comp(x, get_abs_op()); break;
-				case CPY_ABS: comp(y, get_abs_op()); break;
-				case EOR_ABS: eor(get_abs_op());     break;
-				case LAX_ABS: lax(get_abs_op());     break; // Unofficial
-				case LDA_ABS: lda(get_abs_op());     break;
-				case LDX_ABS: ldx(get_abs_op());     break;
-				case LDY_ABS: ldy(get_abs_op());     break;
-				case ORA_ABS: ora(get_abs_op());     break;
-				case SBC_ABS: sbc(get_abs_op());     break;
-
-					      // Unofficial NOP with absolute addressing (acts like a read)
-				case NOP_ABS: get_abs_op(); break;
-
-					      // Read-modify-write instructions
-
-				case ASL_ABS: RMW(asl, get_abs_addr()); break;
-				case DCP_ABS: RMW(dcp, get_abs_addr()); break; // Unofficial
-				case DEC_ABS: RMW(dec, get_abs_addr()); break;
-				case INC_ABS: RMW(inc, get_abs_addr()); break;
-				case ISC_ABS: RMW(isc, get_abs_addr()); break; // Unofficial
-				case LSR_ABS: RMW(lsr, get_abs_addr()); break;
-				case RLA_ABS: RMW(rla, get_abs_addr()); break; // Unofficial
-				case RRA_ABS: RMW(rra, get_abs_addr()); break; // Unofficial
-				case ROL_ABS: RMW(rol, get_abs_addr()); break;
-				case ROR_ABS: RMW(ror, get_abs_addr()); break;
-				case SLO_ABS: RMW(slo, get_abs_addr()); break; // Unofficial
-				case SRE_ABS: RMW(sre, get_abs_addr()); break; // Unofficial
-
-					      // Write instructions
-
-				case SAX_ABS: abs_write(a & x); break; // Unofficial
-				case STA_ABS: abs_write(a);     break;
-				case STX_ABS: abs_write(x);     break;
-				case STY_ABS: abs_write(y);     break;
-
-					      //
-					      // Zero page addressing
-					      //
-
-					      // Read instructions
-
-				case ADC_ZERO: adc(get_zero_op());     break;
-				case AND_ZERO: and_(get_zero_op());    break;
-				case BIT_ZERO: bit(get_zero_op());     break;
-				case CMP_ZERO: comp(a, get_zero_op()); break;
-				case CPX_ZERO: comp(x, get_zero_op()); break;
-				case CPY_ZERO: comp(y, get_zero_op()); break;
-				case EOR_ZERO: eor(get_zero_op());     break;
-				case LAX_ZERO: lax(get_zero_op());     break; // Unofficial
-				case LDA_ZERO: lda(get_zero_op());     break;
-				case LDX_ZERO: ldx(get_zero_op());     break;
-				case LDY_ZERO: ldy(get_zero_op());     break;
-				case ORA_ZERO: ora(get_zero_op());     break;
-				case SBC_ZERO: sbc(get_zero_op());     break;
-
-					       // Read-modify-write instructions
-
-				case ASL_ZERO: ZERO_RMW(asl); break;
-				case DCP_ZERO: ZERO_RMW(dcp); break; // Unofficial
-				case DEC_ZERO: ZERO_RMW(dec); break;
-				case INC_ZERO: ZERO_RMW(inc); break;
-				case ISC_ZERO: ZERO_RMW(isc); break; // Unofficial
-				case LSR_ZERO: ZERO_RMW(lsr); break;
-				case RLA_ZERO: ZERO_RMW(rla); break; // Unofficial
-				case RRA_ZERO: ZERO_RMW(rra); break; // Unofficial
-				case ROL_ZERO: ZERO_RMW(rol); break;
-				case ROR_ZERO: ZERO_RMW(ror); break;
-				case SLO_ZERO: ZERO_RMW(slo); break; // Unofficial
-				case SRE_ZERO: ZERO_RMW(sre); break; // Unofficial
-
-					       // Write instructions
-
-				case SAX_ZERO: zero_write(a & x); break; // Unofficial
-				case STA_ZERO: zero_write(a);     break;
-				case STX_ZERO: zero_write(x);     break;
-				case STY_ZERO: zero_write(y);     break;
-
-					       // Unofficial NOPs with zero page addressing (acts like reads)
-				case NO0_ZERO: case NO1_ZERO: case NO2_ZERO:
-					       get_zero_op();
-					       break;
-
-					       //
-					       // Zero page indexed addressing
-					       //
-
-					       // Read instructions
-
-				case ADC_ZERO_X: adc(get_zero_xy_op(x));     break;
-				case AND_ZERO_X: and_(get_zero_xy_op(x));    break;
-				case CMP_ZERO_X: comp(a, get_zero_xy_op(x)); break;
-				case EOR_ZERO_X: eor(get_zero_xy_op(x));     break;
-				case LAX_ZERO_Y: lax(get_zero_xy_op(y));     break; // Unofficial
-				case LDA_ZERO_X: lda(get_zero_xy_op(x));     break;
-				case LDX_ZERO_Y: ldx(get_zero_xy_op(y));     break;
-				case LDY_ZERO_X: ldy(get_zero_xy_op(x));     break;
-				case ORA_ZERO_X: ora(get_zero_xy_op(x));     break;
-				case SBC_ZERO_X: sbc(get_zero_xy_op(x));     break;
-
-						 // Read-modify-write instructions
-
-				case ASL_ZERO_X: ZERO_X_RMW(asl); break;
-				case DCP_ZERO_X: ZERO_X_RMW(dcp); break; // Unofficial
-				case DEC_ZERO_X: ZERO_X_RMW(dec); break;
-				case INC_ZERO_X: ZERO_X_RMW(inc); break;
-				case ISC_ZERO_X: ZERO_X_RMW(isc); break; // Unofficial
-				case LSR_ZERO_X: ZERO_X_RMW(lsr); break;
-				case RLA_ZERO_X: ZERO_X_RMW(rla); break; // Unofficial
-				case RRA_ZERO_X: ZERO_X_RMW(rra); break; // Unofficial
-				case ROL_ZERO_X: ZERO_X_RMW(rol); break;
-				case ROR_ZERO_X: ZERO_X_RMW(ror); break;
-				case SLO_ZERO_X: ZERO_X_RMW(slo); break; // Unofficial
-				case SRE_ZERO_X: ZERO_X_RMW(sre); break; // Unofficial
-
-						 // Write instructions
-
-				case SAX_ZERO_Y: zero_xy_write(a & x, y); break; // Unofficial
-				case STA_ZERO_X: zero_xy_write(a, x);     break;
-				case STX_ZERO_Y: zero_xy_write(x, y);     break;
-				case STY_ZERO_X: zero_xy_write(y, x);     break;
-
-						 // Unofficial NOPs with indexed zero page addressing (acts like reads)
-				case NO0_ZERO_X: case NO1_ZERO_X: case NO2_ZERO_X: case NO3_ZERO_X:
-				case NO4_ZERO_X: case NO5_ZERO_X:
-						 get_zero_xy_op(x);
-						 break;
-
-						 //
-						 // Absolute indexed addressing
-						 //
-
-						 // Read instructions
-
-				case ADC_ABS_X: adc(get_abs_xy_op_read(x));     break;
-				case ADC_ABS_Y: adc(get_abs_xy_op_read(y));     break;
-				case AND_ABS_X: and_(get_abs_xy_op_read(x));    break;
-				case AND_ABS_Y: and_(get_abs_xy_op_read(y));    break;
-				case CMP_ABS_X: comp(a, get_abs_xy_op_read(x)); break;
-				case CMP_ABS_Y: comp(a, get_abs_xy_op_read(y)); break;
-				case EOR_ABS_X: eor(get_abs_xy_op_read(x));     break;
-				case EOR_ABS_Y: eor(get_abs_xy_op_read(y));     break;
-				case LAS_ABS_Y: las(get_abs_xy_op_read(y));     break; // Unofficial
-				case LAX_ABS_Y: lax(get_abs_xy_op_read(y));     break; // Unofficial
-				case LDA_ABS_X: lda(get_abs_xy_op_read(x));     break;
-				case LDA_ABS_Y: lda(get_abs_xy_op_read(y));     break;
-				case LDX_ABS_Y: ldx(get_abs_xy_op_read(y));     break;
-				case LDY_ABS_X: ldy(get_abs_xy_op_read(x));     break;
-				case ORA_ABS_X: ora(get_abs_xy_op_read(x));     break;
-				case ORA_ABS_Y: ora(get_abs_xy_op_read(y));     break;
-				case SBC_ABS_X: sbc(get_abs_xy_op_read(x));     break;
-				case SBC_ABS_Y: sbc(get_abs_xy_op_read(y));     break;
-
-						// Read-modify-write instructions
-
-				case ASL_ABS_X: RMW(asl, get_abs_xy_addr_write(x)); break;
-				case DCP_ABS_X: RMW(dcp, get_abs_xy_addr_write(x)); break; // Unofficial
-				case DCP_ABS_Y: RMW(dcp, get_abs_xy_addr_write(y)); break; // Unofficial
-				case DEC_ABS_X: RMW(dec, get_abs_xy_addr_write(x)); break;
-				case INC_ABS_X: RMW(inc, get_abs_xy_addr_write(x)); break;
-				case ISC_ABS_X: RMW(isc, get_abs_xy_addr_write(x)); break; // Unofficial
-				case ISC_ABS_Y: RMW(isc, get_abs_xy_addr_write(y)); break; // Unofficial
-				case LSR_ABS_X: RMW(lsr, get_abs_xy_addr_write(x)); break;
-				case RLA_ABS_X: RMW(rla, get_abs_xy_addr_write(x)); break; // Unofficial
-				case RLA_ABS_Y: RMW(rla, get_abs_xy_addr_write(y)); break; // Unofficial
-				case RRA_ABS_X: RMW(rra, get_abs_xy_addr_write(x)); break; // Unofficial
-				case RRA_ABS_Y: RMW(rra, get_abs_xy_addr_write(y)); break; // Unofficial
-				case ROL_ABS_X: RMW(rol, get_abs_xy_addr_write(x)); break;
-				case ROR_ABS_X: RMW(ror, get_abs_xy_addr_write(x)); break;
-				case SLO_ABS_X: RMW(slo, get_abs_xy_addr_write(x)); break; // Unofficial
-				case SLO_ABS_Y: RMW(slo, get_abs_xy_addr_write(y)); break; // Unofficial
-				case SRE_ABS_X: RMW(sre, get_abs_xy_addr_write(x)); break; // Unofficial
-				case SRE_ABS_Y: RMW(sre, get_abs_xy_addr_write(y)); break; // Unofficial
-
-						// Write instructions
-
-				case AXA_ABS_Y: unoff_addr_write(get_abs_addr(), a & x, y); break; // Unofficial
-				case SAY_ABS_X: unoff_addr_write(get_abs_addr(), y    , x); break; // Unofficial
-				case XAS_ABS_Y: unoff_addr_write(get_abs_addr(), x    , y); break; // Unofficial
-						// Unofficial
-				case TAS_ABS_Y:
-						s = a & x;
-						unoff_addr_write(get_abs_addr(), a & x, y);
-						break;
+			OP(SED): decimal     = true;  break;
+			OP(SEI): irq_disable = true;  break;
+
+			OP(DEX): zn = --x; break;
+			OP(DEY): zn = --y; break;
+			OP(INX): zn = ++x; break;
+			OP(INY): zn = ++y; break;
+
+			OP(TAX): zn = x = a; break;
+			OP(TAY): zn = y = a; break;
+			OP(TSX): zn = x = s; break;
+			OP(TXA): zn = a = x; break;
+			OP(TXS):      s = x; break;
+			OP(TYA): zn = a = y; break;
+
+				  // The "official" NOP and various unofficial NOPs with
+				  // accumulator/implied addressing
+			OP(NOP): OP(NO0): OP(NO1): OP(NO2): OP(NO3): OP(NO4): OP(NO5):
+				  break;
+
+				  //
+				  // Immediate addressing
+				  //
+
+			OP(ADC_IMM): adc(op_1);     ++pc; break;
+			OP(ALR_IMM): alr(op_1);     ++pc; break; // Unofficial
+			OP(AN0_IMM): anc(op_1);     ++pc; break; // Unofficial
+			OP(AN1_IMM): anc(op_1);     ++pc; break; // Unofficial
+			OP(AND_IMM): and_(op_1);    ++pc; break;
+			OP(ARR_IMM): arr(op_1);     ++pc; break; // Unofficial
+			OP(ATX_IMM): atx(op_1);     ++pc; break; // Unofficial
+			OP(AXS_IMM): axs(op_1);     ++pc; break; // Unofficial
+			OP(CMP_IMM): comp(a, op_1); ++pc; break;
+			OP(CPX_IMM): comp(x, op_1); ++pc; break;
+			OP(CPY_IMM): comp(y, op_1); ++pc; break;
+			OP(EOR_IMM): eor(op_1);     ++pc; break;
+			OP(LDA_IMM): lda(op_1);     ++pc; break;
+			OP(LDX_IMM): ldx(op_1);     ++pc; break;
+			OP(LDY_IMM): ldy(op_1);     ++pc; break;
+			OP(ORA_IMM): ora(op_1);     ++pc; break;
+			OP(SB2_IMM): // Unofficial, same as SBC
+			OP(SBC_IMM): sbc(op_1);     ++pc; break;
+			OP(XAA_IMM): xaa(op_1);     ++pc; break; // Unofficial
+
+				      // Unofficial NOPs with immediate addressing
+			OP(NO0_IMM): OP(NO1_IMM): OP(NO2_IMM): OP(NO3_IMM): OP(NO4_IMM):
+				      ++pc;
+				      break;
+
+				      //
+				      // Absolute addressing
+				      //
+
+			OP(JMP_ABS):
+				      poll_for_interrupt();
+				      pc = (read_mem(pc + 1) << 8) | op_1;
+				      break;
+
+			OP(JSR_ABS):
+				      ++pc;
+
+				      read_tick(); // Internal operation
+
+				      push(pc >> 8);
+				      push(pc & 0xFF);
+
+				      poll_for_interrupt();
+				      pc = (read_mem(pc) << 8) | op_1;
+				      break;
+
+				      // Read instructions
+
+			OP(ADC_ABS): adc(get_abs_op());     break;
+			OP(AND_ABS): and_(get_abs_op());    break;
+			OP(BIT_ABS): bit(get_abs_op());     break;
+			OP(CMP_ABS): comp(a, get_abs_op()); break;
+			OP(CPX_ABS): comp(x, get_abs_op()); break;
+			OP(CPY_ABS): comp(y, get_abs_op()); break;
+			OP(EOR_ABS): eor(get_abs_op());     break;
+			OP(LAX_ABS): lax(get_abs_op());     break; // Unofficial
+			OP(LDA_ABS): lda(get_abs_op());     break;
+			OP(LDX_ABS): ldx(get_abs_op());     break;
+			OP(LDY_ABS): ldy(get_abs_op());     break;
+			OP(ORA_ABS): ora(get_abs_op());     break;
+			OP(SBC_ABS): sbc(get_abs_op());     break;
+
+				      // Unofficial NOP with absolute addressing (acts like a read)
+			OP(NOP_ABS): get_abs_op(); break;
+
+				      // Read-modify-write instructions
+
+			OP(ASL_ABS): RMW(asl, get_abs_addr()); break;
+			OP(DCP_ABS): RMW(dcp, get_abs_addr()); break; // Unofficial
+			OP(DEC_ABS): RMW(dec, get_abs_addr()); break;
+			OP(INC_ABS): RMW(inc, get_abs_addr()); break;
+			OP(ISC_ABS): RMW(isc, get_abs_addr()); break; // Unofficial
+			OP(LSR_ABS): RMW(lsr, get_abs_addr()); break;
+			OP(RLA_ABS): RMW(rla, get_abs_addr()); break; // Unofficial
+			OP(RRA_ABS): RMW(rra, get_abs_addr()); break; // Unofficial
+			OP(ROL_ABS): RMW(rol, get_abs_addr()); break;
+			OP(ROR_ABS): RMW(ror, get_abs_addr()); break;
+			OP(SLO_ABS): RMW(slo, get_abs_addr()); break; // Unofficial
+			OP(SRE_ABS): RMW(sre, get_abs_addr()); break; // Unofficial
+
+				      // Write instructions
+
+			OP(SAX_ABS): abs_write(a & x); break; // Unofficial
+			OP(STA_ABS): abs_write(a);     break;
+			OP(STX_ABS): abs_write(x);     break;
+			OP(STY_ABS): abs_write(y);     break;
+
+				      //
+				      // Zero page addressing
+				      //
+
+				      // Read instructions
+
+			OP(ADC_ZERO): adc(get_zero_op());     break;
+			OP(AND_ZERO): and_(get_zero_op());    break;
+			OP(BIT_ZERO): bit(get_zero_op());     break;
+			OP(CMP_ZERO): comp(a, get_zero_op()); break;
+			OP(CPX_ZERO): comp(x, get_zero_op()); break;
+			OP(CPY_ZERO): comp(y, get_zero_op()); break;
+			OP(EOR_ZERO): eor(get_zero_op());     break;
+			OP(LAX_ZERO): lax(get_zero_op());     break; // Unofficial
+			OP(LDA_ZERO): lda(get_zero_op());     break;
+			OP(LDX_ZERO): ldx(get_zero_op());     break;
+			OP(LDY_ZERO): ldy(get_zero_op());     break;
+			OP(ORA_ZERO): ora(get_zero_op());     break;
+			OP(SBC_ZERO): sbc(get_zero_op());     break;
+
+				       // Read-modify-write instructions
+
+			OP(ASL_ZERO): ZERO_RMW(asl); break;
+			OP(DCP_ZERO): ZERO_RMW(dcp); break; // Unofficial
+			OP(DEC_ZERO): ZERO_RMW(dec); break;
+			OP(INC_ZERO): ZERO_RMW(inc); break;
+			OP(ISC_ZERO): ZERO_RMW(isc); break; // Unofficial
+			OP(LSR_ZERO): ZERO_RMW(lsr); break;
+			OP(RLA_ZERO): ZERO_RMW(rla); break; // Unofficial
+			OP(RRA_ZERO): ZERO_RMW(rra); break; // Unofficial
+			OP(ROL_ZERO): ZERO_RMW(rol); break;
+			OP(ROR_ZERO): ZERO_RMW(ror); break;
+			OP(SLO_ZERO): ZERO_RMW(slo); break; // Unofficial
+			OP(SRE_ZERO): ZERO_RMW(sre); break; // Unofficial
+
+				       // Write instructions
+
+			OP(SAX_ZERO): zero_write(a & x); break; // Unofficial
+			OP(STA_ZERO): zero_write(a);     break;
+			OP(STX_ZERO): zero_write(x);     break;
+			OP(STY_ZERO): zero_write(y);     break;
+
+				       // Unofficial NOPs with zero page addressing (acts like reads)
+			OP(NO0_ZERO): OP(NO1_ZERO): OP(NO2_ZERO):
+				       get_zero_op();
+				       break;
+
+				       //
+				       // Zero page indexed addressing
+				       //
+
+				       // Read instructions
+
+			OP(ADC_ZERO_X): adc(get_zero_xy_op(x));     break;
+			OP(AND_ZERO_X): and_(get_zero_xy_op(x));    break;
+			OP(CMP_ZERO_X): comp(a, get_zero_xy_op(x)); break;
+			OP(EOR_ZERO_X): eor(get_zero_xy_op(x));     break;
+			OP(LAX_ZERO_Y): lax(get_zero_xy_op(y));     break; // Unofficial
+			OP(LDA_ZERO_X): lda(get_zero_xy_op(x));     break;
+			OP(LDX_ZERO_Y): ldx(get_zero_xy_op(y));     break;
+			OP(LDY_ZERO_X): ldy(get_zero_xy_op(x));     break;
+			OP(ORA_ZERO_X): ora(get_zero_xy_op(x));     break;
+			OP(SBC_ZERO_X): sbc(get_zero_xy_op(x));     break;
+
+					 // Read-modify-write instructions
+
+			OP(ASL_ZERO_X): ZERO_X_RMW(asl); break;
+			OP(DCP_ZERO_X): ZERO_X_RMW(dcp); break; // Unofficial
+			OP(DEC_ZERO_X): ZERO_X_RMW(dec); break;
+			OP(INC_ZERO_X): ZERO_X_RMW(inc); break;
+			OP(ISC_ZERO_X): ZERO_X_RMW(isc); break; // Unofficial
+			OP(LSR_ZERO_X): ZERO_X_RMW(lsr); break;
+			OP(RLA_ZERO_X): ZERO_X_RMW(rla); break; // Unofficial
+			OP(RRA_ZERO_X): ZERO_X_RMW(rra); break; // Unofficial
+			OP(ROL_ZERO_X): ZERO_X_RMW(rol); break;
+			OP(ROR_ZERO_X): ZERO_X_RMW(ror); break;
+			OP(SLO_ZERO_X): ZERO_X_RMW(slo); break; // Unofficial
+			OP(SRE_ZERO_X): ZERO_X_RMW(sre); break; // Unofficial
+
+					 // Write instructions
+
+			OP(SAX_ZERO_Y): zero_xy_write(a & x, y); break; // Unofficial
+			OP(STA_ZERO_X): zero_xy_write(a, x);     break;
+			OP(STX_ZERO_Y): zero_xy_write(x, y);     break;
+			OP(STY_ZERO_X): zero_xy_write(y, x);     break;
+
+					 // Unofficial NOPs with indexed zero page addressing (acts like reads)
+			OP(NO0_ZERO_X): OP(NO1_ZERO_X): OP(NO2_ZERO_X): OP(NO3_ZERO_X):
+			OP(NO4_ZERO_X): OP(NO5_ZERO_X):
+					 get_zero_xy_op(x);
+					 break;
+
+					 //
+					 // Absolute indexed addressing
+					 //
+
+					 // Read instructions
+
+			OP(ADC_ABS_X): adc(get_abs_xy_op_read(x));     break;
+			OP(ADC_ABS_Y): adc(get_abs_xy_op_read(y));     break;
+			OP(AND_ABS_X): and_(get_abs_xy_op_read(x));    break;
+			OP(AND_ABS_Y): and_(get_abs_xy_op_read(y));    break;
+			OP(CMP_ABS_X): comp(a, get_abs_xy_op_read(x)); break;
+			OP(CMP_ABS_Y): comp(a, get_abs_xy_op_read(y)); break;
+			OP(EOR_ABS_X): eor(get_abs_xy_op_read(x));     break;
+			OP(EOR_ABS_Y): eor(get_abs_xy_op_read(y));     break;
+			OP(LAS_ABS_Y): las(get_abs_xy_op_read(y));     break; // Unofficial
+			OP(LAX_ABS_Y): lax(get_abs_xy_op_read(y));     break; // Unofficial
+			OP(LDA_ABS_X): lda(get_abs_xy_op_read(x));     break;
+			OP(LDA_ABS_Y): lda(get_abs_xy_op_read(y));     break;
+			OP(LDX_ABS_Y): ldx(get_abs_xy_op_read(y));     break;
+			OP(LDY_ABS_X): ldy(get_abs_xy_op_read(x));     break;
+			OP(ORA_ABS_X): ora(get_abs_xy_op_read(x));     break;
+			OP(ORA_ABS_Y): ora(get_abs_xy_op_read(y));     break;
+			OP(SBC_ABS_X): sbc(get_abs_xy_op_read(x));     break;
+			OP(SBC_ABS_Y): sbc(get_abs_xy_op_read(y));     break;
+
+					// Read-modify-write instructions
+
+			OP(ASL_ABS_X): RMW(asl, get_abs_xy_addr_write(x)); break;
+			OP(DCP_ABS_X): RMW(dcp, get_abs_xy_addr_write(x)); break; // Unofficial
+			OP(DCP_ABS_Y): RMW(dcp, get_abs_xy_addr_write(y)); break; // Unofficial
+			OP(DEC_ABS_X): RMW(dec, get_abs_xy_addr_write(x)); break;
+			OP(INC_ABS_X): RMW(inc, get_abs_xy_addr_write(x)); break;
+			OP(ISC_ABS_X): RMW(isc, get_abs_xy_addr_write(x)); break; // Unofficial
+			OP(ISC_ABS_Y): RMW(isc, get_abs_xy_addr_write(y)); break; // Unofficial
+			OP(LSR_ABS_X): RMW(lsr, get_abs_xy_addr_write(x)); break;
+			OP(RLA_ABS_X): RMW(rla, get_abs_xy_addr_write(x)); break; // Unofficial
+			OP(RLA_ABS_Y): RMW(rla, get_abs_xy_addr_write(y)); break; // Unofficial
+			OP(RRA_ABS_X): RMW(rra, get_abs_xy_addr_write(x)); break; // Unofficial
+			OP(RRA_ABS_Y): RMW(rra, get_abs_xy_addr_write(y)); break; // Unofficial
+			OP(ROL_ABS_X): RMW(rol, get_abs_xy_addr_write(x)); break;
+			OP(ROR_ABS_X): RMW(ror, get_abs_xy_addr_write(x)); break;
+			OP(SLO_ABS_X): RMW(slo, get_abs_xy_addr_write(x)); break; // Unofficial
+			OP(SLO_ABS_Y): RMW(slo, get_abs_xy_addr_write(y)); break; // Unofficial
+			OP(SRE_ABS_X): RMW(sre, get_abs_xy_addr_write(x)); break; // Unofficial
+			OP(SRE_ABS_Y): RMW(sre, get_abs_xy_addr_write(y)); break; // Unofficial
+
+					// Write instructions
+
+			OP(AXA_ABS_Y): unoff_addr_write(get_abs_addr(), a & x, y); break; // Unofficial
+			OP(SAY_ABS_X): unoff_addr_write(get_abs_addr(), y    , x); break; // Unofficial
+			OP(XAS_ABS_Y): unoff_addr_write(get_abs_addr(), x    , y); break; // Unofficial
+					// Unofficial
+			OP(TAS_ABS_Y):
+					s = a & x;
+					unoff_addr_write(get_abs_addr(), a & x, y);
+					break;
 
-				case STA_ABS_X: abs_xy_write_a(x); break;
-				case STA_ABS_Y: abs_xy_write_a(y); break;
+			OP(STA_ABS_X): abs_xy_write_a(x); break;
+			OP(STA_ABS_Y): abs_xy_write_a(y); break;
 
-						// Unofficial NOPs with absolute,x addressing (acts like reads)
-				case NO0_ABS_X: case NO1_ABS_X: case NO2_ABS_X: case NO3_ABS_X: case NO4_ABS_X:
-				case NO5_ABS_X:
-						get_abs_xy_op_read(x);
-						break;
+					// Unofficial NOPs with absolute,x addressing (acts like reads)
+			OP(NO0_ABS_X): OP(NO1_ABS_X): OP(NO2_ABS_X): OP(NO3_ABS_X): OP(NO4_ABS_X):
+			OP(NO5_ABS_X):
+					get_abs_xy_op_read(x);
+					break;
+
+					//
+					// Indexed indirect addressing
+					//
+
+					// Read instructions
+
+			OP(ADC_IND_X): adc(get_ind_x_op());     break;
+			OP(AND_IND_X): and_(get_ind_x_op());    break;
+			OP(CMP_IND_X): comp(a, get_ind_x_op()); break;
+			OP(EOR_IND_X): eor(get_ind_x_op());     break;
+			OP(LAX_IND_X): lax(get_ind_x_op());     break; // Unofficial
+			OP(LDA_IND_X): lda(get_ind_x_op());     break;
+			OP(ORA_IND_X): ora(get_ind_x_op());     break;
+			OP(SBC_IND_X): sbc(get_ind_x_op());     break;
+
+					// Write instructions
+
+			OP(SAX_IND_X): ind_x_write(a & x); break; // Unofficial
+			OP(STA_IND_X): ind_x_write(a);     break;
+
+					// Read-modify-write instructions
+
+			OP(DCP_IND_X): RMW(dcp, get_ind_x_addr()); break; // Unofficial
+			OP(ISC_IND_X): RMW(isc, get_ind_x_addr()); break; // Unofficial
+			OP(RLA_IND_X): RMW(rla, get_ind_x_addr()); break; // Unofficial
+			OP(RRA_IND_X): RMW(rra, get_ind_x_addr()); break; // Unofficial
+			OP(SLO_IND_X): RMW(slo, get_ind_x_addr()); break; // Unofficial
+			OP(SRE_IND_X): RMW(sre, get_ind_x_addr()); break; // Unofficial
+
+					//
+					// Indirect indexed addressing
+					//
+
+					// Read instructions
+
+			OP(ADC_IND_Y): adc(get_ind_y_op_read());     break;
+			OP(AND_IND_Y): and_(get_ind_y_op_read());    break;
+			OP(CMP_IND_Y): comp(a, get_ind_y_op_read()); break;
+			OP(EOR_IND_Y): eor(get_ind_y_op_read());     break;
+			OP(LAX_IND_Y): lax(get_ind_y_op_read());     break; // Unofficial
+			OP(LDA_IND_Y): lda(get_ind_y_op_read());     break;
+			OP(ORA_IND_Y): ora(get_ind_y_op_read());     break;
+			OP(SBC_IND_Y): sbc(get_ind_y_op_read());     break;
+
+					// Write instructions
+
+					// Unofficial
+			OP(AXA_IND_Y):
+					unoff_addr_write(get_addr_from_zero_page(), a & x, y);
+					break;
+
+			OP(STA_IND_Y): ind_y_write_a(); break;
 
-						//
-						// Indexed indirect addressing
-						//
-
-						// Read instructions
-
-				case ADC_IND_X: adc(get_ind_x_op());     break;
-				case AND_IND_X: and_(get_ind_x_op());    break;
-				case CMP_IND_X: comp(a, get_ind_x_op()); break;
-				case EOR_IND_X: eor(get_ind_x_op());     break;
-				case LAX_IND_X: lax(get_ind_x_op());     break; // Unofficial
-				case LDA_IND_X: lda(get_ind_x_op());     break;
-				case ORA_IND_X: ora(get_ind_x_op());     break;
-				case SBC_IND_X: sbc(get_ind_x_op());     break;
-
-						// Write instructions
-
-				case SAX_IND_X: ind_x_write(a & x); break; // Unofficial
-				case STA_IND_X: ind_x_write(a);     break;
-
-						// Read-modify-write instructions
-
-				case DCP_IND_X: RMW(dcp, get_ind_x_addr()); break; // Unofficial
-				case ISC_IND_X: RMW(isc, get_ind_x_addr()); break; // Unofficial
-				case RLA_IND_X: RMW(rla, get_ind_x_addr()); break; // Unofficial
-				case RRA_IND_X: RMW(rra, get_ind_x_addr()); break; // Unofficial
-				case SLO_IND_X: RMW(slo, get_ind_x_addr()); break; // Unofficial
-				case SRE_IND_X: RMW(sre, get_ind_x_addr()); break; // Unofficial
-
-						//
-						// Indirect indexed addressing
-						//
-
-						// Read instructions
-
-				case ADC_IND_Y: adc(get_ind_y_op_read());     break;
-				case AND_IND_Y: and_(get_ind_y_op_read());    break;
-				case CMP_IND_Y: comp(a, get_ind_y_op_read()); break;
-				case EOR_IND_Y: eor(get_ind_y_op_read());     break;
-				case LAX_IND_Y: lax(get_ind_y_op_read());     break; // Unofficial
-				case LDA_IND_Y: lda(get_ind_y_op_read());     break;
-				case ORA_IND_Y: ora(get_ind_y_op_read());     break;
-				case SBC_IND_Y: sbc(get_ind_y_op_read());     break;
-
-						// Write instructions
-
-						// Unofficial
-				case AXA_IND_Y:
-						++pc;
-						read_tick(); // Fetch effective address low
-						read_tick(); // Fetch effective address high
-						unoff_addr_write(
-								(ram[(op_1 + 1) & 0xFF] << 8) | ram[op_1], // Address
-								a & x, y);
+					// Read-modify-write instructions
+
+			OP(DCP_IND_Y): RMW(dcp, get_ind_y_addr_write()); break; // Unofficial
+			OP(ISC_IND_Y): RMW(isc, get_ind_y_addr_write()); break; // Unofficial
+			OP(RLA_IND_Y): RMW(rla, get_ind_y_addr_write()); break; // Unofficial
+			OP(RRA_IND_Y): RMW(rra, get_ind_y_addr_write()); break; // Unofficial
+			OP(SLO_IND_Y): RMW(slo, get_ind_y_addr_write()); break; // Unofficial
+			OP(SRE_IND_Y): RMW(sre, get_ind_y_addr_write()); break; // Unofficial
+
+					//
+					// Indirect addressing
+					//
+
+			OP(JMP_IND):
+					{
+						uint16_t const addr = (read_mem(pc + 1) << 8) | op_1;
+						pc = read_mem(addr);
+						poll_for_interrupt();
+						pc |= read_mem((addr & 0xFF00) | ((addr + 1) & 0xFF)) << 8;
 						break;
+					}
 
-				case STA_IND_Y: ind_y_write_a(); break;
-
-						// Read-modify-write instructions
-
-				case DCP_IND_Y: RMW(dcp, get_ind_y_addr_write()); break; // Unofficial
-				case ISC_IND_Y: RMW(isc, get_ind_y_addr_write()); break; // Unofficial
-				case RLA_IND_Y: RMW(rla, get_ind_y_addr_write()); break; // Unofficial
-				case RRA_IND_Y: RMW(rra, get_ind_y_addr_write()); break; // Unofficial
-				case SLO_IND_Y: RMW(slo, get_ind_y_addr_write()); break; // Unofficial
-				case SRE_IND_Y: RMW(sre, get_ind_y_addr_write()); break; // Unofficial
-
-						//
-						// Indirect addressing
-						//
-
-				case JMP_IND:
-						{
-							uint16_t const addr = (read_mem(pc + 1) << 8) | op_1;
-							pc = read_mem(addr);
-							poll_for_interrupt();
-							pc |= read_mem((addr & 0xFF00) | ((addr + 1) & 0xFF)) << 8;
-							break;
-						}
-
-						//
-						// Branch instructions
-						//
-
-				case BCC: branch_if(!carry);        break;
-				case BCS: branch_if(carry);         break;
-				case BVC: branch_if(!overflow);     break;
-				case BVS: branch_if(overflow);      break;
-				case BEQ: branch_if(!(zn & 0xFF));  break;
-				case BMI: branch_if(zn & 0x180);    break;
-				case BNE: branch_if(zn & 0xFF);     break;
-				case BPL: branch_if(!(zn & 0x180)); break;
-
-					  //
-					  // KIL instructions (hang the CPU)
-					  //
-
-				case KI0: case KI1: case KI2: case KI3: case KI4: case KI5:
-				case KI6: case KI7: case KI8: case KI9: case K10: case K11:
+					//
+					// Branch instructions
+					//
+
+			OP(BCC): branch_if(!carry);        break;
+			OP(BCS): branch_if(carry);         break;
+			OP(BVC): branch_if(!overflow);     break;
+			OP(BVS): branch_if(overflow);      break;
+			OP(BEQ): branch_if(!(zn & 0xFF));  break;
+			OP(BMI): branch_if(zn & 0x180);    break;
+			OP(BNE): branch_if(zn & 0xFF);     break;
+			OP(BPL): branch_if(!(zn & 0x180)); break;
+
+				  //
+				  // KIL instructions (hang the CPU)
+				  //
+
+			OP(KI0): OP(KI1): OP(KI2): OP(KI3): OP(KI4): OP(KI5):
+			OP(KI6): OP(KI7): OP(KI8): OP(KI9): OP(K10): OP(K11):
 #ifdef ENABLE_CORRUPTION
-					  if (!corrupt_chance) { //the user wants corruptions, not resettions.
+				  if (!corrupt_chance) { //the user wants corruptions, not resettions.
 #endif
-						  reset_cpu(); 
-						  puts("KIL instruction executed, system hung. Resetting.");
+					  reset_cpu(); 
+					  puts("KIL instruction executed, system hung. Resetting.");
 #ifdef ENABLE_CORRUPTION
-					  }
+				  }
 #endif
-					  //end_emulation();
-					  //exit_sdl_thread();
-			}
-		} else {
-			sleep_till_end_of_frame();
-			draw_frame();
-			handle_ui_keys();
-		}
+				  //end_emulation();
+				  //exit_sdl_thread();
+		} while (0);
 	}
+
+	return true;
+}
+
+static void emulate(uint64_t end_cycle, bool stop_at_frame_end) {
+	frame_was_completed = false;
+
+	// run_instructions() returns false when the other version needs to take
+	// over
+	while (!(dbg_attached() ?
+	         run_instructions<true>(end_cycle, stop_at_frame_end) :
+	         run_instructions<false>(end_cycle, stop_at_frame_end)));
+
+	// Leave the PPU up to date for whoever looks at it next
+	sync_ppu();
+}
+
+void run() {
+	power_on();
+	emulate_until_end();
+}
+
+void emulate_until_end() {
+	emulate(UINT64_MAX, false);
+}
+
+void emulate_frame() {
+	emulate(UINT64_MAX, true);
+}
+
+void emulate_cycles(unsigned n) {
+	emulate(cpu_cycle + n, false);
 }
 
 
@@ -1356,6 +1550,7 @@ void run() {
 static void set_cpu_cold_boot_state() {
 	init_array(ram, (uint8_t)0xFF);
 	cpu_data_bus = 0;
+	op_1 = 0;
 #ifdef ENABLE_CORRUPTION
 	corrupt_chance = 0;
 #endif
@@ -1369,20 +1564,24 @@ static void set_cpu_cold_boot_state() {
 	irq_disable = false; // Later set by reset
 	carry       = false;
 
-	pending_event         = false;
-	pending_end_emulation = false;
-	irq_line              = pending_irq = cart_irq = false;
-	nmi_asserted          = pending_nmi = false;
+	irq_line     = cart_irq = false;
+	nmi_asserted = false;
+	oam_dma_page = 0;
 
 	cpu_is_reading = true;
 
 	pal_extra_tick = 5;
 
+	frame_offset = 0;
+	cpu_cycle    = 0;
+	clear_events();
+
 	reset_debugger();
 }
 
 static void reset_cpu() {
-	irq_line = pending_irq = cart_irq = false;
+	irq_line = cart_irq = false;
+	cancel_event(EVENT_IRQ);
 
 	// This sets the interrupt flag as a side effect
 	do_interrupt(Int_reset);
@@ -1392,10 +1591,24 @@ static void reset_cpu() {
 // State transfers
 //
 
+// Interrupt polling having detected NMI or IRQ is part of the state. It's
+// saved as a flag for whether 'event' (EVENT_NMI or EVENT_IRQ) is pending.
+template<bool calculating_size, bool is_save>
+static void transfer_pending_interrupt(Event event, uint8_t *&buf) {
+	bool pending = event_cycle(event) != UINT64_MAX;
+	TRANSFER(pending)
+	if (!calculating_size && !is_save) {
+		if (pending)
+			schedule_event(event, cpu_cycle);
+		else
+			cancel_event(event);
+	}
+}
+
 template<bool calculating_size, bool is_save>
 void transfer_cpu_state(uint8_t *&buf) {
-	TRANSFER(ram)
-		if (wram_base) TRANSFER_P(wram_base, 0x2000*wram_8k_banks)
+	TRANSFER_PAGES(ram, sizeof ram, DIRTY_RAM)
+		if (wram_base) TRANSFER_PAGES(wram_base, 0x2000*wram_8k_banks, DIRTY_WRAM)
 			TRANSFER(pc)
 				TRANSFER(a) TRANSFER(s) TRANSFER(x) TRANSFER(y)
 				TRANSFER(zn) TRANSFER(carry) TRANSFER(irq_disable) TRANSFER(decimal)
@@ -1405,10 +1618,24 @@ void transfer_cpu_state(uint8_t *&buf) {
 				TRANSFER(cpu_data_bus)
 				TRANSFER(cart_irq) TRANSFER(dmc_irq) TRANSFER(frame_irq) TRANSFER(irq_line)
 				TRANSFER(nmi_asserted)
-				TRANSFER(pending_irq) TRANSFER(pending_nmi)
+				transfer_pending_interrupt<calculating_size, is_save>(EVENT_IRQ, buf);
+				transfer_pending_interrupt<calculating_size, is_save>(EVENT_NMI, buf);
 				if (is_pal) TRANSFER(pal_extra_tick)
 }
 
+// Bookkeeping and counters that are not part of the save state, but that need
+// to follow the console when switching between consoles (see emulator.h). The
+// pending events go along with the scheduler.
+template<bool calculating_size, bool is_save>
+void transfer_cpu_context(uint8_t *&buf) {
+	TRANSFER(oam_dma_page)
+#ifdef ENABLE_CORRUPTION
+	TRANSFER(corrupt_chance)
+#endif
+	TRANSFER(frame_offset)
+	TRANSFER(cpu_cycle)
+}
+
 // Explicit instantiations
 
 // Calculating state size
@@ -1417,3 +1644,10 @@ template void transfer_cpu_state<true, false>(uint8_t*&);
 template void transfer_cpu_state<false, true>(uint8_t*&);
 // Loading state from buffer
 template void transfer_cpu_state<false, false>(uint8_t*&);
+
+// Calculating context size
+template void transfer_cpu_context<true, false>(uint8_t*&);
+// Saving context to buffer
+template void transfer_cpu_context<false, true>(uint8_t*&);
+// Loading context from buffer
+template void transfer_cpu_context<false, false>(uint8_t*&);
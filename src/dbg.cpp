@@ -1,13 +1,17 @@
 // vi:sw=2
-#include "dbg.h"
 #include "common.h"
+#include "dbg.h"
 #include "opcodes.h"
 #include "cpu.h"
 #include "mapper.h"
+#include "scheduler.h"
 #include "sdl_backend.h"
 
 static enum _debug_mode { RUN, SINGLE_STEP, NEXT_STEP } debug_mode;// = SINGLE_STEP;
 static bool debugger_on = false;
+bool dbg_hooked;
+
+static void update_dbg_hooked();
 
 enum dbgviews {
   DV_CPU = 0,
@@ -33,6 +37,7 @@ int set_debugger_vis(bool vis) {
   }else {
   }
 
+  debugger_attachment_changed();
   return 0;
 }
 
@@ -46,6 +51,7 @@ static void set_debug_mode ( enum _debug_mode dm ) {
   if ((dm != SINGLE_STEP) && (debug_mode == SINGLE_STEP)) audio_pause(0);
 
   debug_mode = dm;
+  update_dbg_hooked();
 }
 
 static int read_without_side_effects(uint16_t addr) {
@@ -121,8 +127,47 @@ static bool     breakpoint_at[0x10000];
 // breakpoints are set
 static unsigned n_breakpoints_set;
 
+// Condition for a breakpoint, like "A == 05" or "$0300 >= 80"
+struct Condition {
+  enum Lhs { LHS_A, LHS_X, LHS_Y, LHS_S, LHS_MEM } lhs;
+  uint16_t addr; // For LHS_MEM
+  enum Op { OP_EQ, OP_NE, OP_LT, OP_GT, OP_LE, OP_GE } op;
+  uint8_t val;
+};
+
+// Breakpoints that only trigger if their condition holds. The address must
+// also be set in breakpoint_at, so this is only searched on a hit.
+static struct {
+  uint16_t addr;
+  Condition cond;
+} cond_breakpoints[16];
+static unsigned n_cond_breakpoints;
+
+// Triggers on CPU reads and/or writes to addresses in first-last
+struct Watchpoint {
+  uint16_t first, last;
+  bool on_read, on_write;
+};
+
+static Watchpoint watchpoints[16];
+static unsigned n_watchpoints;
+bool dbg_watchpoints_set;
+
+// Address of the instruction being executed, for watchpoint messages
+static uint16_t instruction_pc;
+
+static void update_dbg_hooked() {
+  dbg_watchpoints_set = n_watchpoints > 0;
+  dbg_hooked = debug_mode != RUN || n_breakpoints_set > 0 || n_watchpoints > 0;
+  debugger_attachment_changed();
+}
+
 int reset_debugger(void) {
   init_array(breakpoint_at, false);
+  n_breakpoints_set = 0;
+  n_cond_breakpoints = 0;
+  n_watchpoints = 0;
+  update_dbg_hooked();
   return 0;
 }
 
@@ -555,13 +600,24 @@ int kbdinput_ign = 0;
 static int breakpoint_set (uint16_t addr) {
   n_breakpoints_set += !breakpoint_at[addr];
   breakpoint_at[addr] = true;
+  update_dbg_hooked();
   return 0;
 }
 
+static void remove_condition (uint16_t addr) {
+  for (unsigned i = 0; i < n_cond_breakpoints; ++i)
+    if (cond_breakpoints[i].addr == addr) {
+      cond_breakpoints[i] = cond_breakpoints[--n_cond_breakpoints];
+      return;
+    }
+}
+
 static int breakpoint_remove (uint16_t addr) {
   n_breakpoints_set -= breakpoint_at[addr];
   if (!breakpoint_at[addr]) return 1;
   breakpoint_at[addr] = false;
+  remove_condition(addr);
+  update_dbg_hooked();
   return 0;
 }
 
@@ -569,6 +625,103 @@ static int breakpoint_toggle (uint16_t addr) {
   return breakpoint_at[addr] ? breakpoint_remove(addr) : breakpoint_set(addr);
 }
 
+// Parses a condition like "A == 05" or "$0300 >= 80". Returns 0 on success.
+static int parse_condition (char const *lhs, char const *op, unsigned val, Condition &cond) {
+  static char const *const ops[] = { "==", "!=", "<", ">", "<=", ">=" };
+
+  if (!strcmp(lhs, "A") || !strcmp(lhs, "a")) cond.lhs = Condition::LHS_A;
+  else if (!strcmp(lhs, "X") || !strcmp(lhs, "x")) cond.lhs = Condition::LHS_X;
+  else if (!strcmp(lhs, "Y") || !strcmp(lhs, "y")) cond.lhs = Condition::LHS_Y;
+  else if (!strcmp(lhs, "S") || !strcmp(lhs, "s")) cond.lhs = Condition::LHS_S;
+  else {
+    unsigned addr;
+    if (sscanf(lhs, "$%x", &addr) != 1 || addr > 0xFFFF) return 1;
+    cond.lhs = Condition::LHS_MEM;
+    cond.addr = addr;
+  }
+
+  unsigned i;
+  for (i = 0; i < ARRAY_LEN(ops); ++i)
+    if (!strcmp(op, ops[i])) break;
+  if (i == ARRAY_LEN(ops) || val > 0xFF) return 1;
+  cond.op = (Condition::Op)i;
+  cond.val = val;
+  return 0;
+}
+
+static bool condition_holds (Condition const &cond) {
+  int lhs;
+  switch (cond.lhs) {
+    case Condition::LHS_A:   lhs = a; break;
+    case Condition::LHS_X:   lhs = x; break;
+    case Condition::LHS_Y:   lhs = y; break;
+    case Condition::LHS_S:   lhs = s; break;
+    case Condition::LHS_MEM: lhs = read_without_side_effects(cond.addr); break;
+    default: return true;
+  }
+
+  switch (cond.op) {
+    case Condition::OP_EQ: return lhs == cond.val;
+    case Condition::OP_NE: return lhs != cond.val;
+    case Condition::OP_LT: return lhs <  cond.val;
+    case Condition::OP_GT: return lhs >  cond.val;
+    case Condition::OP_LE: return lhs <= cond.val;
+    case Condition::OP_GE: return lhs >= cond.val;
+    default: return true;
+  }
+}
+
+static int breakpoint_set_conditional (uint16_t addr, Condition const &cond) {
+  remove_condition(addr);
+  if (n_cond_breakpoints == ARRAY_LEN(cond_breakpoints)) {
+    puts("Too many conditional breakpoints");
+    return 1;
+  }
+  cond_breakpoints[n_cond_breakpoints].addr = addr;
+  cond_breakpoints[n_cond_breakpoints].cond = cond;
+  ++n_cond_breakpoints;
+  return breakpoint_set(addr);
+}
+
+// Returns true if the breakpoint at 'addr' has no condition or its condition
+// holds
+static bool breakpoint_triggers (uint16_t addr) {
+  for (unsigned i = 0; i < n_cond_breakpoints; ++i)
+    if (cond_breakpoints[i].addr == addr)
+      return condition_holds(cond_breakpoints[i].cond);
+  return true;
+}
+
+static int watchpoint_add (uint16_t first, uint16_t last, bool on_read, bool on_write) {
+  if (n_watchpoints == ARRAY_LEN(watchpoints)) {
+    puts("Too many watchpoints");
+    return 1;
+  }
+  Watchpoint &w = watchpoints[n_watchpoints++];
+  w.first = first;
+  w.last = last;
+  w.on_read = on_read;
+  w.on_write = on_write;
+  update_dbg_hooked();
+  return 0;
+}
+
+void dbg_watchpoint_access(uint16_t addr, uint8_t val, bool is_write) {
+  for (unsigned i = 0; i < n_watchpoints; ++i) {
+    Watchpoint const &w = watchpoints[i];
+    if (addr >= w.first && addr <= w.last && (is_write ? w.on_write : w.on_read)) {
+      printf("Watchpoint: %s %04X (value %02X) by instruction at %04X\n",
+             is_write ? "write to" : "read from", addr, val, instruction_pc);
+      // Stops before the next instruction, as the access happens within an
+      // instruction
+      if (debug_mode == RUN) set_debug_mode(SINGLE_STEP);
+      show_debugger = 1;
+      cursor_cpu = pc;
+      return;
+    }
+  }
+}
+
 const char* hextable = "0123456789abcdef";
 
 static void dbg_kbdinput(int keycode) {
@@ -648,13 +801,26 @@ static void dbg_kbdinput(int keycode) {
 						break;
 		     case 'b':
 						{
-						  if (!sdl_text_prompt("Breakpoint address (add):",arg,80)) {
+						  if (!sdl_text_prompt("Breakpoint address [condition] (add):",arg,80)) {
 						    puts("Missing address");
 						    break;
 						  }
-						  unsigned addr;
-						  sscanf(arg, "%x", &addr);
-						  breakpoint_set(addr);
+						  // An optional condition follows the address, e.g.
+						  // "C000 A == 05" or "C000 $0300 >= 80"
+						  unsigned addr, val;
+						  char lhs[8], op[4];
+						  int n = sscanf(arg, "%x %7s %3s %x", &addr, lhs, op, &val);
+						  if (n == 1) {
+						    remove_condition(addr);
+						    breakpoint_set(addr);
+						  } else {
+						    Condition cond;
+						    if (n != 4 || parse_condition(lhs, op, val, cond)) {
+						      puts("Invalid condition (expected e.g. \"A == 05\" or \"$0300 >= 80\")");
+						      break;
+						    }
+						    breakpoint_set_conditional(addr, cond);
+						  }
 						  break;
 						}
 
@@ -684,12 +850,48 @@ static void dbg_kbdinput(int keycode) {
 						  }
 						}
 						n_breakpoints_set = 0;
+						n_cond_breakpoints = 0;
+						update_dbg_hooked();
+						break;
+
+		     case 'w':
+						{
+						  if (!sdl_text_prompt("Watchpoint address[-end] and r/w/rw (add):",arg,80)) {
+						    puts("Missing address");
+						    break;
+						  }
+						  unsigned first, last;
+						  char kind[4];
+						  if (sscanf(arg, "%x-%x %3s", &first, &last, kind) != 3) {
+						    if (sscanf(arg, "%x %3s", &first, kind) != 2) {
+						      puts("Expected e.g. \"0300 w\" or \"2000-2007 rw\"");
+						      break;
+						    }
+						    last = first;
+						  }
+						  bool const on_read = strchr(kind, 'r'), on_write = strchr(kind, 'w');
+						  if (first > last || last > 0xFFFF || !(on_read || on_write)) {
+						    puts("Invalid watchpoint");
+						    break;
+						  }
+						  watchpoint_add(first, last, on_read, on_write);
+						}
+						break;
+		     case (KM_SHIFT | 'w'):
+						//delete all watchpoints.
+						n_watchpoints = 0;
+						update_dbg_hooked();
+						puts("Deleted all watchpoints");
 						break;
 
 		     case 'i':
 						for (unsigned i = 0; i < ARRAY_LEN(breakpoint_at); ++i)
 						  if (breakpoint_at[i])
 						    printf("Breakpoint at %04X\n", i);
+						for (unsigned i = 0; i < n_watchpoints; ++i)
+						  printf("Watchpoint at %04X-%04X (%s%s)\n",
+						         watchpoints[i].first, watchpoints[i].last,
+						         watchpoints[i].on_read ? "r" : "", watchpoints[i].on_write ? "w" : "");
 						break;
 		     case 'r':
 						if (debug_mode == SINGLE_STEP) set_debug_mode(RUN);
@@ -859,6 +1061,8 @@ void dbg_redraw_cpu() {
 
   sdldbg_mvprintf(86, 5, "\362%c%c%c%c%c%c\360",carry ? 'C' : 'c', !(zn & 0xFF) ? 'Z' : 'z', irq_disable ? 'I' : 'i', decimal ? 'D' : 'd', overflow ? 'V' : 'v', !!(zn & 0x180) ? 'N' : 'n');
 
+  bool const pending_nmi = event_cycle(EVENT_NMI) != UINT64_MAX;
+  bool const pending_irq = event_cycle(EVENT_IRQ) != UINT64_MAX;
   if (pending_nmi && pending_irq)
     sdldbg_mvputs(86,6," (pending NMI and IRQ)");
   else if (pending_nmi)
@@ -960,11 +1164,13 @@ void dbg_redraw_mem() {
 
 int dbg_log_instruction() {
 
+  instruction_pc = pc;
+
   if (debug_mode == NEXT_STEP) { set_debug_mode(SINGLE_STEP); cursor_cpu = pc; }
 
   if (debug_mode == RUN) {
 
-    if (n_breakpoints_set > 0 && breakpoint_at[pc]) {
+    if (n_breakpoints_set > 0 && breakpoint_at[pc] && breakpoint_triggers(pc)) {
       set_debug_mode (SINGLE_STEP);
       show_debugger = 1;
       cursor_cpu = pc;
@@ -0,0 +1,261 @@
+#include "common.h"
+
+#include "apu.h"
+#include "audio.h"
+#include "backend.h"
+#include "cpu.h"
+#include "emulator.h"
+#include "input.h"
+#include "input_movie.h"
+#include "mapper.h"
+#include "ppu.h"
+#include "rom.h"
+#include "save_states.h"
+#include "scheduler.h"
+#include "state_hash.h"
+#include "timing.h"
+
+#ifdef HEADLESS
+#  include <pthread.h>
+#endif
+
+struct Emulator {
+    // Context and save state of the console while it is switched out
+    uint8_t *context;
+    uint8_t *state;
+    // Snapshot ID of 'state' (see save_states.h)
+    uint64_t state_id;
+};
+
+// The Emulator whose console is currently in the core variables on this
+// thread, or null if none
+static THREAD_LOCAL Emulator *active_emu;
+
+template<bool calculating_size, bool is_save>
+static size_t transfer_system_context(uint8_t *buf) {
+    uint8_t *tmp = buf;
+
+    transfer_rom_context<calculating_size, is_save>(buf);
+    transfer_mapper_context<calculating_size, is_save>(buf);
+    transfer_apu_context<calculating_size, is_save>(buf);
+    transfer_cpu_context<calculating_size, is_save>(buf);
+    transfer_scheduler_context<calculating_size, is_save>(buf);
+    transfer_audio_context<calculating_size, is_save>(buf);
+    transfer_input_context<calculating_size, is_save>(buf);
+    transfer_input_movie_context<calculating_size, is_save>(buf);
+    transfer_save_states_context<calculating_size, is_save>(buf);
+    transfer_state_hash_context<calculating_size, is_save>(buf);
+#ifdef HEADLESS
+    transfer_backend_context<calculating_size, is_save>(buf);
+#endif
+
+    // Return size of context in bytes
+    return buf - tmp;
+}
+
+static void switch_out() {
+    if (!active_emu)
+        return;
+
+    // Catch-up mode might have owed dots (e.g. from the reset sequence after
+    // power-on) and APU cycles, which need to be run before the frame buffer
+    // and the audio buffer go into the context
+    sync_ppu();
+    sync_apu();
+    // Only the pages written since the console was last switched out need to
+    // be copied. Taking the snapshot updates the dirty-page tracking, which is
+    // part of the context, so the context goes second.
+    active_emu->state_id =
+      save_snapshot(active_emu->state, active_emu->state_id);
+    transfer_system_context<false, true>(active_emu->context);
+    active_emu = 0;
+}
+
+static void switch_in(Emulator *emu) {
+    if (emu == active_emu)
+        return;
+
+    switch_out();
+
+    transfer_system_context<false, false>(emu->context);
+    // The memory map points into the RAM of this thread
+    init_cpu_mem_map();
+    // Set up the NTSC/PAL timing parameters for the console. The timing
+    // needs to come first, as the others are derived from it.
+    init_timing_for_rom();
+    init_apu_for_rom();
+    init_ppu_for_rom();
+    // Restores the console exactly as it was switched out, so that the
+    // dirty-page tracking restored with the context stays valid
+    transfer_system_state<false, false>(emu->state);
+
+    active_emu = emu;
+}
+
+// Allocates the buffers for switching out the console
+static void alloc_emulator_buffers(Emulator *emu) {
+    size_t const context_size = transfer_system_context<true, false>(0);
+    fail_if(!(emu->context = new (std::nothrow) uint8_t[context_size]),
+      "failed to allocate %zu-byte buffer for emulator context", context_size);
+    size_t const state_size = transfer_system_state<true, false>(0);
+    fail_if(!(emu->state = new (std::nothrow) uint8_t[state_size]),
+      "failed to allocate %zu-byte buffer for emulator state", state_size);
+    emu->state_id = 0;
+}
+
+Emulator *new_emulator(char const *filename) {
+    size_t size;
+    uint8_t *buf = get_file_buffer(filename, size);
+    char const *error;
+    Emulator *const emu = new_emulator(filename, buf, size, error);
+    if (!emu) {
+        free_array_set_null(buf);
+        fail("failed to load '%s': %s", filename, error);
+    }
+    return emu;
+}
+
+Emulator *new_emulator(char const *filename, uint8_t *buf, size_t size,
+                       char const *&error) {
+    switch_out();
+
+    Emulator *const emu = new (std::nothrow) Emulator;
+    fail_if(!emu, "failed to allocate emulator instance for '%s'", filename);
+
+    if ((error = load_rom(filename, buf, size, false))) {
+        delete emu;
+        return 0;
+    }
+#ifdef HEADLESS
+    clear_frame_buffer();
+#endif
+    power_on();
+    alloc_emulator_buffers(emu);
+
+    active_emu = emu;
+
+    return emu;
+}
+
+Emulator *fork_emulator(Emulator *parent) {
+    switch_in(parent);
+    Rom_ref const rom = ref_rom();
+    // Brings the parent's state buffer up to date
+    switch_out();
+
+    Emulator *const emu = new (std::nothrow) Emulator;
+    fail_if(!emu, "failed to allocate emulator instance for fork of '%s'",
+            rom.filename);
+
+    load_rom(rom, false);
+    power_on();
+    // The parent's snapshot IDs mean nothing to the fork, so this loads all
+    // of the state
+    load_snapshot(parent->state, 0);
+    alloc_emulator_buffers(emu);
+
+    // Leave the fork switched out, so that it can be run on any thread
+    active_emu = emu;
+    switch_out();
+
+    return emu;
+}
+
+void delete_emulator(Emulator *emu) {
+    switch_in(emu);
+    stop_movie();
+    stop_state_hashing();
+    unload_rom();
+    active_emu = 0;
+
+    free_array_set_null(emu->context);
+    free_array_set_null(emu->state);
+    delete emu;
+}
+
+void run_frame(Emulator *emu) {
+    switch_in(emu);
+    emulate_frame();
+}
+
+unsigned step(Emulator *emu, unsigned n_cycles) {
+    switch_in(emu);
+    uint64_t const start_cycle = cpu_cycle;
+    emulate_cycles(n_cycles);
+    return cpu_cycle - start_cycle;
+}
+
+#ifdef HEADLESS
+
+// Branches to run, shared by the run_branches() workers
+struct Branch_run {
+    Branch  *branches;
+    unsigned n_branches;
+    unsigned n_frames;
+    // Index of the next branch to run. Grabbed atomically by the workers.
+    unsigned next_branch;
+};
+
+// The workers only need the RAM contents, so pixels are never produced
+static bool want_no_frames() {
+    return false;
+}
+
+static void set_controller_1(uint8_t buttons) {
+    for (unsigned i = 0; i < I_COUNT; ++i)
+        controller_inputs[0][i] = NTH_BIT(buttons, i);
+}
+
+static void *branch_worker(void *arg) {
+    Branch_run &run = *(Branch_run*)arg;
+
+    sink_fns.video      = 0;
+    sink_fns.audio      = 0;
+    sink_fns.want_frame = want_no_frames;
+
+    for (;;) {
+        unsigned const i = __sync_fetch_and_add(&run.next_branch, 1);
+        if (i >= run.n_branches)
+            break;
+
+        Branch &branch = run.branches[i];
+        for (unsigned frame = 0; frame < run.n_frames; ++frame) {
+            set_controller_1(branch.inputs[frame]);
+            run_frame(branch.emu);
+        }
+        branch.ram_digest = fnv_1a(fnv_offset_basis, ram, sizeof ram);
+    }
+
+    // Leave the last branch switched out, so that it can be run on other
+    // threads
+    switch_out();
+
+    return 0;
+}
+
+void run_branches(Branch *branches, unsigned n_branches, unsigned n_frames) {
+    // A branch might be active on this thread
+    switch_out();
+
+    Branch_run run = { branches, n_branches, n_frames, 0 };
+
+    long const n_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned const n_workers =
+      min<unsigned>(n_cores > 0 ? n_cores : 1, n_branches);
+
+    pthread_t *workers = new (std::nothrow) pthread_t[n_workers];
+    fail_if(!workers, "failed to allocate %u worker threads", n_workers);
+
+    for (unsigned i = 0; i < n_workers; ++i) {
+        int const res = pthread_create(&workers[i], 0, branch_worker, &run);
+        errno_val_fail_if(res != 0, res, "failed to create worker thread");
+    }
+    for (unsigned i = 0; i < n_workers; ++i) {
+        int const res = pthread_join(workers[i], 0);
+        errno_val_fail_if(res != 0, res, "failed to join worker thread");
+    }
+
+    free_array_set_null(workers);
+}
+
+#endif
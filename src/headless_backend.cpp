@@ -0,0 +1,83 @@
+// Backend used by HEADLESS builds. Nothing is displayed or played back, and
+// there is no input; finished frames and audio are handed to the sinks in
+// 'sink_fns' instead. Lets the emulator run in batch jobs and on servers
+// without SDL.
+
+#include "common.h"
+
+#include "backend.h"
+#include "cpu.h"
+#include "input.h"
+
+THREAD_LOCAL Sink_fns sink_fns;
+
+//
+// Video
+//
+
+static THREAD_LOCAL uint32_t frame_buffer[NES_PPU_W*NES_PPU_H];
+
+void put_pixel(int x, unsigned y, uint32_t color) {
+    assert(x >= -NES_PPU_OFFSET);
+    assert(x < NES_PPU_W - NES_PPU_OFFSET);
+    assert(y < NES_PPU_H);
+
+    frame_buffer[NES_PPU_W*y + (x + NES_PPU_OFFSET)] = color;
+}
+
+void put_pixels(int x, unsigned y, uint32_t const *colors, unsigned n) {
+    assert(x >= -NES_PPU_OFFSET);
+    assert(x + (int)n <= NES_PPU_W - NES_PPU_OFFSET);
+    assert(y < NES_PPU_H);
+
+    memcpy(frame_buffer + NES_PPU_W*y + (x + NES_PPU_OFFSET), colors,
+           sizeof(uint32_t)*n);
+}
+
+void draw_frame() {
+    if (sink_fns.video)
+        sink_fns.video(frame_buffer);
+}
+
+void clear_frame_buffer() {
+    init_array(frame_buffer, (uint32_t)0);
+}
+
+bool want_frame() {
+    return !sink_fns.want_frame || sink_fns.want_frame();
+}
+
+template<bool calculating_size, bool is_save>
+void transfer_backend_context(uint8_t *&buf) {
+    TRANSFER(frame_buffer)
+}
+
+// Explicit instantiations
+
+// Calculating context size
+template void transfer_backend_context<true, false>(uint8_t*&);
+// Saving context to buffer
+template void transfer_backend_context<false, true>(uint8_t*&);
+// Loading context from buffer
+template void transfer_backend_context<false, false>(uint8_t*&);
+
+//
+// Audio
+//
+
+int audio_pause(bool) { return 1; }
+
+//
+// Input
+//
+
+THREAD_LOCAL bool controller_inputs[4][I_COUNT];
+THREAD_LOCAL bool global_inputs[IG_COUNT];
+
+void lock_input() {}
+void unlock_input() {}
+
+void handle_ui_keys() {
+    if (reset_pushed)
+        soft_reset();
+}
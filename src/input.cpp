@@ -1,16 +1,15 @@
 #include "common.h"
 
-#include "sdl_backend.h"
-
-// The input routines are still tied to SDL
-#include <SDL.h>
+#include "backend.h"
+#include "input.h"
+#include "input_movie.h"
 
 // If true, prevent the game from seeing left+right or up+down pressed
 // simultaneously, which glitches out some games. When both keys are pressed at
 // the same time, pretend only the key most recently pressed is pressed.
 bool const prevent_simul_left_right_or_up_down = true;
 
-static struct Controller_data {
+static THREAD_LOCAL struct Controller_data {
     // Button states
     bool left_pushed, right_pushed, up_pushed, down_pushed,
          a_pushed, b_pushed, start_pushed, select_pushed;
@@ -23,7 +22,7 @@ static struct Controller_data {
     //unsigned key_a, key_b, key_select, key_start, key_up, key_down, key_left, key_right;
 } controller_data[2];
 
-bool reset_pushed;
+THREAD_LOCAL bool reset_pushed;
 
 void init_input() {
     // Currently hardcoded
@@ -47,8 +46,38 @@ void init_input() {
     //controller_data[1].key_right  = SDL_SCANCODE_RIGHT;
 }
 
+void set_input_cold_boot_state() {
+    memset(controller_data, 0, sizeof controller_data);
+    reset_pushed = false;
+}
+
+// Sets the button states of controller 'n' from 'buttons', in the format
+// returned by get_button_states()
+static void set_button_states(unsigned n, uint8_t buttons) {
+    Controller_data &c = controller_data[n];
+    c.a_pushed      = NTH_BIT(buttons, 0);
+    c.b_pushed      = NTH_BIT(buttons, 1);
+    c.select_pushed = NTH_BIT(buttons, 2);
+    c.start_pushed  = NTH_BIT(buttons, 3);
+    c.up_pushed     = NTH_BIT(buttons, 4);
+    c.down_pushed   = NTH_BIT(buttons, 5);
+    c.left_pushed   = NTH_BIT(buttons, 6);
+    c.right_pushed  = NTH_BIT(buttons, 7);
+}
+
 void calc_controller_state() {
-    SDL_LockMutex(event_lock);
+    if (movie_mode == MOVIE_PLAYING) {
+        // The movie has the final button states, so the backend's inputs are
+        // not consulted at all
+        uint8_t buttons[2];
+        if (get_movie_frame(buttons, reset_pushed)) {
+            set_button_states(0, buttons[0]);
+            set_button_states(1, buttons[1]);
+            return;
+        }
+    }
+
+    lock_input();
 
     for (unsigned i = 0; i < 2; ++i) {
         Controller_data &c = controller_data[i];
@@ -105,7 +134,14 @@ void calc_controller_state() {
 
     reset_pushed = global_inputs[IG_RESET];
 
-    SDL_UnlockMutex(event_lock);
+    unlock_input();
+
+    if (movie_mode == MOVIE_RECORDING) {
+        // Record the button states after left+right/up+down elimination, so
+        // that the movie doesn't depend on that setting
+        uint8_t const buttons[2] = { get_button_states(0), get_button_states(1) };
+        record_movie_frame(buttons, reset_pushed);
+    }
 }
 
 uint8_t get_button_states(unsigned n) {
@@ -142,3 +178,19 @@ template void transfer_input_state<true, false>(uint8_t*&);
 template void transfer_input_state<false, true>(uint8_t*&);
 // Loading state from buffer
 template void transfer_input_state<false, false>(uint8_t*&);
+
+// The key press history used for left+right/up+down elimination is not part of
+// the save state
+template<bool calculating_size, bool is_save>
+void transfer_input_context(uint8_t *&buf) {
+    TRANSFER(controller_data)
+}
+
+// Explicit instantiations
+
+// Calculating context size
+template void transfer_input_context<true, false>(uint8_t*&);
+// Saving context to buffer
+template void transfer_input_context<false, true>(uint8_t*&);
+// Loading context from buffer
+template void transfer_input_context<false, false>(uint8_t*&);
@@ -0,0 +1,296 @@
+#include "common.h"
+
+#include "cpu.h"
+#include "input_movie.h"
+#include "lz.h"
+#include "mapper.h"
+#include "rom.h"
+#include "save_states.h"
+
+//
+// Movie files
+//
+// All integers are little-endian.
+//
+//   Header:
+//     "NESMOVIE"      Magic
+//     <u32>           Format version (movie_file_version)
+//     <u32>           Mapper number
+//     <16 bytes>      MD5 digest of the PRG ROM
+//
+//   Starting point:
+//     <u32>           Size of the save state file the movie starts from, or
+//                     0 if the movie starts from power-on
+//     <data>          The save state file (see save_states.cpp)
+//
+//   Frames:
+//     <u32>           Number of frames
+//     <u32>           Size of the frame data that follows. If it differs from
+//                     'frame_size' times the number of frames, the data is
+//                     compressed (see lz.h).
+//     <data>
+//
+//   Frame:
+//     <u8>            Buttons pressed on controller 1. Bits 0-7 are A, B,
+//                     Select, Start, Up, Down, Left, and Right.
+//     <u8>            Buttons pressed on controller 2
+//     <u8>            Flags (frame_reset_flag)
+//
+// The save state file has its own versioning, so states going out of date
+// makes loading the movie fail too.
+
+static char const movie_file_magic[8] =
+  { 'N', 'E', 'S', 'M', 'O', 'V', 'I', 'E' };
+
+uint32_t const movie_file_version = 1;
+
+size_t const movie_file_header_size = 8 + 4 + 4 + 16;
+
+size_t const frame_size = 3;
+
+// Set in the flags of frames where the reset button is pressed
+uint8_t const frame_reset_flag = 1;
+
+THREAD_LOCAL Movie_mode movie_mode;
+
+// The frames of the movie being recorded or played back, with room for
+// 'max_frames' frames
+static THREAD_LOCAL uint8_t *frames;
+static THREAD_LOCAL size_t   n_frames, max_frames;
+// Next frame to play back
+static THREAD_LOCAL size_t   cur_frame;
+
+// When recording, the save state file for the starting point of the movie, or
+// null if it starts from power-on
+static THREAD_LOCAL uint8_t *start_state;
+static THREAD_LOCAL size_t   start_state_size;
+
+// Where the movie being recorded goes
+static THREAD_LOCAL char    *movie_filename;
+
+void init_input_movie_for_rom() {
+    // Whatever is here belongs to another console (see emulator.h), which
+    // frees it
+    movie_mode = MOVIE_OFF;
+    frames = 0;
+    n_frames = max_frames = cur_frame = 0;
+    start_state = 0;
+    start_state_size = 0;
+    movie_filename = 0;
+}
+
+static void alloc_frames(size_t n) {
+    fail_if(!(frames = new (std::nothrow) uint8_t[frame_size*n]),
+      "failed to allocate buffer for %zu movie frames", n);
+    max_frames = n;
+}
+
+//
+// Recording
+//
+
+void start_movie_recording(char const *filename, bool from_power_on) {
+    stop_movie();
+
+    if (from_power_on) {
+        reset_cart();
+        power_on();
+    }
+    else
+        fail_if(!(start_state = save_state_to_buf(start_state_size)),
+          "failed to save the starting state for movie '%s'", filename);
+
+    fail_if(!(movie_filename = new (std::nothrow) char[strlen(filename) + 1]),
+      "failed to allocate memory for movie filename");
+    strcpy(movie_filename, filename);
+
+    // About a minute of frames to begin with
+    alloc_frames(4096);
+    n_frames = 0;
+
+    movie_mode = MOVIE_RECORDING;
+}
+
+void record_movie_frame(uint8_t const buttons[2], bool reset) {
+    if (n_frames == max_frames) {
+        uint8_t *const old_frames = frames;
+        alloc_frames(2*max_frames);
+        memcpy(frames, old_frames, frame_size*n_frames);
+        delete [] old_frames;
+    }
+
+    uint8_t *const frame = frames + frame_size*n_frames++;
+    frame[0] = buttons[0];
+    frame[1] = buttons[1];
+    frame[2] = reset ? frame_reset_flag : 0;
+}
+
+static bool write_movie_file() {
+    size_t const frames_size = frame_size*n_frames;
+    size_t const max_file_size = movie_file_header_size + 4 +
+      start_state_size + 4 + 4 + lz_max_compressed_size(frames_size);
+
+    uint8_t *file_buf = new (std::nothrow) uint8_t[max_file_size];
+    if (!file_buf) {
+        fprintf(stderr, "Failed to allocate %zu-byte buffer for movie\n",
+                max_file_size);
+        return false;
+    }
+
+    uint8_t *p = file_buf;
+    memcpy(p, movie_file_magic, 8);
+    p = put_u32(p + 8, movie_file_version);
+    p = put_u32(p, mapper_nr);
+    memcpy(p, prg_md5, 16);
+    p = put_u32(p + 16, start_state_size);
+    if (start_state) {
+        memcpy(p, start_state, start_state_size);
+        p += start_state_size;
+    }
+
+    p = put_u32(p, n_frames);
+    // Frames mostly repeat the previous one, so they compress well
+    size_t stored_size = lz_compress(frames, frames_size, p + 4);
+    if (stored_size >= frames_size) {
+        stored_size = frames_size;
+        memcpy(p + 4, frames, frames_size);
+    }
+    p = put_u32(p, stored_size) + stored_size;
+
+    bool const ok = write_file_safely(movie_filename, file_buf, p - file_buf);
+    if (ok)
+        printf("Recorded %zu frames to '%s'\n", n_frames, movie_filename);
+    else
+        fprintf(stderr, "Failed to save movie to '%s': %s\n", movie_filename,
+                strerror(errno));
+
+    free_array_set_null(file_buf);
+
+    return ok;
+}
+
+//
+// Playback
+//
+
+// Checks the 'size'-byte movie file 'file', puts the console in the starting
+// state of the movie, and loads the frames. Returns an error message, or null
+// if successful.
+static char const *read_movie_file(uint8_t const *file, size_t size) {
+    uint8_t const *const end = file + size;
+
+    if (size < movie_file_header_size + 4 || memcmp(file, movie_file_magic, 8))
+        return "not an input movie";
+    if (get_u32(file + 8) != movie_file_version)
+        return "recorded by an incompatible version of the emulator";
+    if (get_u32(file + 12) != mapper_nr || memcmp(file + 16, prg_md5, 16))
+        return "recorded for a different ROM";
+
+    uint8_t const *p = file + movie_file_header_size;
+    size_t const state_size = get_u32(p);
+    p += 4;
+    if (size_t(end - p) < state_size + 8)
+        return "truncated";
+    uint8_t const *const state_file = p;
+    p += state_size;
+
+    size_t const n = get_u32(p);
+    size_t const stored_size = get_u32(p + 4);
+    p += 8;
+    if (size_t(end - p) < stored_size)
+        return "truncated";
+
+    // One extra frame avoids an empty buffer
+    alloc_frames(n + 1);
+    n_frames = n;
+    if (stored_size == frame_size*n)
+        memcpy(frames, p, stored_size);
+    else if (!lz_decompress(p, stored_size, frames, frame_size*n))
+        return "corrupt compressed frame data";
+
+    if (state_size == 0) {
+        reset_cart();
+        power_on();
+    }
+    else {
+        char const *const error = load_state_from_buf(state_file, state_size);
+        if (error)
+            return error;
+    }
+
+    return 0;
+}
+
+void start_movie_playback(char const *filename) {
+    char const *const error = try_start_movie_playback(filename);
+    fail_if(error, "failed to load movie '%s': %s", filename, error);
+}
+
+char const *try_start_movie_playback(char const *filename) {
+    stop_movie();
+
+    size_t size;
+    uint8_t *file = try_get_file_buffer(filename, size);
+    if (!file)
+        return strerror(errno);
+    char const *const error = read_movie_file(file, size);
+    free_array_set_null(file);
+    if (error)
+        return error;
+
+    cur_frame  = 0;
+    movie_mode = MOVIE_PLAYING;
+
+    return 0;
+}
+
+bool get_movie_frame(uint8_t buttons[2], bool &reset) {
+    if (cur_frame == n_frames) {
+#ifndef HEADLESS
+        printf("Movie ended after %zu frames\n", n_frames);
+#endif
+        stop_movie();
+        return false;
+    }
+
+    uint8_t const *const frame = frames + frame_size*cur_frame++;
+    buttons[0] = frame[0];
+    buttons[1] = frame[1];
+    reset      = frame[2] & frame_reset_flag;
+
+    return true;
+}
+
+bool stop_movie() {
+    bool const ok = movie_mode != MOVIE_RECORDING || write_movie_file();
+
+    movie_mode = MOVIE_OFF;
+    free_array_set_null(frames);
+    n_frames = max_frames = 0;
+    free_array_set_null(start_state);
+    start_state_size = 0;
+    free_array_set_null(movie_filename);
+
+    return ok;
+}
+
+template<bool calculating_size, bool is_save>
+void transfer_input_movie_context(uint8_t *&buf) {
+    TRANSFER(movie_mode)
+    TRANSFER(frames)
+    TRANSFER(n_frames)
+    TRANSFER(max_frames)
+    TRANSFER(cur_frame)
+    TRANSFER(start_state)
+    TRANSFER(start_state_size)
+    TRANSFER(movie_filename)
+}
+
+// Explicit instantiations
+
+// Calculating context size
+template void transfer_input_movie_context<true, false>(uint8_t*&);
+// Saving context to buffer
+template void transfer_input_movie_context<false, true>(uint8_t*&);
+// Loading context from buffer
+template void transfer_input_movie_context<false, false>(uint8_t*&);
@@ -0,0 +1,144 @@
+#include "common.h"
+
+#include "lz.h"
+
+unsigned const min_match = 4;
+unsigned const max_offset = 0xFFFF;
+
+// Matches are found through a hash table with the last position of each
+// four-byte sequence
+unsigned const hash_bits = 12;
+
+static uint32_t load_32(uint8_t const *p) {
+    uint32_t res;
+    memcpy(&res, p, 4);
+    return res;
+}
+
+static unsigned hash_32(uint32_t val) {
+    return (val*UINT32_C(2654435761)) >> (32 - hash_bits);
+}
+
+size_t lz_max_compressed_size(size_t len) {
+    // All literals in a single sequence
+    return 1 + len/255 + 1 + len;
+}
+
+static uint8_t *put_length(uint8_t *out, size_t len) {
+    for (; len >= 255; len -= 255)
+        *out++ = 255;
+    *out++ = len;
+    return out;
+}
+
+static uint8_t *put_sequence(uint8_t *out, uint8_t const *literals,
+                             size_t n_literals, unsigned offset, size_t match_len) {
+    size_t const match_code = match_len ? match_len - min_match : 0;
+
+    *out++ = (min<size_t>(n_literals, 15) << 4) | min<size_t>(match_code, 15);
+    if (n_literals >= 15)
+        out = put_length(out, n_literals - 15);
+    memcpy(out, literals, n_literals);
+    out += n_literals;
+
+    if (match_len) {
+        *out++ = offset & 0xFF;
+        *out++ = offset >> 8;
+        if (match_code >= 15)
+            out = put_length(out, match_code - 15);
+    }
+
+    return out;
+}
+
+size_t lz_compress(uint8_t const *in, size_t len, uint8_t *out) {
+    uint8_t *const out_start = out;
+
+    // Positions plus one, with zero meaning none
+    size_t table[1 << hash_bits] = {};
+
+    size_t anchor = 0; // Start of pending literals
+    for (size_t i = 0; i + min_match <= len;) {
+        uint32_t const val = load_32(in + i);
+        size_t &entry = table[hash_32(val)];
+        size_t const cand = entry - 1;
+        entry = i + 1;
+
+        if (cand == SIZE_MAX || i - cand > max_offset || load_32(in + cand) != val) {
+            ++i;
+            continue;
+        }
+
+        size_t match_len = min_match;
+        while (i + match_len < len && in[cand + match_len] == in[i + match_len])
+            ++match_len;
+
+        out = put_sequence(out, in + anchor, i - anchor, i - cand, match_len);
+        i = anchor = i + match_len;
+    }
+
+    out = put_sequence(out, in + anchor, len - anchor, 0, 0);
+
+    return out - out_start;
+}
+
+// Reads an extended length, adding it to 'len'. Returns false if the input
+// runs out.
+static bool get_length(uint8_t const *&in, uint8_t const *in_end, size_t &len) {
+    uint8_t byte;
+    do {
+        if (in == in_end)
+            return false;
+        byte = *in++;
+        len += byte;
+    } while (byte == 255);
+    return true;
+}
+
+bool lz_decompress(uint8_t const *in, size_t in_len, uint8_t *out, size_t out_len) {
+    uint8_t const *const in_end = in + in_len;
+    uint8_t *const out_start = out;
+    uint8_t *const out_end = out + out_len;
+
+    for (;;) {
+        if (in == in_end)
+            // Missing final sequence
+            return false;
+        unsigned const token = *in++;
+
+        size_t n_literals = token >> 4;
+        if (n_literals == 15 && !get_length(in, in_end, n_literals))
+            return false;
+        if (n_literals > size_t(in_end - in) || n_literals > size_t(out_end - out))
+            return false;
+        memcpy(out, in, n_literals);
+        in += n_literals;
+        out += n_literals;
+
+        if (in == in_end)
+            // Final sequence
+            return out == out_end;
+
+        if (in_end - in < 2)
+            return false;
+        size_t const offset = in[0] | (in[1] << 8);
+        in += 2;
+        size_t match_len = token & 0x0F;
+        if (match_len == 15 && !get_length(in, in_end, match_len))
+            return false;
+        match_len += min_match;
+        if (offset == 0 || offset > size_t(out - out_start) ||
+            match_len > size_t(out_end - out))
+            return false;
+
+        if (offset >= match_len) {
+            memcpy(out, out - offset, match_len);
+            out += match_len;
+        }
+        else
+            // The match overlaps itself (e.g. a run of the same byte), so
+            // copy a byte at a time
+            for (uint8_t const *from = out - offset; match_len--;)
+                *out++ = *from++;
+    }
+}
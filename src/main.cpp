@@ -1,34 +1,118 @@
 #include "common.h"
 
 #include "apu.h"
+#ifdef HEADLESS
+#  include "batch.h"
+#endif
 #include "cpu.h"
 #include "input.h"
+#include "input_movie.h"
 #include "mapper.h"
 #include "rom.h"
-#include "sdl_backend.h"
+#include "state_hash.h"
+#ifdef HEADLESS
+#  include "backend.h"
+#else
+#  include "sdl_backend.h"
+#endif
 #ifdef RUN_TESTS
 #  include "test.h"
 #endif
+#include "timing.h"
 
-#include <SDL.h>
+#ifndef HEADLESS
+#  include <SDL.h>
+#endif
 
 char const *program_name;
 
+#ifndef RUN_TESTS
+// Input movie to play back or record, if any
+static char const *input_movie_filename;
+static bool        recording_input_movie;
+#endif
+
+#if defined(HEADLESS) && !defined(RUN_TESTS)
+// File to log per-frame state digests to and file with reference digests to
+// check against, if any (see state_hash.h)
+static char const *hash_log_filename;
+static char const *hash_ref_filename;
+// Cleared if the state diverged from the reference
+static bool        hashes_matched = true;
+#endif
+
 static int emulation_thread(void*) {
 #ifdef RUN_TESTS
     run_tests();
 #else
-    run();
+    power_on();
+    if (input_movie_filename) {
+        if (recording_input_movie)
+            start_movie_recording(input_movie_filename, true);
+        else
+            start_movie_playback(input_movie_filename);
+    }
+#  ifdef HEADLESS
+    if (hash_log_filename || hash_ref_filename)
+        start_state_hashing(hash_log_filename, hash_ref_filename);
+#  endif
+    emulate_until_end();
+    // Writes out the movie if recording
+    stop_movie();
+#  ifdef HEADLESS
+    hashes_matched = stop_state_hashing();
+#  endif
 #endif
 
     return 0;
 }
 
+#if defined(HEADLESS) && !defined(RUN_TESTS)
+// Number of frames left to emulate
+static unsigned long frames_left;
+
+static void count_frame(uint32_t const*) {
+    if (--frames_left == 0)
+        end_emulation();
+}
+#endif
+
 int main(int argc, char *argv[]) {
     program_name = argv[0] ? argv[0] : "nesalizer";
-#ifndef RUN_TESTS
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <rom file>\n", program_name);
+#if defined(HEADLESS) && !defined(RUN_TESTS)
+    bool const batch_mode = argc == 3 && !strcmp(argv[1], "--batch");
+    bool valid_args = batch_mode || argc >= 3;
+    for (int i = 3; !batch_mode && valid_args && i < argc; ++i) {
+        if (!strcmp(argv[i], "--log-hashes") && i + 1 < argc)
+            hash_log_filename = argv[++i];
+        else if (!strcmp(argv[i], "--check-hashes") && i + 1 < argc)
+            hash_ref_filename = argv[++i];
+        else if (!input_movie_filename && argv[i][0] != '-')
+            input_movie_filename = argv[i];
+        else
+            valid_args = false;
+    }
+    if (!valid_args) {
+        fprintf(stderr, "usage: %s <rom file> <frames> [<input movie>] "
+                          "[--log-hashes <file>] [--check-hashes <file>]\n"
+                        "       %s --batch <manifest file>\n",
+                program_name, program_name);
+        exit(EXIT_FAILURE);
+    }
+    unsigned long n_frames = 0;
+    if (!batch_mode) {
+        char *end;
+        n_frames = frames_left = strtoul(argv[2], &end, 0);
+        fail_if(*end != '\0' || n_frames == 0, "invalid frame count '%s'", argv[2]);
+    }
+#elif !defined(RUN_TESTS)
+    if (argc == 4 && (!strcmp(argv[2], "--record") || !strcmp(argv[2], "--play"))) {
+        input_movie_filename  = argv[3];
+        recording_input_movie = !strcmp(argv[2], "--record");
+    }
+    else if (argc != 2) {
+        fprintf(stderr, "usage: %s <rom file> [--record|--play <input movie>]\n",
+                program_name);
         exit(EXIT_FAILURE);
     }
 #else
@@ -42,10 +126,32 @@ int main(int argc, char *argv[]) {
     init_input();
     init_mappers();
 
+#if defined(HEADLESS) && !defined(RUN_TESTS)
+    if (batch_mode)
+        // Each job gets its own console on one of the worker threads
+        exit(run_batch(argv[2]) ? EXIT_SUCCESS : EXIT_FAILURE);
+#endif
+
 #ifndef RUN_TESTS
     load_rom(argv[1], true);
 #endif
 
+#ifdef HEADLESS
+    // No rendering thread. Emulate on this thread as fast as we can.
+
+#  ifdef RUN_TESTS
+    emulation_thread(0);
+#  else
+    sink_fns.video = count_frame;
+    double const start_time = get_seconds();
+    emulation_thread(0);
+    double const elapsed = get_seconds() - start_time;
+    // Emulation ends early if the state diverges from reference digests
+    unsigned long const n_emulated = n_frames - frames_left;
+    printf("Emulated %lu frames in %.3f seconds (%.1f FPS)\n",
+           n_emulated, elapsed, n_emulated/elapsed);
+#  endif
+#else
     // Create a separate emulation thread and use this thread as the rendering
     // thread
 
@@ -56,10 +162,15 @@ int main(int argc, char *argv[]) {
     sdl_thread();
     SDL_WaitThread(emu_thread, 0);
     deinit_sdl();
+#endif
 
 #ifndef RUN_TESTS
     unload_rom();
 #endif
 
     puts("Shut down cleanly");
+
+#if defined(HEADLESS) && !defined(RUN_TESTS)
+    return hashes_matched ? EXIT_SUCCESS : EXIT_FAILURE;
+#endif
 }
@@ -2,11 +2,15 @@
 
 #include "cpu.h"
 #include "mapper.h"
+#include "ppu.h"
 #include "rom.h"
+#include "save_states.h"
 
 static uint8_t nop_read(uint16_t) { return cpu_data_bus; } // Return open bus by default
 static void    nop_write(uint8_t, uint16_t) {}
-static void    nop_ppu_tick_callback() {}
+
+// Not static, as the PPU checks for it (see mapper.h)
+void nop_ppu_tick_callback() {}
 
 // Implicitly NULL-initialized
 Mapper_fns mapper_fns_table[256];
@@ -22,6 +26,17 @@ DECLARE_STATE_FNS( 11) DECLARE_STATE_FNS( 13) DECLARE_STATE_FNS( 28)
 DECLARE_STATE_FNS( 71) DECLARE_STATE_FNS(232)
 #undef DECLARE_STATE_FNS
 
+// Makes mapper 'n' see CPU writes to 'first'-'last', which must start and end
+// at page boundaries
+static void add_write_window(unsigned n, uint16_t first, uint16_t last) {
+    Mapper_fns &fns = mapper_fns_table[n];
+    assert(fns.n_write_windows < ARRAY_LEN(fns.write_windows));
+    assert((first & 0xFF) == 0 && (last & 0xFF) == 0xFF);
+    Cpu_window &window = fns.write_windows[fns.n_write_windows++];
+    window.first = first;
+    window.last  = last;
+}
+
 void init_mappers() {
     // All mappers have these
     #define MAPPER_COMMON(n)                                                      \
@@ -29,7 +44,8 @@ void init_mappers() {
       mapper_fns_table[n].init       = mapper_##n##_init;                         \
       mapper_fns_table[n].state_size = transfer_mapper_##n##_state<true, false>;  \
       mapper_fns_table[n].save_state = transfer_mapper_##n##_state<false, true>;  \
-      mapper_fns_table[n].load_state = transfer_mapper_##n##_state<false, false>;
+      mapper_fns_table[n].load_state = transfer_mapper_##n##_state<false, false>; \
+      mapper_fns_table[n].n_write_windows = 0;
 
     // No mapper (hardwired/NROM)
     #define MAPPER_NONE(n)                                           \
@@ -101,6 +117,23 @@ void init_mappers() {
     // Camerica/Capcom mapper used by the Quattro * games
     MAPPER_W(   232)
 
+    // The CPU addresses where each mapper has registers. Writes elsewhere
+    // never reach the mapper.
+    add_write_window(  1, 0x8000, 0xFFFF);
+    add_write_window(  2, 0x8000, 0xFFFF);
+    add_write_window(  3, 0x8000, 0xFFFF);
+    add_write_window(  4, 0x8000, 0xFFFF);
+    add_write_window(  5, 0x5100, 0x5FFF);
+    add_write_window(  7, 0x8000, 0xFFFF);
+    add_write_window(  9, 0x8000, 0xFFFF);
+    add_write_window( 10, 0x8000, 0xFFFF);
+    add_write_window( 11, 0x8000, 0xFFFF);
+    add_write_window( 13, 0x8000, 0xFFFF);
+    add_write_window( 28, 0x5000, 0x5FFF);
+    add_write_window( 28, 0x8000, 0xFFFF);
+    add_write_window( 71, 0xC000, 0xFFFF);
+    add_write_window(232, 0x8000, 0xFFFF);
+
     #undef MAPPER_COMMON
     #undef MAPPER_NONE
     #undef MAPPER_W
@@ -115,20 +148,81 @@ void init_mappers() {
 // PRG is split up into four 8 KB pages to handle memory mapping. This is the
 // finest granularity switched by any mapper. These pointers point to the
 // beginning of each page.
-static uint8_t *prg_pages[4];
-static bool prg_page_is_ram[4]; // MMC5 can map WRAM into the $8000+ range
+static THREAD_LOCAL uint8_t *prg_pages[4];
+static THREAD_LOCAL bool prg_page_is_ram[4]; // MMC5 can map WRAM into the $8000+ range
 
 uint8_t read_prg(uint16_t addr) {
     return prg_pages[(addr >> 13) & 3][addr & 0x1FFF];
 }
 
 void write_prg(uint16_t addr, uint8_t val) {
-    if (prg_page_is_ram[(addr >> 13) & 3])
-        prg_pages[(addr >> 13) & 3][addr & 0x1FFF] = val;
+    uint8_t *const page = prg_pages[(addr >> 13) & 3];
+    if (prg_page_is_ram[(addr >> 13) & 3]) {
+        page[addr & 0x1FFF] = val;
+        if (wram_base)
+            mark_page_dirty(DIRTY_WRAM, page - wram_base + (addr & 0x1FFF));
+    }
+}
+
+// Direct writes to memory that isn't tracked set their dirty bit here
+static THREAD_LOCAL uint64_t untracked_dirty_word;
+
+// Maps the 'n' CPU pages from page 'first' directly to 'mem'. If 'writable'
+// is true, writes go to 'mem' too and mark the corresponding pages of
+// 'region', which starts at 'region_base', dirty. 'region_base' is null for
+// memory that isn't tracked.
+static void map_cpu_mem(unsigned first, unsigned n, uint8_t *mem,
+                        bool writable, Dirty_region region,
+                        uint8_t const *region_base) {
+    // CPU pages and dirty pages are both 256 bytes
+    assert(dirty_page_size == 0x100);
+
+    for (unsigned i = 0; i < n; ++i) {
+        Cpu_page &page = cpu_pages[first + i];
+        page.read  = mem + 0x100*i;
+        page.write = writable ? page.read : 0;
+        if (writable && region_base) {
+            size_t const dirty_page = (page.read - region_base) >> dirty_page_shift;
+            page.dirty_word = dirty_pages[region].bits + dirty_page/64;
+            page.dirty_mask = UINT64_C(1) << (dirty_page%64);
+        }
+        else {
+            page.dirty_word = &untracked_dirty_word;
+            page.dirty_mask = 0;
+        }
+    }
 }
 
-// CHR is split up into eight 1 KB pages
-uint8_t *chr_pages[8];
+// Maps the 'n' CPU pages from page 'first' to 'handler'
+static void map_cpu_handler(unsigned first, unsigned n, Cpu_page_handler handler) {
+    for (unsigned i = 0; i < n; ++i) {
+        Cpu_page &page = cpu_pages[first + i];
+        page.read = page.write = 0;
+        page.read_handler = page.write_handler = handler;
+    }
+}
+
+// Updates the CPU memory map for PRG page 'n'. Writes to ROM are dropped
+// (after the mapper sees them).
+static void map_prg_page(unsigned n) {
+    map_cpu_mem(0x80 + 0x20*n, 0x20, prg_pages[n], prg_page_is_ram[n],
+                DIRTY_WRAM, wram_base);
+    for (unsigned i = 0; i < 0x20; ++i)
+        cpu_pages[0x80 + 0x20*n + i].write_handler = PAGE_NONE;
+}
+
+static void map_wram_6000_page() {
+    if (wram_6000_page)
+        map_cpu_mem(0x60, 0x20, wram_6000_page, true, DIRTY_WRAM, wram_base);
+    else
+        // Open bus
+        map_cpu_handler(0x60, 0x20, PAGE_NONE);
+}
+
+// CHR is split up into eight 1 KB pages. The set_chr_*() functions (and
+// set_mirroring()) sync the PPU first, so that it renders the dots leading up
+// to the change with the old mapping in catch-up mode (see ppu.h).
+THREAD_LOCAL uint8_t *chr_pages[8];
 
 void set_prg_32k_bank(unsigned bank) {
     if (prg_16k_banks == 1) {
@@ -143,8 +237,10 @@ void set_prg_32k_bank(unsigned bank) {
             prg_pages[i] = bank_ptr + 0x2000*i;
     }
 
-    for (unsigned i = 0; i < 4; ++i)
+    for (unsigned i = 0; i < 4; ++i) {
         prg_page_is_ram[i] = false;
+        map_prg_page(i);
+    }
 }
 
 void set_prg_16k_bank(unsigned n, int bank, bool is_ram /* = false */) {
@@ -168,6 +264,7 @@ void set_prg_16k_bank(unsigned n, int bank, bool is_ram /* = false */) {
     for (unsigned i = 0; i < 2; ++i) {
         prg_pages[2*n + i] = bank_ptr + 0x2000*i;
         prg_page_is_ram[2*n + i] = is_ram;
+        map_prg_page(2*n + i);
     }
 }
 
@@ -190,15 +287,18 @@ void set_prg_8k_bank(unsigned n, int bank, bool is_ram /* = false */) {
 
     prg_pages[n] = base + 0x2000*(bank & mask);
     prg_page_is_ram[n] = is_ram;
+    map_prg_page(n);
 }
 
 void set_chr_8k_bank(unsigned bank) {
+    sync_ppu();
     uint8_t *const bank_ptr = chr_base + 0x2000*(bank & (chr_8k_banks - 1));
     for (unsigned i = 0; i < 8; ++i)
         chr_pages[i] = bank_ptr + 0x400*i;
 }
 
 void set_chr_4k_bank(unsigned n, unsigned bank) {
+    sync_ppu();
     assert(n < 2);
     uint8_t *const bank_ptr = chr_base + 0x1000*(bank & (2*chr_8k_banks - 1));
     for (unsigned i = 0; i < 4; ++i)
@@ -206,6 +306,7 @@ void set_chr_4k_bank(unsigned n, unsigned bank) {
 }
 
 void set_chr_2k_bank(unsigned n, unsigned bank) {
+    sync_ppu();
     assert(n < 4);
     uint8_t *const bank_ptr = chr_base + 0x800*(bank & (4*chr_8k_banks - 1));
     for (unsigned i = 0; i < 2; ++i)
@@ -213,25 +314,79 @@ void set_chr_2k_bank(unsigned n, unsigned bank) {
 }
 
 void set_chr_1k_bank(unsigned n, unsigned bank) {
+    sync_ppu();
     assert(n < 8);
     chr_pages[n] = chr_base + 0x400*(bank & (8*chr_8k_banks - 1));
 }
 
-uint8_t *wram_6000_page;
+THREAD_LOCAL uint8_t *wram_6000_page;
 
 void set_wram_6000_bank(unsigned bank) {
     wram_6000_page = wram_base + 0x2000*(bank & (wram_8k_banks - 1));
+    map_wram_6000_page();
+}
+
+//
+// CPU memory map
+//
+
+THREAD_LOCAL Cpu_page cpu_pages[256];
+
+void init_cpu_mem_map() {
+    // $0000-$1FFF: 2 KB of RAM, mirrored four times
+    for (unsigned i = 0; i < 4; ++i)
+        map_cpu_mem(0x08*i, 0x08, ram, true, DIRTY_RAM, ram);
+    map_cpu_handler(0x20, 0x20, PAGE_PPU);
+    map_cpu_handler(0x40, 0x01, PAGE_IO);
+    map_cpu_handler(0x41, 0x1F, PAGE_CART);
+    map_wram_6000_page();
+    for (unsigned n = 0; n < 4; ++n)
+        map_prg_page(n);
+
+    for (unsigned i = 0; i < 256; ++i)
+        cpu_pages[i].mapper_write = false;
+    for (unsigned i = 0; i < mapper_fns.n_write_windows; ++i) {
+        Cpu_window const &window = mapper_fns.write_windows[i];
+        for (unsigned page = window.first >> 8; page <= window.last >> 8; ++page)
+            cpu_pages[page].mapper_write = true;
+    }
 }
 
 //
 // Mirroring
 //
 
-Mirroring mirroring;
+THREAD_LOCAL Mirroring mirroring;
 
 void set_mirroring(Mirroring m) {
+    sync_ppu();
     // In four-screen mode, the cart is assumed to be wired so that the mapper
     // can't influence mirroring
     if (mirroring != FOUR_SCREEN)
         mirroring = m;
 }
+
+//
+// Switching between consoles
+//
+
+// The memory mappings are derived from the mapper state for most mappers, but
+// some (e.g. NROM) only set them up once in their init() function. The
+// mirroring mode might also come from the iNES header.
+template<bool calculating_size, bool is_save>
+void transfer_mapper_context(uint8_t *&buf) {
+    TRANSFER(prg_pages)
+    TRANSFER(prg_page_is_ram)
+    TRANSFER(chr_pages)
+    TRANSFER(wram_6000_page)
+    TRANSFER(mirroring)
+}
+
+// Explicit instantiations
+
+// Calculating context size
+template void transfer_mapper_context<true, false>(uint8_t*&);
+// Saving context to buffer
+template void transfer_mapper_context<false, true>(uint8_t*&);
+// Loading context from buffer
+template void transfer_mapper_context<false, false>(uint8_t*&);
@@ -4,9 +4,9 @@
 
 #include "mapper.h"
 
-static unsigned temp_reg;
-static unsigned nth_write;
-static unsigned regs[4];
+static THREAD_LOCAL unsigned temp_reg;
+static THREAD_LOCAL unsigned nth_write;
+static THREAD_LOCAL unsigned regs[4];
 
 static void apply_state() {
     switch (regs[0] & 3) {
@@ -52,7 +52,6 @@ void mapper_1_init() {
 
 void mapper_1_write(uint8_t val, uint16_t addr) {
     // static uint64_t last_write_cycle;
-    if (!(addr & 0x8000)) return;
 
     // Writes after the first write are ignored for writes on consecutive CPU
     // cycles. Bill & Ted's Excellent Adventure needs this.
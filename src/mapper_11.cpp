@@ -4,7 +4,7 @@
 
 #include "mapper.h"
 
-uint8_t prg_bank, chr_bank;
+THREAD_LOCAL uint8_t prg_bank, chr_bank;
 
 static void apply_state() {
     set_prg_32k_bank(prg_bank);
@@ -16,8 +16,7 @@ void mapper_11_init() {
     apply_state();
 }
 
-void mapper_11_write(uint8_t val, uint16_t addr) {
-    if (!(addr & 0x8000)) return;
+void mapper_11_write(uint8_t val, uint16_t) {
     prg_bank = val & 3;
     chr_bank = val >> 4;
     apply_state();
@@ -4,7 +4,7 @@
 
 #include "mapper.h"
 
-static uint8_t chr_bank;
+static THREAD_LOCAL uint8_t chr_bank;
 
 static void apply_state() {
     set_chr_4k_bank(1, chr_bank);
@@ -21,8 +21,7 @@ void mapper_13_init() {
     apply_state();
 }
 
-void mapper_13_write(uint8_t val, uint16_t addr) {
-    if (!(addr & 0x8000)) return;
+void mapper_13_write(uint8_t val, uint16_t) {
     chr_bank = val & 3;
     apply_state();
 }
@@ -4,7 +4,7 @@
 
 #include "mapper.h"
 
-static uint8_t prg_bank;
+static THREAD_LOCAL uint8_t prg_bank;
 
 static void apply_state() {
     set_prg_16k_bank(0, prg_bank);
@@ -18,9 +18,7 @@ void mapper_2_init() {
     apply_state();
 }
 
-void mapper_2_write(uint8_t val, uint16_t addr) {
-    if (!(addr & 0x8000)) return;
-
+void mapper_2_write(uint8_t val, uint16_t) {
     prg_bank = val;
     apply_state();
 }
@@ -9,9 +9,9 @@
 
 // 64 KB block, selected by 0x8000-0x9FFF. Represented as an offset in 16 KB
 // units - always a multiple of four.
-static uint8_t block;
+static THREAD_LOCAL uint8_t block;
 // 16 KB Page within block, selected by 0xA000-0xFFFF
-static uint8_t page;
+static THREAD_LOCAL uint8_t page;
 
 static void apply_state() {
     set_prg_16k_bank(0, block | page);
@@ -27,8 +27,6 @@ void mapper_232_init() {
 }
 
 void mapper_232_write(uint8_t val, uint16_t addr) {
-    if (!(addr & 0x8000)) return;
-
     if (!((addr >> 13) & 3))
         // 0x8000-0x9FFF
         block = (val & 0x18) >> 1;
@@ -7,7 +7,7 @@
 
 // Actual reg is only 2 bits wide, but some homebrew ROMs (e.g.
 // lolicatgirls) assume more is possible
-static uint8_t chr_bank;
+static THREAD_LOCAL uint8_t chr_bank;
 
 static void apply_state() {
     set_chr_8k_bank(chr_bank);
@@ -21,8 +21,6 @@ void mapper_3_init() {
 }
 
 void mapper_3_write(uint8_t val, uint16_t addr) {
-    if (!(addr & 0x8000)) return;
-
     // Cybernoid depends on bus conflicts
     if (has_bus_conflicts) val &= read_prg(addr);
     chr_bank = val;
@@ -4,20 +4,25 @@
 #include "mapper.h"
 #include "ppu.h"
 
-static unsigned reg_8000;
+static THREAD_LOCAL unsigned reg_8000;
 
 // regs[0-5] define CHR mappings, regs[6-7] PRG mappings
-static unsigned regs[8];
+static THREAD_LOCAL unsigned regs[8];
 
-static bool horizontal_mirroring;
+static THREAD_LOCAL bool horizontal_mirroring;
 
 // IRQs
 
-static uint8_t irq_period;
-static uint8_t irq_period_cnt;
-static bool    irq_enabled;
+static THREAD_LOCAL uint8_t irq_period;
+static THREAD_LOCAL uint8_t irq_period_cnt;
+static THREAD_LOCAL bool    irq_enabled;
+static THREAD_LOCAL uint64_t last_a12_high_cycle;
 
-static void apply_state() {
+// The registers are applied piecemeal, so that a write only remaps what it
+// affects. Games that bank-switch a lot would otherwise remap every PRG and
+// CHR page on each write.
+
+static void apply_prg_banks() {
     // Second 8K PRG bank fixed to regs[7]
     set_prg_8k_bank(1, regs[7]);
     if (!(reg_8000 & 0x40)) {
@@ -30,41 +35,67 @@ static void apply_state() {
         set_prg_8k_bank(0, -2);
         set_prg_8k_bank(2, regs[6]);
     }
+}
 
-    if (!(reg_8000 & 0x80)) {
-        // [ <regs[0]> | <regs[1]> | regs[2..5] ]
-        set_chr_2k_bank(0, regs[0] >> 1);
-        set_chr_2k_bank(1, regs[1] >> 1);
-        for (unsigned i = 0; i < 4; ++i)
-            set_chr_1k_bank(4 + i, regs[2 + i]);
-    }
-    else {
-        // [ regs[2..5] | <regs[0]> | <regs[1]> ]
-        for (unsigned i = 0; i < 4; ++i)
-            set_chr_1k_bank(i, regs[2 + i]);
-        set_chr_2k_bank(2, regs[0] >> 1);
-        set_chr_2k_bank(3, regs[1] >> 1);
-    }
+// Applies CHR register 'n' (0-5)
+static void apply_chr_bank(unsigned n) {
+    // Bit 7 of $8000 swaps the halves of the CHR space:
+    //   [ <regs[0]> | <regs[1]> | regs[2..5] ] when clear
+    //   [ regs[2..5] | <regs[0]> | <regs[1]> ] when set
+    unsigned const swap = (reg_8000 & 0x80) ? 4 : 0;
+    if (n < 2)
+        set_chr_2k_bank(n + swap/2, regs[n] >> 1);
+    else
+        set_chr_1k_bank((n + 2) ^ swap, regs[n]);
+}
+
+static void apply_chr_banks() {
+    for (unsigned n = 0; n < 6; ++n)
+        apply_chr_bank(n);
+}
 
+static void apply_mirroring() {
     set_mirroring(horizontal_mirroring ? HORIZONTAL : VERTICAL);
 }
 
+static void apply_state() {
+    apply_prg_banks();
+    apply_chr_banks();
+    apply_mirroring();
+}
+
 void mapper_4_init() {
+    reg_8000 = 0;
     init_array(regs, (unsigned)0);
     horizontal_mirroring = true; // Guess
     set_prg_8k_bank(3, -1); // Last PRG 8K page fixed
     irq_period = irq_period_cnt = 0;
     irq_enabled = false;
+    last_a12_high_cycle = 0;
     apply_state();
 }
 
 void mapper_4_write(uint8_t val, uint16_t addr) {
-    if (!(addr & 0x8000)) return;
-
     switch (((addr >> 12) & 6) | (addr & 1)) {
-    case 0: reg_8000 = val;                      break; // 0x8000
-    case 1: regs[reg_8000 & 7] = val;            break; // 0x8001
-    case 2: horizontal_mirroring = val & 1;      break; // 0xA000
+    case 0: // 0x8000
+    {
+        unsigned const changed = reg_8000 ^ val;
+        reg_8000 = val;
+        if (changed & 0x40) apply_prg_banks();
+        if (changed & 0x80) apply_chr_banks();
+        break;
+    }
+    case 1: // 0x8001
+        regs[reg_8000 & 7] = val;
+        if ((reg_8000 & 7) < 6)
+            apply_chr_bank(reg_8000 & 7);
+        else
+            apply_prg_banks();
+        break;
+    case 2: // 0xA000
+        horizontal_mirroring = val & 1;
+        apply_mirroring();
+        break;
     // WRAM write protection
     case 3:                                      break; // 0xA001
     case 4: irq_period = val;                    break; // 0xC000
@@ -74,8 +105,6 @@ void mapper_4_write(uint8_t val, uint16_t addr) {
     case 7: irq_enabled = true;                  break; // 0xE001
     default: UNREACHABLE
     }
-
-    apply_state();
 }
 
 // There is a short delay after A12 rises till IRQ is asserted, but it probably
@@ -99,16 +128,12 @@ static void clock_scanline_counter() {
     }
 }
 
-static uint64_t last_a12_high_cycle;
-
-unsigned const min_a12_rise_diff = 16;
-
 void mapper_4_ppu_tick_callback() {
     //if (delayed_irq > 0 && --delayed_irq == 0)
         //set_cart_irq(true);
 
     if (ppu_addr_bus & 0x1000) {
-        if (ppu_cycle - last_a12_high_cycle >= min_a12_rise_diff)
+        if (ppu_cycle - last_a12_high_cycle >= mmc3_min_a12_rise_diff)
             clock_scanline_counter();
         last_a12_high_cycle = ppu_cycle;
     }
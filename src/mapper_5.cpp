@@ -6,9 +6,10 @@
 #include "mapper.h"
 #include "ppu.h"
 #include "rom.h"
+#include "save_states.h"
 
 // 1 KB of extra on-chip memory
-static uint8_t exram[1024];
+static THREAD_LOCAL uint8_t exram[1024];
 
 // Mirroring:
 //  ---------------------------
@@ -32,45 +33,45 @@ static uint8_t exram[1024];
 //    Vert:  $44  (%01 00 01 00)
 //    1ScA:  $00  (%00 00 00 00)
 //    1ScB:  $55  (%01 01 01 01)
-static uint8_t mmc5_mirroring;
+static THREAD_LOCAL uint8_t mmc5_mirroring;
 
 // $5104:  [.... ..XX]    ExRAM mode
 //     %00 = Extra Nametable mode    ("Ex0")
 //     %01 = Extended Attribute mode ("Ex1")
 //     %10 = CPU access mode         ("Ex2")
 //     %11 = CPU read-only mode      ("Ex3")
-static unsigned exram_mode;
+static THREAD_LOCAL unsigned exram_mode;
 
-static unsigned prg_mode;
-static unsigned chr_mode;
+static THREAD_LOCAL unsigned prg_mode;
+static THREAD_LOCAL unsigned chr_mode;
 
-static unsigned prg_banks[4];
-static unsigned sprite_chr_banks[8];
-static unsigned bg_chr_banks[4];
+static THREAD_LOCAL unsigned prg_banks[4];
+static THREAD_LOCAL unsigned sprite_chr_banks[8];
+static THREAD_LOCAL unsigned bg_chr_banks[4];
 
-static unsigned wram_6000_bank;
+static THREAD_LOCAL unsigned wram_6000_bank;
 
-static unsigned high_chr_bits; // $5130, pre-shifted by 6
+static THREAD_LOCAL unsigned high_chr_bits; // $5130, pre-shifted by 6
 
 // Built-in multiplier in $5205/$5206
-static unsigned multiplicand, multiplier;
+static THREAD_LOCAL unsigned multiplicand, multiplier;
 
 // Scanline IRQ and frame logic
 
-static bool    irq_pending;
-static bool    irq_enabled;
-static uint8_t irq_scanline;
-static uint8_t scanline_cnt;
-static bool    in_frame;
+static THREAD_LOCAL bool    irq_pending;
+static THREAD_LOCAL bool    irq_enabled;
+static THREAD_LOCAL uint8_t irq_scanline;
+static THREAD_LOCAL uint8_t scanline_cnt;
+static THREAD_LOCAL bool    in_frame;
 
 // 'true' if the background CHR mappings are currently active. Only an
 // optimization at the moment.
-static bool using_bg_chr;
+static THREAD_LOCAL bool using_bg_chr;
 
 // Fill mode
 
-static uint8_t fill_tile;
-static uint8_t fill_attrib;
+static THREAD_LOCAL uint8_t fill_tile;
+static THREAD_LOCAL uint8_t fill_attrib;
 
 // Extended attribute mode
 
@@ -78,18 +79,18 @@ static uint8_t fill_attrib;
 // is able to supply the corresponding attribute byte for the subsequent
 // attribute fetch. Use this to keep track of the previously fetched
 // non-attribute value from exram so we can do the same.
-static uint8_t exram_val;
+static THREAD_LOCAL uint8_t exram_val;
 
 // Vertical split mode
 
 // $5200
-static bool     split_enabled;
-static bool     split_on_right;
-static unsigned split_tile_nr;
+static THREAD_LOCAL bool     split_enabled;
+static THREAD_LOCAL bool     split_on_right;
+static THREAD_LOCAL unsigned split_tile_nr;
 // $5201
-static unsigned split_y_scroll;
+static THREAD_LOCAL unsigned split_y_scroll;
 // $5202
-static unsigned split_chr_page;
+static THREAD_LOCAL unsigned split_chr_page;
 
 static void use_bg_chr() {
     using_bg_chr = true;
@@ -200,6 +201,7 @@ void mapper_5_init() {
     init_array(sprite_chr_banks, 0xFFu);
     init_array(bg_chr_banks, 0xFFu);
 
+    exram_mode     = 0;
     prg_mode       = chr_mode = 3;
     wram_6000_bank = 7;
     mmc5_mirroring = 0xFF;
@@ -207,8 +209,13 @@ void mapper_5_init() {
     multiplicand   = multiplier = 0;
 
     irq_pending = irq_enabled = in_frame = false;
+    irq_scanline = scanline_cnt = 0;
 
     fill_tile = fill_attrib = 0;
+    exram_val = 0;
+
+    split_enabled = split_on_right = false;
+    split_tile_nr = split_y_scroll = split_chr_page = 0;
 
     // Assume the sprite CHR banks are used at startup
     using_bg_chr = false;
@@ -240,8 +247,6 @@ uint8_t mapper_5_read(uint16_t addr) {
 }
 
 void mapper_5_write(uint8_t val, uint16_t addr) {
-    if (addr < 0x5100) return;
-
     switch (addr) {
     case 0x5100: prg_mode = val & 3;     break;
     case 0x5101: chr_mode = val & 3;     break;
@@ -417,9 +422,15 @@ void mapper_5_write_nt(uint8_t val, uint16_t addr) {
     unsigned const bit_offset = (addr >> 9) & 6;
     switch ((mmc5_mirroring >> bit_offset) & 3) {
     // Internal nametable A
-    case 0: ciram[addr & 0x03FF] = val; break;
+    case 0:
+        ciram[addr & 0x03FF] = val;
+        mark_page_dirty(DIRTY_CIRAM, addr & 0x03FF);
+        break;
     // Internal nametable B
-    case 1: ciram[0x0400 | (addr & 0x03FF)] = val; break;
+    case 1:
+        ciram[0x0400 | (addr & 0x03FF)] = val;
+        mark_page_dirty(DIRTY_CIRAM, 0x0400 | (addr & 0x03FF));
+        break;
     // Use ExRAM as nametable
     case 2: if (exram_mode <= 1) exram[addr & 0x03FF] = val; break;
     // Assume the fill tile and attribute can't be written through the PPU in
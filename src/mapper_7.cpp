@@ -4,7 +4,7 @@
 
 #include "mapper.h"
 
-static uint8_t reg;
+static THREAD_LOCAL uint8_t reg;
 
 static void apply_state() {
     set_mirroring(reg & 0x10 ? ONE_SCREEN_HIGH : ONE_SCREEN_LOW);
@@ -17,8 +17,7 @@ void mapper_7_init() {
     apply_state();
 }
 
-void mapper_7_write(uint8_t val, uint16_t addr) {
-    if (!(addr & 0x8000)) return;
+void mapper_7_write(uint8_t val, uint16_t) {
     reg = val;
     apply_state();
 }
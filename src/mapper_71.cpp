@@ -6,7 +6,7 @@
 
 // TODO: This mapper has variants that work differently
 
-static uint8_t prg_bank;
+static THREAD_LOCAL uint8_t prg_bank;
 
 static void apply_state() {
     set_prg_16k_bank(0, prg_bank);
@@ -21,12 +21,10 @@ void mapper_71_init() {
     apply_state();
 }
 
-void mapper_71_write(uint8_t val, uint16_t addr) {
-    if (!(~addr & 0xC000)) {
-        // $C000-$FFFF
-        prg_bank = val;
-        apply_state();
-    }
+void mapper_71_write(uint8_t val, uint16_t) {
+    // $C000-$FFFF
+    prg_bank = val;
+    apply_state();
 }
 
 MAPPER_STATE_START(71)
@@ -5,20 +5,20 @@
 #include "mapper.h"
 #include "ppu.h"
 
-static uint8_t prg_bank;
+static THREAD_LOCAL uint8_t prg_bank;
 
 // Index 0 is from $B000/$D000, index 1 from $C000/$E000
-static uint8_t chr_low_bank[2];
-static uint8_t chr_high_bank[2];
+static THREAD_LOCAL uint8_t chr_low_bank[2];
+static THREAD_LOCAL uint8_t chr_high_bank[2];
 
-static bool chr_low_uses_C000, chr_high_uses_E000;
+static THREAD_LOCAL bool chr_low_uses_C000, chr_high_uses_E000;
 
 // Assume the CHR switch-over happens when the PPU address bus goes from one of
 // the magic values to some other value (maybe not perfectly accurate, but
 // captures observed behavior)
-static uint16_t prev_ppu_addr_bus;
+static THREAD_LOCAL uint16_t prev_ppu_addr_bus;
 
-static bool horizontal_mirroring;
+static THREAD_LOCAL bool horizontal_mirroring;
 
 static void apply_state() {
     set_prg_8k_bank(0, prg_bank);
@@ -41,13 +41,12 @@ void mapper_9_init() {
     chr_high_bank[0] = chr_high_bank[1] = 0;
     chr_low_uses_C000 = chr_high_uses_E000 = false;
     prev_ppu_addr_bus = 0;
+    horizontal_mirroring = false;
 
     apply_state();
 }
 
 void mapper_9_write(uint8_t val, uint16_t addr) {
-    if (!(addr & 0x8000)) return;
-
     switch ((addr >> 12) & 7) {
     case 2: prg_bank             = val & 0x0F; break; // 0xA000
     case 3: chr_low_bank[0]      = val & 0x1F; break; // 0xB000
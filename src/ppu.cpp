@@ -1,133 +1,185 @@
 #include "common.h"
 
+#include "backend.h"
 #include "cpu.h"
 #include "ppu.h"
 #include "mapper.h"
 #include "rom.h"
-#include "sdl_backend.h"
+#include "save_states.h"
+#include "scheduler.h"
 #include "timing.h"
 
 #include "palette.inc"
 
+#ifdef __SSE2__
+#  include <immintrin.h>
+#endif
+
 // Points to the current palette as determined by the color tint bits
-static uint32_t const     *pal_to_rgb;
+static THREAD_LOCAL uint32_t const *pal_to_rgb;
 
 // If true, treat the emulated code as the first code that runs (i.e., not the
 // situation on PowerPak), which means writes to certain registers will be
 // inhibited during the initial frame. This breaks some demos.
-bool const                starts_on_initial_frame = false;
+bool const                         starts_on_initial_frame = false;
 
-uint8_t                   *ciram;
+THREAD_LOCAL uint8_t               *ciram;
 
-unsigned                  prerender_line;
+THREAD_LOCAL unsigned              prerender_line;
 
-static uint8_t            palettes[0x20];
-static uint8_t            oam[0x100];
-static uint8_t            sec_oam[0x20];
+static THREAD_LOCAL uint8_t        palettes[0x20];
+static THREAD_LOCAL uint8_t        oam[0x100];
+static THREAD_LOCAL uint8_t        sec_oam[0x20];
 
 // VRAM address/scroll regs. 15 bits long.
-static unsigned           t, v;
-static uint8_t            fine_x;
+static THREAD_LOCAL unsigned       t, v;
+static THREAD_LOCAL uint8_t        fine_x;
 // v is not immediately updated from t on the second write to $2006. This
 // variable implements the delay.
-static unsigned           pending_v_update;
+static THREAD_LOCAL unsigned       pending_v_update;
 
-static unsigned           v_inc;           // $2000:2
-static uint16_t           sprite_pat_addr; // $2000:3
-static uint16_t           bg_pat_addr;     // $2000:4
-static enum Sprite_size {
+static THREAD_LOCAL unsigned       v_inc;           // $2000:2
+static THREAD_LOCAL uint16_t       sprite_pat_addr; // $2000:3
+static THREAD_LOCAL uint16_t       bg_pat_addr;     // $2000:4
+static THREAD_LOCAL enum  Sprite_size {
     EIGHT_BY_EIGHT,
     EIGHT_BY_SIXTEEN
-}                         sprite_size;   // $2000:5
-static bool               nmi_on_vblank; // $2000:7
+}                                  sprite_size;   // $2000:5
+static THREAD_LOCAL bool           nmi_on_vblank; // $2000:7
 
 // $2001:0 - 0x30 if grayscale mode enabled, otherwise 0x3F
-static uint8_t            grayscale_color_mask;
-static bool               show_bg_left_8;       // $2001:1
-static bool               show_sprites_left_8;  // $2001:2
-static bool               show_bg;              // $2001:3
-static bool               show_sprites;         // $2001:4
-static uint8_t            tint_bits;            // $2001:7-5
-
-bool                      rendering_enabled;
+static THREAD_LOCAL uint8_t        grayscale_color_mask;
+static THREAD_LOCAL bool           show_bg_left_8;       // $2001:1
+static THREAD_LOCAL bool           show_sprites_left_8;  // $2001:2
+static THREAD_LOCAL bool           show_bg;              // $2001:3
+static THREAD_LOCAL bool           show_sprites;         // $2001:4
+static THREAD_LOCAL uint8_t        tint_bits;            // $2001:7-5
+
+THREAD_LOCAL bool                  rendering_enabled;
 // Optimizations - if bg/sprites are disabled, a value is set that causes
 // comparisons to always fail. If the leftmost 8 pixels should be clipped,
 // comparisons only fail for those pixels. Otherwise, comparisons never fail.
-static unsigned           bg_clip_comp;
-static unsigned           sprite_clip_comp;
+static THREAD_LOCAL unsigned       bg_clip_comp;
+static THREAD_LOCAL unsigned       sprite_clip_comp;
 
-static bool               sprite_overflow; // $2002:5
-static bool               sprite_zero_hit; // $2002:6
-static bool               in_vblank;       // $2002:7
+static THREAD_LOCAL bool           sprite_overflow; // $2002:5
+static THREAD_LOCAL bool           sprite_zero_hit; // $2002:6
+static THREAD_LOCAL bool           in_vblank;       // $2002:7
 
-static uint8_t            oam_addr; // $2003
+static THREAD_LOCAL uint8_t        oam_addr; // $2003
 // Pointer into the secondary OAM, 5 bits wide
 //  - Updated during sprite evaluation and loading
 //  - Cleared at dots 64.5, 256.5 and 340.5, if rendering
-static unsigned           sec_oam_addr;
-static uint8_t            oam_data; // $2004 (seen when reading from $2004)
+static THREAD_LOCAL unsigned       sec_oam_addr;
+static THREAD_LOCAL uint8_t        oam_data; // $2004 (seen when reading from $2004)
 
 // Sprite evaluation state
 
 // Goes high for three ticks when an in-range sprite is found during sprite
 // evaluation
-static unsigned           copy_sprite_signal;
-static bool               oam_addr_overflow, sec_oam_addr_overflow;
-static bool               overflow_detection;
+static THREAD_LOCAL unsigned       copy_sprite_signal;
+static THREAD_LOCAL bool           oam_addr_overflow, sec_oam_addr_overflow;
+static THREAD_LOCAL bool           overflow_detection;
 
 // PPUSCROLL/PPUADDR write flip-flop. First write when false, second write when
 // true.
-static bool               write_flip_flop;
+static THREAD_LOCAL bool           write_flip_flop;
 
-static uint8_t            ppu_data_reg; // $2007 read buffer
+static THREAD_LOCAL uint8_t        ppu_data_reg; // $2007 read buffer
 
-static bool               odd_frame;
+static THREAD_LOCAL bool           odd_frame;
 
-uint64_t                  ppu_cycle;
+THREAD_LOCAL uint64_t              ppu_cycle;
 
 // Internal PPU counters and registers
 
-unsigned                  dot, scanline;
+THREAD_LOCAL unsigned              dot, scanline;
+
+static THREAD_LOCAL uint8_t        nt_byte, at_byte;
+static THREAD_LOCAL uint8_t        bg_byte_l, bg_byte_h;
+static THREAD_LOCAL uint16_t       bg_shift_l, bg_shift_h;
+static THREAD_LOCAL unsigned       at_shift_l, at_shift_h;
+static THREAD_LOCAL unsigned       at_latch_l, at_latch_h;
 
-static uint8_t            nt_byte, at_byte;
-static uint8_t            bg_byte_l, bg_byte_h;
-static uint16_t           bg_shift_l, bg_shift_h;
-static unsigned           at_shift_l, at_shift_h;
-static unsigned           at_latch_l, at_latch_h;
+static THREAD_LOCAL uint8_t        sprite_attribs[8];
+static THREAD_LOCAL uint8_t        sprite_x[8];
+static THREAD_LOCAL uint8_t        sprite_pat_l[8];
+static THREAD_LOCAL uint8_t        sprite_pat_h[8];
 
-static uint8_t            sprite_attribs[8];
-static uint8_t            sprite_x[8];
-static uint8_t            sprite_pat_l[8];
-static uint8_t            sprite_pat_h[8];
+static THREAD_LOCAL bool           s0_on_next_scanline;
+static THREAD_LOCAL bool           s0_on_cur_scanline;
 
-static bool               s0_on_next_scanline;
-static bool               s0_on_cur_scanline;
+// The sprite pixels for the current line, worked out from the sprite output
+// units above. Each entry holds the pattern bits in bits 1-0 (0 if there's no
+// sprite pixel), the palette in bits 3-2, the priority in bit 5, and
+// SPRITE_LINE_S0 if the pixel comes from sprite zero. Bit n in
+// 'sprite_line_tiles' is set if there are any sprite pixels in pixels
+// 8n-8n+7.
+//
+// Not part of the state. Set 'sprite_line_dirty' when the sprite output units
+// change, and the buffer is rebuilt before it is used next.
+static THREAD_LOCAL uint8_t        sprite_line[256];
+static THREAD_LOCAL uint32_t       sprite_line_tiles;
+static THREAD_LOCAL bool           sprite_line_dirty;
+uint8_t const SPRITE_LINE_S0 = 0x40;
 
 // Temporary storage (also exists in PPU) for data during sprite loading
-static uint8_t            sprite_y, sprite_index;
-static bool               sprite_in_range;
+static THREAD_LOCAL uint8_t        sprite_y, sprite_index;
+static THREAD_LOCAL bool           sprite_in_range;
 
 // Writes to certain registers are suppressed during the initial frame:
 // http://wiki.nesdev.com/w/index.php/PPU_power_up_state
 //
 // Emulating this makes NY2011 and possibly other demos hang. They probably
 // don't run on the real thing either.
-static bool               initial_frame;
+static THREAD_LOCAL bool           initial_frame;
 
-unsigned                  ppu_addr_bus;
+THREAD_LOCAL unsigned              ppu_addr_bus;
 
 // Open bus for reads from PPU $2000-$2007 (tested by ppu_open_bus.nes).
 // "wcycle" is short for "write cycle".
 
-static uint8_t            ppu_open_bus;
-static uint64_t           bit_7_6_wcycle, bit_5_wcycle, bit_4_0_wcycle;
+static THREAD_LOCAL uint8_t        ppu_open_bus;
+static THREAD_LOCAL uint64_t       bit_7_6_wcycle, bit_5_wcycle, bit_4_0_wcycle;
+
+static THREAD_LOCAL unsigned       open_bus_decay_cycles;
+
+#ifdef CATCH_UP_PPU
+// True if the mapper has a ppu_tick_callback() that needs to see each dot
+static THREAD_LOCAL bool           mapper_snoops_ppu;
+// True if the mapper's ppu_tick_callback() only counts A12 rises (MMC3)
+static THREAD_LOCAL bool           mapper_counts_a12;
+// A12 of ppu_addr_bus as of the last dot run, which is the last A12 the
+// mapper has seen. $2007 accesses can raise A12 on the bus in between dots.
+static THREAD_LOCAL bool           mapper_saw_a12;
+#endif
 
-static unsigned           open_bus_decay_cycles;
+// Compositor state (see compose_8_pixels())
+
+// Pixels up to and including this PPU cycle have already been output by the
+// compositor
+static THREAD_LOCAL uint64_t       composed_till_cycle;
+// PPU cycle of a sprite zero hit that the compositor has set sprite_zero_hit
+// for ahead of time, or 0 if none
+static THREAD_LOCAL uint64_t       early_s0_hit_cycle;
+// True if the CPU supports AVX2, which is used for the color lookups
+static THREAD_LOCAL bool           use_avx2;
+
+// True if the pixels for the current frame are skipped, because the backend
+// doesn't want the frame (see want_frame()). Only sprite zero hits are
+// detected then.
+static THREAD_LOCAL bool           skipping_frame;
+
+static void select_ppu_loop();
 
 void init_ppu_for_rom() {
     prerender_line = is_pal ? 311 : 261;
     // PPU open bus values fade after about 600 ms
     open_bus_decay_cycles = 0.6*ppu_clock_rate;
+    select_ppu_loop();
+#ifdef __SSE2__
+    use_avx2 = __builtin_cpu_supports("avx2");
+#endif
 }
 
 static void open_bus_refreshed() {
@@ -186,8 +238,68 @@ static uint8_t read_nt(uint16_t addr) {
 static void write_nt(uint16_t addr, uint8_t val) {
     if (mapper_fns.write_nt)
         mapper_fns.write_nt(val, addr);
-    else
-        ciram[get_mirrored_addr(addr)] = val;
+    else {
+        unsigned const mirrored_addr = get_mirrored_addr(addr);
+        ciram[mirrored_addr] = val;
+        mark_page_dirty(DIRTY_CIRAM, mirrored_addr);
+    }
+}
+
+//
+// Mapper PPU hooks
+//
+// The PPU loop is specialized for the PPU hooks of the mapper (see
+// select_ppu_loop()). Mappers that don't snoop on the PPU or have custom
+// nametables pay nothing for the hooks, and the hooks of those that do are
+// called directly.
+//
+
+// No hooks
+struct No_ppu_hooks {
+    static bool const snoops    = false;
+    static bool const custom_nt = false;
+    // True if the hook only reacts to A12 rises that MMC3 would count (see
+    // calc_dots_till_a12_clock())
+    static bool const a12_only  = false;
+    static void    ppu_tick() {}
+    static uint8_t read_nt(uint16_t) { return 0; }
+};
+
+// TICK snoops on the PPU each dot
+template<void (*TICK)()>
+struct Snooping_ppu_hooks : No_ppu_hooks {
+    static bool const snoops = true;
+    static void ppu_tick() { TICK(); }
+};
+
+// TICK only looks for A12 rises (MMC3). Those are predicted in catch-up mode.
+template<void (*TICK)()>
+struct A12_ppu_hooks : Snooping_ppu_hooks<TICK> {
+    static bool const a12_only = true;
+};
+
+// READ_NT also supplies the nametable bytes (MMC5)
+template<void (*TICK)(), uint8_t (*READ_NT)(uint16_t)>
+struct Nt_ppu_hooks : Snooping_ppu_hooks<TICK> {
+    static bool const custom_nt = true;
+    static uint8_t read_nt(uint16_t addr) { return READ_NT(addr); }
+};
+
+// Goes through mapper_fns. Used for mappers not known to select_ppu_loop().
+struct Generic_ppu_hooks {
+    static bool const snoops    = true;
+    static bool const custom_nt = true;
+    static bool const a12_only  = false;
+    static void    ppu_tick() { mapper_fns.ppu_tick_callback(); }
+    static uint8_t read_nt(uint16_t addr) { return ::read_nt(addr); }
+};
+
+// read_nt() for rendering
+template<class Hooks>
+static uint8_t fetch_nt(uint16_t addr) {
+    return Hooks::custom_nt ?
+             Hooks::read_nt(addr) :
+             ciram[get_mirrored_addr(addr)];
 }
 
 // Bumps the horizontal bits in v every eight pixels during rendering
@@ -238,12 +350,13 @@ static void copy_vert() {
 }
 
 // Fetches nametable and tile bytes for the background
+template<class Hooks>
 static void do_bg_fetches() {
     switch ((dot - 1) % 8) {
 
     // NT byte
     case 0: ppu_addr_bus = 0x2000 | (v & 0x0FFF); break;
-    case 1: nt_byte = read_nt(ppu_addr_bus);      break;
+    case 1: nt_byte = fetch_nt<Hooks>(ppu_addr_bus); break;
 
     // AT byte
     case 2:
@@ -253,7 +366,7 @@ static void do_bg_fetches() {
         ppu_addr_bus = 0x23C0 | (v & 0x0C00) | ((v >> 4) & 0x38) | ((v >> 2) & 7);
         break;
     case 3:
-        at_byte = read_nt(ppu_addr_bus);
+        at_byte = fetch_nt<Hooks>(ppu_addr_bus);
         break;
 
     // Low BG tile byte
@@ -277,36 +390,63 @@ static void do_bg_fetches() {
     }
 }
 
-// Looks for an in-range sprite pixel at the current location.
-// Performance hotspot!
-// Possible optimization: Set flag if any sprites on the line
-static unsigned get_sprite_pixel(unsigned &spr_pal, bool &spr_behind_bg, bool &spr_is_s0) {
-    unsigned const pixel = dot - 2;
-    // Equivalent to 'if (!show_sprites || (!show_sprites_left_8 && pixel < 8))'
-    if (pixel < sprite_clip_comp)
-        return 0;
+// Rebuilds 'sprite_line' from the sprite output units. Going from the
+// lowest-priority sprite to the highest, each sprite overwrites the pixels
+// where it is opaque.
+static void build_sprite_line() {
+    init_array(sprite_line, (uint8_t)0);
+    sprite_line_tiles = 0;
+
+    for (int i = 7; i >= 0; --i) {
+        if (!(sprite_pat_l[i] | sprite_pat_h[i]))
+            continue;
+
+        uint8_t const info = ((sprite_attribs[i] & 3) << 2) |
+                             (sprite_attribs[i] & 0x20) |
+                             (i == 0 && s0_on_cur_scanline ? SPRITE_LINE_S0 : 0);
+        for (unsigned offset = 0; offset < 8; ++offset) {
+            unsigned const pixel = sprite_x[i] + offset;
+            if (pixel >= 256)
+                break;
 
-    for (unsigned i = 0; i < 8; ++i) {
-        unsigned const offset = pixel - sprite_x[i];
-        if (offset < 8) { // offset >= 0 && offset < 8
             unsigned const pat_res = (NTH_BIT(sprite_pat_h[i], 7 - offset) << 1) |
                                       NTH_BIT(sprite_pat_l[i], 7 - offset);
             if (pat_res) {
-                spr_pal       = sprite_attribs[i] & 3;
-                spr_behind_bg = sprite_attribs[i] & 0x20;
-                spr_is_s0     = s0_on_cur_scanline && (i == 0);
-                return pat_res;
+                sprite_line[pixel] = info | pat_res;
+                sprite_line_tiles |= 1u << (pixel/8);
             }
         }
     }
 
-    return 0;
+    sprite_line_dirty = false;
+}
+
+// Looks for an in-range sprite pixel at the current location
+static unsigned get_sprite_pixel(unsigned &spr_pal, bool &spr_behind_bg, bool &spr_is_s0) {
+    unsigned const pixel = dot - 2;
+    // Equivalent to 'if (!show_sprites || (!show_sprites_left_8 && pixel < 8))'
+    if (pixel < sprite_clip_comp)
+        return 0;
+
+    if (sprite_line_dirty)
+        build_sprite_line();
+
+    if (!NTH_BIT(sprite_line_tiles, pixel/8))
+        return 0;
+
+    uint8_t const entry = sprite_line[pixel];
+    spr_pal       = (entry >> 2) & 3;
+    spr_behind_bg = entry & 0x20;
+    spr_is_s0     = entry & SPRITE_LINE_S0;
+    return entry & 3;
 }
 
 // Fetches pixels from the background and sprite shift registers and produces
 // an output pixel according to the pixel values and background/sprite
-// priority. Also handles sprite zero hit detection.
+// priority. Also handles sprite zero hit detection. Only does the latter if
+// OUTPUT is false.
 // Performance hotspot!
+template<bool OUTPUT>
 static void do_pixel_output_and_sprite_zero() {
 
     const int pixel = (dot >= 328) ? dot - 343 : dot - 2;
@@ -352,7 +492,159 @@ static void do_pixel_output_and_sprite_zero() {
         }
     }
 
-    put_pixel(pixel, scanline, pal_to_rgb[palettes[pal_index] & grayscale_color_mask]);
+    if (OUTPUT)
+        put_pixel(pixel, scanline, pal_to_rgb[palettes[pal_index] & grayscale_color_mask]);
+}
+
+#ifdef __SSE2__
+
+// Scanline compositor. When rendering is enabled, the visible pixels are
+// output eight at a time at the start of each tile (dots 2, 10, ..., 250)
+// instead of by do_pixel_output_and_sprite_zero(). Nothing that goes into
+// the pixels changes during those eight dots unless the CPU accesses the PPU,
+// in which case cut_compositor_short() is called first.
+
+// Expands the bits of 'bits' into byte lanes, most significant bit first.
+// Lanes 0-7 become 0xFF for set bits and 0x00 for clear bits.
+static __m128i expand_bits(unsigned bits) {
+    __m128i const bit_masks =
+      _mm_setr_epi8(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+                    0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+    return _mm_cmpeq_epi8(_mm_and_si128(_mm_set1_epi8(bits), bit_masks),
+                          bit_masks);
+}
+
+// Returns 'a' in lanes where 'mask' is 0xFF and 'b' elsewhere
+static __m128i select_lanes(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// Looks up the colors for eight palette indices, in lanes 0-7 of
+// 'pal_indices'
+__attribute__((target("avx2")))
+static void lookup_colors_avx2(__m128i pal_indices, uint32_t colors[8]) {
+    // Palette RAM lookup, with one shuffle for each half of the palette RAM
+    __m128i const pal_lo  = _mm_loadu_si128((__m128i const*)palettes);
+    __m128i const pal_hi  = _mm_loadu_si128((__m128i const*)(palettes + 16));
+    __m128i const in_hi   = _mm_cmpgt_epi8(pal_indices, _mm_set1_epi8(15));
+    __m128i const nes_col =
+      _mm_and_si128(_mm_blendv_epi8(_mm_shuffle_epi8(pal_lo, pal_indices),
+                                    _mm_shuffle_epi8(pal_hi, pal_indices),
+                                    in_hi),
+                    _mm_set1_epi8(grayscale_color_mask));
+
+    _mm256_storeu_si256((__m256i*)colors,
+      _mm256_i32gather_epi32((int const*)pal_to_rgb,
+                             _mm256_cvtepu8_epi32(nes_col), 4));
+}
+
+static void lookup_colors(__m128i pal_indices, uint32_t colors[8]) {
+    uint8_t indices[16];
+    _mm_storeu_si128((__m128i*)indices, pal_indices);
+    for (unsigned i = 0; i < 8; ++i)
+        colors[i] = pal_to_rgb[palettes[indices[i]] & grayscale_color_mask];
+}
+
+// Outputs the pixels for the current dot and the seven dots after it. Does
+// the same thing as do_pixel_output_and_sprite_zero<OUTPUT>() for each of
+// them.
+template<bool OUTPUT>
+static void compose_8_pixels() {
+    int const pixel = dot - 2;
+
+    // Background. The pixels come from the shift registers as they are now,
+    // with the attribute bits shifting in from the latches, so we can take
+    // them from a 16-bit window starting at fine_x.
+    __m128i bg_pal_index = _mm_setzero_si128();
+    __m128i bg_opaque    = _mm_setzero_si128();
+    // Equivalent to 'if (show_bg && (show_bg_left_8 || pixel >= 8))'
+    if (pixel >= (int)bg_clip_comp) {
+        unsigned const at_l = ((at_shift_l & 0xFF) << 8) | (at_latch_l ? 0xFF : 0);
+        unsigned const at_h = ((at_shift_h & 0xFF) << 8) | (at_latch_h ? 0xFF : 0);
+
+        __m128i const pat_l  = expand_bits((bg_shift_l << fine_x) >> 8);
+        __m128i const pat_h  = expand_bits((bg_shift_h << fine_x) >> 8);
+        __m128i const attr_l = expand_bits((at_l << fine_x) >> 8);
+        __m128i const attr_h = expand_bits((at_h << fine_x) >> 8);
+
+        bg_opaque = _mm_or_si128(pat_l, pat_h);
+        bg_pal_index =
+          _mm_and_si128(bg_opaque,
+            _mm_or_si128(
+              _mm_or_si128(_mm_and_si128(pat_l , _mm_set1_epi8(1)),
+                           _mm_and_si128(pat_h , _mm_set1_epi8(2))),
+              _mm_or_si128(_mm_and_si128(attr_l, _mm_set1_epi8(4)),
+                           _mm_and_si128(attr_h, _mm_set1_epi8(8)))));
+    }
+
+    // Sprites, from the sprite line buffer
+    __m128i spr_pal_index = _mm_setzero_si128();
+    __m128i spr_opaque    = _mm_setzero_si128();
+    __m128i spr_behind_bg = _mm_setzero_si128();
+    __m128i spr_is_s0     = _mm_setzero_si128();
+    // Equivalent to 'if (show_sprites && (show_sprites_left_8 || pixel >= 8))'
+    if (pixel >= (int)sprite_clip_comp) {
+        if (sprite_line_dirty)
+            build_sprite_line();
+
+        if (NTH_BIT(sprite_line_tiles, pixel/8)) {
+            __m128i const entries =
+              _mm_loadl_epi64((__m128i const*)(sprite_line + pixel));
+            __m128i const zero = _mm_setzero_si128();
+
+            spr_opaque    = _mm_cmpeq_epi8(_mm_cmpeq_epi8(
+                              _mm_and_si128(entries, _mm_set1_epi8(3)), zero), zero);
+            spr_pal_index = _mm_or_si128(_mm_and_si128(entries, _mm_set1_epi8(0x0F)),
+                                         _mm_set1_epi8(0x10));
+            spr_behind_bg = _mm_cmpeq_epi8(_mm_cmpeq_epi8(
+                              _mm_and_si128(entries, _mm_set1_epi8(0x20)), zero), zero);
+            spr_is_s0     = _mm_cmpeq_epi8(_mm_cmpeq_epi8(
+                              _mm_and_si128(entries, _mm_set1_epi8(SPRITE_LINE_S0)), zero), zero);
+        }
+    }
+
+    // Priority
+    __m128i const use_spr =
+      _mm_andnot_si128(_mm_and_si128(spr_behind_bg, bg_opaque), spr_opaque);
+    __m128i const pal_index = select_lanes(use_spr, spr_pal_index, bg_pal_index);
+
+    // Sprite zero hit. Never happens at pixel 255.
+    if (!sprite_zero_hit) {
+        unsigned const hits =
+          _mm_movemask_epi8(_mm_and_si128(spr_is_s0, bg_opaque)) &
+          (pixel == 248 ? 0x7F : 0xFF);
+        if (hits) {
+            // Set the flag now, but remember when the hit happens in case the
+            // CPU looks before then
+            sprite_zero_hit = true;
+            early_s0_hit_cycle = ppu_cycle + __builtin_ctz(hits);
+        }
+    }
+
+    if (OUTPUT) {
+        uint32_t colors[8];
+        if (use_avx2)
+            lookup_colors_avx2(pal_index, colors);
+        else
+            lookup_colors(pal_index, colors);
+        put_pixels(pixel, scanline, colors, 8);
+    }
+
+    composed_till_cycle = ppu_cycle + 7;
+}
+
+#endif
+
+// Called before the CPU accesses the PPU. If the compositor has output pixels
+// ahead of the current dot, they're output again by
+// do_pixel_output_and_sprite_zero() from here on, as the access might change
+// them. A sprite zero hit found ahead of time is taken back.
+static void cut_compositor_short() {
+    if (composed_till_cycle > ppu_cycle) {
+        composed_till_cycle = ppu_cycle;
+        if (early_s0_hit_cycle > ppu_cycle)
+            sprite_zero_hit = false;
+    }
 }
 
 // Shifts the background shift registers, reloading the upper eight bits and
@@ -543,6 +835,9 @@ static void do_sprite_loading() {
     //    257.5-258, 258.5-259, ..., 319.5-320
     s0_on_cur_scanline = s0_on_next_scanline;
 
+    // The sprite output units are about to change
+    sprite_line_dirty = true;
+
     switch ((dot - 1) % 8) {
 
     // Load sprite attributes from secondary OAM
@@ -596,6 +891,10 @@ static void do_sprite_loading() {
         // Horizontal flipping
         if (sprite_attribs[sprite_n] & 0x40)
             sprite_pat_h[sprite_n] = rev_byte(sprite_pat_h[sprite_n]);
+
+        // All sprites loaded. Get the sprite pixels for the next line ready.
+        if (dot == 320)
+            build_sprite_line();
         break;
 
     default: UNREACHABLE
@@ -604,6 +903,7 @@ static void do_sprite_loading() {
 
 // Common operations for the visible lines (0-239) and the pre-render line.
 // Performance hotspot!
+template<class Hooks>
 static void do_render_line_ops() {
     // We get a short dummy bg-related fetch here. Probably not worth
     // emulating the exact address.
@@ -616,7 +916,7 @@ static void do_render_line_ops() {
     switch (dot) {
     case 1 ... 256: case 321 ... 336:
         // Possible optimization: Could be merged to save double decoding of dot
-        do_bg_fetches();
+        do_bg_fetches<Hooks>();
         if (dot == 256)
             bump_vert();
         break;
@@ -640,14 +940,34 @@ static void do_render_line_ops() {
     }
 }
 
+template<bool OUTPUT>
+static void do_pixels() {
+#ifdef __SSE2__
+    if (rendering_enabled && dot >= 2 && dot <= 250 && (dot - 2) % 8 == 0)
+        compose_8_pixels<OUTPUT>();
+    else
+#endif
+        do_pixel_output_and_sprite_zero<OUTPUT>();
+}
+
 // Called for dots on the visible lines (0-239)
+template<class Hooks>
 static void do_visible_line_ops() {
 
-    if ( (dot <= 268) || (dot >= 328) )
-        do_pixel_output_and_sprite_zero();
+    if ( ((dot <= 268) || (dot >= 328)) && ppu_cycle > composed_till_cycle ) {
+        if (!skipping_frame || (scanline == 0 && dot == 0))
+            // Odd frames skip dot 0 on line 0, so its padding pixel keeps the
+            // value from the last frame that had the dot. Outputting it on
+            // skipped frames too keeps the wanted frames identical to those
+            // of a run without skipping.
+            do_pixels<true>();
+        else if (rendering_enabled && s0_on_cur_scanline && !sprite_zero_hit)
+            // A skipped frame only needs the sprite zero hit
+            do_pixels<false>();
+    }
 
     if (rendering_enabled) {
-        do_render_line_ops();
+        do_render_line_ops<Hooks>();
 
         switch (dot) {
         case 1 ... 64:
@@ -677,6 +997,7 @@ static void do_line_241_ops() {
 }
 
 // Called for dots on the pre-render line
+template<class Hooks>
 static void do_prerender_line_ops() {
     // This might be one tick off due to the possibility of reading the flags
     // really shortly after they are cleared in the preferred alignment
@@ -685,7 +1006,7 @@ static void do_prerender_line_ops() {
     if (dot == 2) in_vblank = false;
 
     if (rendering_enabled) {
-        do_render_line_ops();
+        do_render_line_ops<Hooks>();
 
         // This is where s0_on_next_scanline is initialized on the
         // prerender line the hardware. There's an "in visible frame"
@@ -706,7 +1027,9 @@ static void do_prerender_line_ops() {
 // the scanline number of the pre-render line (the final line of the frame).
 // These are also available as 'is_pal' and 'prerender_line', but kept as
 // compile-time constants here for performance.
-template<bool IS_PAL, unsigned PRERENDER_LINE>
+//
+// Hooks holds the mapper's PPU hooks (see above).
+template<bool IS_PAL, unsigned PRERENDER_LINE, class Hooks>
 static void tick_ppu() {
     ++ppu_cycle;
 
@@ -725,6 +1048,7 @@ static void tick_ppu() {
 
         case PRERENDER_LINE + 1:
             scanline = 0;
+            skipping_frame = !want_frame();
             if (!IS_PAL) {
                 if (rendering_enabled && odd_frame) ++dot;
                 odd_frame = !odd_frame;
@@ -740,21 +1064,280 @@ static void tick_ppu() {
     }
 
     switch (scanline) {
-    case 0 ... 239     : do_visible_line_ops();   break;
-    case 241           : do_line_241_ops();       break;
-    case PRERENDER_LINE: do_prerender_line_ops();
+    case 0 ... 239     : do_visible_line_ops<Hooks>();   break;
+    case 241           : do_line_241_ops();              break;
+    case PRERENDER_LINE: do_prerender_line_ops<Hooks>();
     }
 
     // Mapper-specific operations - usually to snoop on ppu_addr_bus
-    mapper_fns.ppu_tick_callback();
+    if (Hooks::snoops)
+        Hooks::ppu_tick();
 }
 
-void tick_ntsc_ppu() {
-    tick_ppu<false, 261>();
+template<bool IS_PAL, unsigned PRERENDER_LINE, class Hooks>
+static void run_dots(unsigned n) {
+    while (n > 0) {
+        // Line 240 and the VBlank lines have nothing to do besides the
+        // delayed v update and setting the VBlank flag at 241:1, so we can
+        // skip to the end of the line in one go. The line change is left
+        // to tick_ppu().
+        if (!Hooks::snoops && scanline >= 240 && scanline < PRERENDER_LINE &&
+            !(scanline == 241 && dot == 0) && pending_v_update == 0 &&
+            dot < 340) {
+
+            unsigned const n_idle = min(n, 340 - dot);
+            dot       += n_idle;
+            ppu_cycle += n_idle;
+            n         -= n_idle;
+        }
+        else {
+            tick_ppu<IS_PAL, PRERENDER_LINE, Hooks>();
+            --n;
+        }
+    }
+}
+
+THREAD_LOCAL void (*run_ppu_dots)(unsigned n);
+
+template<class Hooks>
+static void use_ppu_hooks() {
+    run_ppu_dots = is_pal ? run_dots<true, 311, Hooks> :
+                            run_dots<false, 261, Hooks>;
+#ifdef CATCH_UP_PPU
+    mapper_snoops_ppu = Hooks::snoops && !Hooks::a12_only;
+    mapper_counts_a12 = Hooks::a12_only;
+#endif
+}
+
+// Picks the version of the PPU loop for the mapper's PPU hooks
+static void select_ppu_loop() {
+    void (*const tick_callback)() = mapper_fns.ppu_tick_callback;
+    uint8_t (*const read_nt_fn)(uint16_t) = mapper_fns.read_nt;
+
+    if (tick_callback == nop_ppu_tick_callback && !read_nt_fn)
+        use_ppu_hooks<No_ppu_hooks>();
+    else if (tick_callback == mapper_4_ppu_tick_callback && !read_nt_fn)
+        use_ppu_hooks<A12_ppu_hooks<mapper_4_ppu_tick_callback> >();
+    else if (tick_callback == mapper_9_ppu_tick_callback && !read_nt_fn)
+        use_ppu_hooks<Snooping_ppu_hooks<mapper_9_ppu_tick_callback> >();
+    else if (tick_callback == mapper_10_ppu_tick_callback && !read_nt_fn)
+        use_ppu_hooks<Snooping_ppu_hooks<mapper_10_ppu_tick_callback> >();
+    else if (tick_callback == mapper_5_ppu_tick_callback &&
+             read_nt_fn == mapper_5_read_nt)
+        use_ppu_hooks<Nt_ppu_hooks<mapper_5_ppu_tick_callback, mapper_5_read_nt> >();
+    else
+        use_ppu_hooks<Generic_ppu_hooks>();
+}
+
+#ifdef CATCH_UP_PPU
+
+//
+// Catch-up mode (see ppu.h)
+//
+
+THREAD_LOCAL unsigned              ppu_dots_owed;
+
+// Returns a lower bound on the number of dots until the next time the PPU is
+// at 'line':'line_dot'. These are the dots that signal the CPU: the frame
+// completion at 240:0 and the VBlank flag (and NMI) at 241:1.
+static unsigned calc_dots_till(unsigned line, unsigned line_dot) {
+    unsigned const pos    = 341*scanline + dot;
+    unsigned const target = 341*line + line_dot;
+
+    if (pos < target)
+        return target - pos;
+    // The next frame. One less since the pre-render line might be one dot
+    // short.
+    return 341*(prerender_line + 1) - 1 - pos + target;
 }
 
-void tick_pal_ppu() {
-    tick_ppu<true, 311>();
+//
+// MMC3 A12 prediction
+//
+// MMC3 snoops on A12 of the PPU address bus to clock its scanline counter,
+// which can raise an IRQ. Rather than syncing the PPU each CPU cycle, we work
+// out the earliest dot at which the counter could be clocked and sync there.
+// The mapper still sees each dot when the PPU runs, so the counter behaves the
+// same as without catch-up mode.
+//
+// During rendering, the fetches come in groups of four dots that each put a
+// fixed A12 on the bus, given by the pattern table addresses in $2000. 8x16
+// sprites select the pattern table by tile index, so A12 isn't known for their
+// fetches. Outside rendering, the address bus mirrors v. Register writes that
+// affect any of this update the prediction (see a12_timing_changed()).
+//
+
+enum A12_state {
+    A12_LOW     = 1,
+    A12_HIGH    = 2,
+    A12_UNKNOWN = A12_LOW | A12_HIGH
+};
+
+// Returns the A12 state for fetch group 'g' (dots 4g+1 to 4g+4) of a
+// rendering line
+static A12_state fetch_group_a12(unsigned g) {
+    // NT and AT fetches, including the dummy ones, have A12 clear
+    if (!(g & 1) || g >= 84)
+        return A12_LOW;
+
+    // Sprite pattern fetches on dots 257-320
+    if (g >= 64 && g < 80) {
+        if (sprite_size == EIGHT_BY_SIXTEEN)
+            return A12_UNKNOWN;
+        return sprite_pat_addr ? A12_HIGH : A12_LOW;
+    }
+
+    // Background pattern fetches
+    return bg_pat_addr ? A12_HIGH : A12_LOW;
+}
+
+// Walks the dots ahead of the current one, looking for the first that could
+// clock the counter. That's a dot where A12 might be high, with A12 possibly
+// low on the mmc3_min_a12_rise_diff - 1 dots before it.
+struct A12_scan {
+    // Dots walked so far
+    unsigned dots;
+    // Last dot where A12 is known to be high, relative to the current dot
+    long     last_high;
+
+    // Walks 'n' dots with A12 in 'state'. Returns true, with 'dots' set to the
+    // dot, if one of them could clock the counter.
+    bool walk(unsigned n, A12_state state) {
+        if (n > 0 && state != A12_LOW) {
+            long const first_clock =
+              max((long)dots + 1, last_high + mmc3_min_a12_rise_diff);
+
+            // If A12 is known to be high, only the first dot can be a rise
+            if (first_clock <= (long)(dots + n) &&
+                (state == A12_UNKNOWN || first_clock == (long)dots + 1)) {
+                dots = first_clock;
+                return true;
+            }
+
+            if (state == A12_HIGH)
+                last_high = dots + n;
+        }
+        dots += n;
+        return false;
+    }
+
+    // Walks the rendering line dots after 'from'
+    bool walk_line(unsigned from) {
+        for (unsigned d = from + 1; d <= 340; d = 4*((d - 1)/4) + 5)
+            if (walk(4*((d - 1)/4) + 5 - d, fetch_group_a12((d - 1)/4)))
+                return true;
+        return false;
+    }
+};
+
+// Returns a lower bound on the number of dots until MMC3 could clock its
+// scanline counter, or UINT_MAX if that can't happen before the next sync
+static unsigned calc_dots_till_a12_clock() {
+    // Outside rendering, the address bus mirrors v. It changes when a $2006
+    // write is copied over to v, and at 240:0, which is synced at anyway.
+    if ((!rendering_enabled || (scanline >= 240 && scanline < prerender_line)) &&
+        pending_v_update > 0)
+        return pending_v_update;
+
+    // A12 raised outside of the dots (by a $2007 access) is seen by the
+    // mapper on the next dot
+    if ((ppu_addr_bus & 0x1000) && !mapper_saw_a12)
+        return 1;
+
+    if (!rendering_enabled)
+        return UINT_MAX;
+
+    // Dots before the current one are assumed to have had A12 low, which
+    // keeps the result a lower bound. If A12 is high now, the mapper has
+    // already seen it (see above).
+    A12_scan scan = { 0, (ppu_addr_bus & 0x1000) ? 0 : LONG_MIN/2 };
+    A12_state const bus_a12 = (ppu_addr_bus & 0x1000) ? A12_HIGH : A12_LOW;
+
+    unsigned line = scanline;
+    unsigned from = dot;
+    if (line >= 240 && line < prerender_line) {
+        // The bus stays the same up to and including dot 0 of the pre-render
+        // line
+        scan.walk(341*(prerender_line - line) - dot, bus_a12);
+        line = prerender_line;
+        from = 0;
+    }
+
+    // The rest of this line and all of the next. After that, the lines repeat
+    // the same pattern until line 240.
+    for (unsigned i = 0; i < 2; ++i) {
+        if (scan.walk_line(from))
+            return scan.dots;
+
+        if (line == 239)
+            // The bus is set to v at 240:0
+            return scan.dots + 1;
+
+        // Dot 0 keeps A12 low from the dummy NT fetches. It's skipped on line
+        // 0 in odd NTSC frames, so leave it out there. That doesn't change
+        // which rises count, as A12 only changes every four dots.
+        line = (line == prerender_line) ? 0 : line + 1;
+        if (line != 0)
+            scan.walk(1, A12_LOW);
+        from = 0;
+    }
+
+    return UINT_MAX;
+}
+
+// Schedules 'event' for when the owed dots reach 'dots', or cancels it if
+// 'dots' is UINT_MAX
+static void schedule_ppu_sync_at(Event event, unsigned dots) {
+    if (dots == UINT_MAX)
+        cancel_event(event);
+    else
+        schedule_event(event, cpu_cycle + cycles_till_ppu_dots(
+          dots > ppu_dots_owed ? dots - ppu_dots_owed : 0));
+}
+
+static void schedule_mapper_sync() {
+    schedule_ppu_sync_at(EVENT_MAPPER_SYNC,
+      mapper_snoops_ppu ? 0 :
+      mapper_counts_a12 ? calc_dots_till_a12_clock() : UINT_MAX);
+}
+
+// Posts the next dots that signal the CPU
+static void schedule_ppu_sync() {
+    schedule_ppu_sync_at(EVENT_PPU_FRAME_END, calc_dots_till(240, 0));
+    schedule_ppu_sync_at(EVENT_PPU_VBLANK,    calc_dots_till(241, 1));
+    schedule_mapper_sync();
+}
+
+void sync_ppu() {
+    if (ppu_dots_owed > 0) {
+        unsigned const n = ppu_dots_owed;
+        // Cleared up front, as mapper callbacks might switch CHR banks and
+        // sync recursively
+        ppu_dots_owed = 0;
+        run_ppu_dots(n);
+        mapper_saw_a12 = ppu_addr_bus & 0x1000;
+    }
+    schedule_ppu_sync();
+}
+
+// Used when the position in the frame is changed from the outside, with any
+// owed dots being irrelevant
+static void restart_catch_up() {
+    ppu_dots_owed = 0;
+    // The mapper state goes along with the bus
+    mapper_saw_a12 = ppu_addr_bus & 0x1000;
+    schedule_ppu_sync();
+}
+
+#endif
+
+// Called after register accesses that could move the next A12 rise, once the
+// PPU has been synced
+static void a12_timing_changed() {
+#ifdef CATCH_UP_PPU
+    if (mapper_counts_a12)
+        schedule_mapper_sync();
+#endif
 }
 
 static void do_2007_post_access_bump() {
@@ -820,7 +1403,13 @@ static void write_vram(uint8_t val) {
     switch (v & 0x3FFF) {
 
     // Pattern tables
-    case 0x0000 ... 0x1FFF: if (chr_is_ram) chr_ref(v) = val; break;
+    case 0x0000 ... 0x1FFF:
+        if (chr_is_ram) {
+            uint8_t &byte = chr_ref(v);
+            byte = val;
+            mark_page_dirty(DIRTY_CHR_RAM, &byte - chr_base);
+        }
+        break;
     // Nametables
     case 0x2000 ... 0x3EFF: write_nt(v, val); break;
     // Palettes
@@ -845,6 +1434,9 @@ static void write_vram(uint8_t val) {
 }
 
 uint8_t read_ppu_reg(unsigned n) {
+    sync_ppu();
+    cut_compositor_short();
+
     switch (n) {
 
     // Write-only registers
@@ -893,6 +1485,7 @@ uint8_t read_ppu_reg(unsigned n) {
         {
         uint8_t const res = read_vram();
         do_2007_post_access_bump();
+        a12_timing_changed();
         return res;
         }
 
@@ -905,6 +1498,7 @@ void write_oam_data_reg(uint8_t val) {
     // rendering do perform a glitchy oam_addr increment however, but that
     // might be hard to pin down (could depend on current sprite evaluation
     // status for example) and not worth emulating.
+    sync_ppu();
     if (rendering_enabled && (scanline < 240 || scanline == prerender_line))
         return;
     oam[oam_addr++] = val;
@@ -919,6 +1513,9 @@ static void set_derived_ppumask_vars() {
 }
 
 void write_ppu_reg(uint8_t val, unsigned n) {
+    sync_ppu();
+    cut_compositor_short();
+
     ppu_open_bus = val;
     open_bus_refreshed();
 
@@ -938,6 +1535,7 @@ void write_ppu_reg(uint8_t val, unsigned n) {
         sprite_pat_addr = (val & 0x08) << 9; // val & 0x08 ? 0x1000 : 0x0000
         bg_pat_addr     = (val & 0x10) << 8; // val & 0x10 ? 0x1000 : 0x0000
         sprite_size     = val & 0x20 ? EIGHT_BY_SIXTEEN : EIGHT_BY_EIGHT;
+        a12_timing_changed();
 
         bool const new_nmi_on_vblank = val & 0x80;
         if (new_nmi_on_vblank) {
@@ -973,6 +1571,7 @@ void write_ppu_reg(uint8_t val, unsigned n) {
         tint_bits            = (val >> 5) & 7;
 
         set_derived_ppumask_vars();
+        a12_timing_changed();
 
         break;
 
@@ -1025,6 +1624,7 @@ void write_ppu_reg(uint8_t val, unsigned n) {
             t = (t & 0x7F00) | val;
             // There is a delay of ~3 ticks before t is copied to v
             pending_v_update = 3;
+            a12_timing_changed();
         }
 
         write_flip_flop = !write_flip_flop;
@@ -1034,6 +1634,7 @@ void write_ppu_reg(uint8_t val, unsigned n) {
     case 7:
         write_vram(val);
         do_2007_post_access_bump();
+        a12_timing_changed();
         break;
 
     default: UNREACHABLE
@@ -1101,6 +1702,8 @@ void set_ppu_cold_boot_state() {
     s0_on_next_scanline = s0_on_cur_scanline = false;
     ppu_addr_bus        = 0;
     dot                 = scanline = ppu_cycle = 0;
+    composed_till_cycle = early_s0_hit_cycle = 0;
+    skipping_frame      = false;
 
     // Open bus
 
@@ -1122,9 +1725,17 @@ void set_ppu_cold_boot_state() {
     init_array(sprite_x      , (uint8_t)0);
     init_array(sprite_pat_l  , (uint8_t)0);
     init_array(sprite_pat_h  , (uint8_t)0);
+    sprite_line_dirty = true;
+
+#ifdef CATCH_UP_PPU
+    restart_catch_up();
+#endif
 }
 
 void reset_ppu() {
+    // Run the dots leading up to the reset
+    sync_ppu();
+
     // Loopy regs
     fine_x = t = 0;
 
@@ -1140,14 +1751,25 @@ void reset_ppu() {
 
     sprite_y = sprite_index = 0;
     sprite_in_range = false;
+
+#ifdef CATCH_UP_PPU
+    restart_catch_up();
+#endif
 }
 
 // State transfers
 
 template<bool calculating_size, bool is_save>
 void transfer_ppu_state(uint8_t *&buf) {
-    if (chr_is_ram) TRANSFER_P(chr_base, chr_8k_banks*0x2000);
-    TRANSFER_P(ciram, mirroring == FOUR_SCREEN ? 0x1000 : 0x800);
+    // Owed dots and pixels output ahead of time are not part of the state.
+    // Catch up and cut the compositor short before saving.
+    if (!calculating_size && is_save) {
+        sync_ppu();
+        cut_compositor_short();
+    }
+
+    if (chr_is_ram) TRANSFER_PAGES(chr_base, chr_8k_banks*0x2000, DIRTY_CHR_RAM)
+    TRANSFER_PAGES(ciram, mirroring == FOUR_SCREEN ? 0x1000 : 0x800, DIRTY_CIRAM)
     TRANSFER(palettes)
     TRANSFER(oam) TRANSFER(sec_oam)
     TRANSFER(t) TRANSFER(v) TRANSFER(fine_x)
@@ -1206,6 +1828,19 @@ void transfer_ppu_state(uint8_t *&buf) {
 
     TRANSFER(ppu_open_bus)
     TRANSFER(bit_7_6_wcycle) TRANSFER(bit_5_wcycle) TRANSFER(bit_4_0_wcycle)
+
+    if (!calculating_size && !is_save) {
+        composed_till_cycle = early_s0_hit_cycle = 0;
+        sprite_line_dirty = true;
+        // The frame buffer isn't part of the state, so the rest of the frame
+        // might end up displayed no matter what was decided at its start
+        skipping_frame = false;
+    }
+
+#ifdef CATCH_UP_PPU
+    if (!calculating_size && !is_save)
+        restart_catch_up();
+#endif
 }
 
 // Explicit instantiations
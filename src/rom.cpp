@@ -2,6 +2,7 @@
 
 #include "apu.h"
 #include "audio.h"
+#include "input_movie.h"
 #include "mapper.h"
 #ifdef RECORD_MOVIE
 #  include "movie.h"
@@ -10,31 +11,43 @@
 #include "ppu.h"
 #include "rom.h"
 #include "save_states.h"
+#include "state_hash.h"
 #include "timing.h"
 
-uint8_t *prg_base;
-unsigned prg_16k_banks;
+THREAD_LOCAL uint8_t *prg_base;
+THREAD_LOCAL unsigned prg_16k_banks;
 
-uint8_t *chr_base;
-unsigned chr_8k_banks;
-bool chr_is_ram;
+THREAD_LOCAL uint8_t *chr_base;
+THREAD_LOCAL unsigned chr_8k_banks;
+THREAD_LOCAL bool chr_is_ram;
 
-uint8_t *wram_base;
-unsigned wram_8k_banks;
+THREAD_LOCAL uint8_t *wram_base;
+THREAD_LOCAL unsigned wram_8k_banks;
 
-bool is_pal;
+THREAD_LOCAL bool is_pal;
 
-bool has_battery;
-bool has_trainer;
+THREAD_LOCAL bool has_battery;
+THREAD_LOCAL bool has_trainer;
 
-bool is_vs_unisystem;
-bool is_playchoice_10;
+THREAD_LOCAL bool is_vs_unisystem;
+THREAD_LOCAL bool is_playchoice_10;
 
-bool has_bus_conflicts;
+THREAD_LOCAL bool has_bus_conflicts;
 
-Mapper_fns mapper_fns;
+THREAD_LOCAL Mapper_fns mapper_fns;
 
-static uint8_t *rom_buf;
+THREAD_LOCAL char *rom_filename;
+THREAD_LOCAL unsigned mapper_nr;
+THREAD_LOCAL uint8_t prg_md5[16];
+
+static THREAD_LOCAL uint8_t *rom_buf;
+static THREAD_LOCAL size_t rom_buf_size;
+// Number of consoles sharing rom_buf (see Rom_ref). Shared between threads.
+static THREAD_LOCAL unsigned *rom_buf_refs;
+
+// Mirroring from the header, after ROM-specific overrides. Restored by
+// reset_cart().
+static THREAD_LOCAL Mirroring rom_mirroring;
 
 char const *const mirroring_to_str[N_MIRRORING_MODES] =
   { "horizontal",
@@ -45,11 +58,103 @@ char const *const mirroring_to_str[N_MIRRORING_MODES] =
 
 static void do_rom_specific_overrides();
 
+static size_t ciram_size() {
+    return rom_mirroring == FOUR_SCREEN ? 0x1000 : 0x800;
+}
+
+// Sets up the console for the ROM image in rom_buf
+static void set_up_rom(char const *filename, bool print_info);
+
+static bool is_nes_2_0_header(uint8_t const *header) {
+    return (header[7] & 0x0C) == 0x08;
+}
+
+// Assume we're dealing with a corrupted header (e.g. one containing
+// "DiskDude!" in bytes 7-15) if the ROM is not in NES 2.0 format and bytes
+// 12-15 are not all zero. Byte 7 is ignored then.
+static bool header_looks_corrupted(uint8_t const *header) {
+    return !is_nes_2_0_header(header) && !MEM_EQ(header + 12, "\0\0\0\0");
+}
+
+static unsigned header_mapper(uint8_t const *header) {
+    return (header[6] >> 4) |
+           (header_looks_corrupted(header) ? 0 : header[7] & 0xF0);
+}
+
+// Checks if the 'size'-byte ROM image 'buf' can be loaded. Returns an error
+// message, or null if it can.
+static char const *check_rom(uint8_t const *buf, size_t size) {
+    // For messages with details
+    static THREAD_LOCAL char msg[64];
+
+    if (size < 16 || !MEM_EQ(buf, "NES\x1A"))
+        return "not an iNES file";
+
+    unsigned const prg_16k = buf[4];
+    unsigned const chr_8k  = buf[5];
+    if (prg_16k == 0) // TODO: This makes sense for NES 2.0
+        return "the header specifies zero banks of PRG ROM";
+    if (!is_pow_2_or_0(prg_16k) || !is_pow_2_or_0(chr_8k))
+        return "non-power-of-two PRG and CHR sizes are not supported yet";
+    if (size < 16 + 512*!!(buf[6] & 4) + 0x4000*prg_16k + 0x2000*chr_8k)
+        return "too short to hold the PRG and CHR ROM specified in the header";
+
+    if (is_nes_2_0_header(buf))
+        return "NES 2.0 not yet supported";
+    unsigned const mapper = header_mapper(buf);
+    if (!mapper_fns_table[mapper].init) {
+        snprintf(msg, sizeof msg, "mapper %u not supported", mapper);
+        return msg;
+    }
+
+    return 0;
+}
+
 void load_rom(char const *filename, bool print_info) {
+    size_t size;
+    uint8_t *buf = get_file_buffer(filename, size);
+    char const *const error = load_rom(filename, buf, size, print_info);
+    if (error) {
+        free_array_set_null(buf);
+        fail("failed to load '%s': %s", filename, error);
+    }
+}
+
+char const *load_rom(char const *filename, uint8_t *buf, size_t size,
+                     bool print_info) {
+    char const *const error = check_rom(buf, size);
+    if (error)
+        return error;
+
+    rom_buf      = buf;
+    rom_buf_size = size;
+    fail_if(!(rom_buf_refs = new (std::nothrow) unsigned(1)),
+            "failed to allocate reference count for ROM image");
+    set_up_rom(filename, print_info);
+
+    return 0;
+}
+
+Rom_ref ref_rom() {
+    __sync_fetch_and_add(rom_buf_refs, 1);
+    Rom_ref const ref = { rom_buf, rom_buf_size, rom_buf_refs, rom_filename };
+    return ref;
+}
+
+void load_rom(Rom_ref const &ref, bool print_info) {
+    rom_buf      = ref.buf;
+    rom_buf_size = ref.size;
+    rom_buf_refs = ref.refs;
+    set_up_rom(ref.filename, print_info);
+}
+
+// The image has passed check_rom()
+static void set_up_rom(char const *filename, bool print_info) {
     #define PRINT_INFO(...) do { if (print_info) printf(__VA_ARGS__); } while(0)
 
-    size_t rom_buf_size;
-    rom_buf = get_file_buffer(filename, rom_buf_size);
+    fail_if(!(rom_filename = new (std::nothrow) char[strlen(filename) + 1]),
+            "failed to allocate memory for the filename '%s'", filename);
+    strcpy(rom_filename, filename);
 
     //
     // Parse header
@@ -58,44 +163,19 @@ void load_rom(char const *filename, bool print_info) {
     is_pal = strstr(filename, "(E)") || strstr(filename, "PAL");
     PRINT_INFO("guessing %s based on filename\n", is_pal ? "PAL" : "NTSC");
 
-    fail_if(rom_buf_size < 16,
-            "'%s' is too short to be a valid iNES file (is %zu bytes - not even enough to hold the 16-byte "
-            "header)", filename, rom_buf_size);
-
-    fail_if(!MEM_EQ(rom_buf, "NES\x1A"),
-            "'%s' does not start with the expected byte sequence 'N', 'E', 'S', 0x1A", filename);
-
     prg_16k_banks = rom_buf[4];
     chr_8k_banks  = rom_buf[5];
     PRINT_INFO("PRG ROM size: %u KB\nCHR ROM size: %u KB\n", 16*prg_16k_banks, 8*chr_8k_banks);
 
-    fail_if(prg_16k_banks == 0, // TODO: This makes sense for NES 2.0
-            "the iNES header specifies zero banks of PRG ROM (program storage), which makes no sense");
-    fail_if(!is_pow_2_or_0(prg_16k_banks) || !is_pow_2_or_0(chr_8k_banks),
-            "non-power-of-two PRG and CHR sizes are not supported yet");
+    unsigned const mapper = header_mapper(rom_buf);
 
-    size_t const min_size = 16 + 512*has_trainer + 0x4000*prg_16k_banks + 0x2000*chr_8k_banks;
-    fail_if(rom_buf_size < min_size,
-            "'%s' is too short to hold the specified amount of PRG (program data) and CHR (graphics data) "
-            "ROM - is %zu bytes, expected at least %zu bytes (16 (header) + %s%u*16384 (PRG) + %u*8192 (CHR))",
-            filename, rom_buf_size, min_size, has_trainer ? "512 (trainer) + " : "", prg_16k_banks, chr_8k_banks);
-
-    unsigned mapper;
-
-    // Possibly updated with the high nibble below
-    mapper = rom_buf[6] >> 4;
-
-    bool const is_nes_2_0 = (rom_buf[7] & 0x0C) == 0x08;
+    bool const is_nes_2_0 = is_nes_2_0_header(rom_buf);
     PRINT_INFO(is_nes_2_0 ? "in NES 2.0 format\n" : "in iNES format\n");
-    // Assume we're dealing with a corrupted header (e.g. one containing
-    // "DiskDude!" in bytes 7-15) if the ROM is not in NES 2.0 format and bytes
-    // 12-15 are not all zero
-    if (!is_nes_2_0 && !MEM_EQ(rom_buf + 12, "\0\0\0\0"))
+    if (header_looks_corrupted(rom_buf))
         PRINT_INFO("header looks corrupted (bytes 12-15 not all zero) - ignoring byte 7\n");
     else {
         is_vs_unisystem  = rom_buf[7] & 1;
         is_playchoice_10 = rom_buf[7] & 2;
-        mapper |= (rom_buf[7] & 0xF0);
     }
 
     PRINT_INFO("mapper: %u\n", mapper);
@@ -123,11 +203,12 @@ void load_rom(char const *filename, bool print_info) {
 
     // Needs to come after a possible override
     prerender_line = is_pal ? 311 : 261;
+    rom_mirroring = mirroring;
 
     PRINT_INFO("mirroring: %s\n", mirroring_to_str[mirroring]);
 
-    fail_if(!(ciram = alloc_array_init<uint8_t>(mirroring == FOUR_SCREEN ? 0x1000 : 0x800, 0xFF)),
-            "failed to allocate %u bytes of nametable memory", mirroring == FOUR_SCREEN ? 0x1000 : 0x800);
+    fail_if(!(ciram = alloc_array_init<uint8_t>(ciram_size(), 0xFF)),
+            "failed to allocate %zu bytes of nametable memory", ciram_size());
 
     if (mirroring == FOUR_SCREEN || mapper == 7)
         // Assume no WRAM when four-screen, per
@@ -153,10 +234,7 @@ void load_rom(char const *filename, bool print_info) {
 
     #undef PRINT_INFO
 
-    fail_if(is_nes_2_0, "NES 2.0 not yet supported");
-
-    fail_if(!mapper_fns_table[mapper].init, "mapper %u not supported\n", mapper);
-
+    mapper_nr = mapper;
     mapper_fns = mapper_fns_table[mapper];
     mapper_fns.init();
 
@@ -168,17 +246,41 @@ void load_rom(char const *filename, bool print_info) {
     init_audio_for_rom();
     init_ppu_for_rom();
     init_save_states_for_rom();
+    init_input_movie_for_rom();
+    init_state_hash_for_rom();
+    // Needs the dirty-page bitmaps from init_save_states_for_rom()
+    init_cpu_mem_map();
 #ifdef RECORD_MOVIE
     // Needs to know whether PAL or NTSC, so can't be done in main()
     init_movie();
 #endif
 }
 
+void reset_cart() {
+    mirroring = rom_mirroring;
+
+    memset(ciram, 0xFF, ciram_size());
+    if (wram_base)
+        memset(wram_6000_page = wram_base, 0xFF, 0x2000*wram_8k_banks);
+    if (chr_is_ram)
+        memset(chr_base, 0xFF, 0x2000*chr_8k_banks);
+
+    mapper_fns.init();
+    init_cpu_mem_map();
+}
+
 void unload_rom() {
     // Flush any pending audio samples
+    sync_apu();
     end_audio_frame();
 
-    free_array_set_null(rom_buf);
+    if (__sync_sub_and_fetch(rom_buf_refs, 1) == 0) {
+        free_array_set_null(rom_buf);
+        delete rom_buf_refs;
+    }
+    rom_buf = 0;
+    rom_buf_refs = 0;
+    free_array_set_null(rom_filename);
     free_array_set_null(ciram);
     if (chr_is_ram)
         free_array_set_null(chr_base);
@@ -213,12 +315,12 @@ static void set_pal() {
 }
 
 static void do_rom_specific_overrides() {
-    static MD5_CTX md5_ctx;
-    static unsigned char md5[16];
+    static THREAD_LOCAL MD5_CTX md5_ctx;
+    uint8_t const *const md5 = prg_md5;
 
     MD5_Init(&md5_ctx);
     MD5_Update(&md5_ctx, (void*)prg_base, 16*1024*prg_16k_banks);
-    MD5_Final(md5, &md5_ctx);
+    MD5_Final(prg_md5, &md5_ctx);
 
 #if 0
     for (unsigned i = 0; i < 16; ++i)
@@ -236,3 +338,27 @@ static void do_rom_specific_overrides() {
         // Rad Racer 2
         correct_mirroring(FOUR_SCREEN);
 }
+
+template<bool calculating_size, bool is_save>
+void transfer_rom_context(uint8_t *&buf) {
+    TRANSFER(rom_buf) TRANSFER(rom_buf_size) TRANSFER(rom_buf_refs)
+    TRANSFER(rom_filename) TRANSFER(mapper_nr) TRANSFER(prg_md5)
+    TRANSFER(prg_base) TRANSFER(prg_16k_banks)
+    TRANSFER(chr_base) TRANSFER(chr_8k_banks) TRANSFER(chr_is_ram)
+    TRANSFER(wram_base) TRANSFER(wram_8k_banks)
+    TRANSFER(ciram) TRANSFER(rom_mirroring)
+    TRANSFER(is_pal)
+    TRANSFER(has_battery) TRANSFER(has_trainer)
+    TRANSFER(is_vs_unisystem) TRANSFER(is_playchoice_10)
+    TRANSFER(has_bus_conflicts)
+    TRANSFER(mapper_fns)
+}
+
+// Explicit instantiations
+
+// Calculating context size
+template void transfer_rom_context<true, false>(uint8_t*&);
+// Saving context to buffer
+template void transfer_rom_context<false, true>(uint8_t*&);
+// Loading context from buffer
+template void transfer_rom_context<false, false>(uint8_t*&);
@@ -5,49 +5,128 @@
 #include "controller.h"
 #include "cpu.h"
 #include "input.h"
+#include "lz.h"
 #include "ppu.h"
 #include "mapper.h"
 #include "rom.h"
 #include "save_states.h"
 #include "timing.h"
 
-// Buffer for a single plain old save state. Not related to rewinding.
-static uint8_t *state;
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Buffer for plain old save states, which go through it on the way to and
+// from files. Not related to rewinding.
+static THREAD_LOCAL uint8_t *state;
+// Snapshot ID of 'state', or 0 if it doesn't hold a snapshot
+static THREAD_LOCAL uint64_t state_id;
 // Total state size. Varies depending on the mapper.
-static size_t state_size;
-// For the plain old save state
-static bool has_save;
+static THREAD_LOCAL size_t state_size;
+
+// The subsystems, in the order transfer_system_state() transfers them. Each
+// gets a chunk in save state files.
+enum Subsystem {
+    SS_APU,
+    SS_CPU,
+    SS_PPU,
+    SS_CONTROLLER,
+    SS_INPUT,
+    SS_MAPPER,
+    N_SUBSYSTEMS
+};
+
+static char const subsystem_tags[N_SUBSYSTEMS][4] =
+  { { 'A', 'P', 'U', ' ' },
+    { 'C', 'P', 'U', ' ' },
+    { 'P', 'P', 'U', ' ' },
+    { 'C', 'T', 'R', 'L' },
+    { 'I', 'N', 'P', 'T' },
+    { 'M', 'A', 'P', 'R' } };
+
+// Offset of the end of each subsystem's state within the state. Set when
+// calculating the state size.
+static THREAD_LOCAL size_t subsystem_end[N_SUBSYSTEMS];
 
 #ifdef INCLUDE_REWIND
 
-// Number of seconds of rewind to support. The rewind buffer is a ring buffer
-// where a new state will overwrite the oldest state when the buffer is full.
-unsigned const rewind_seconds = 10;
-
-static uint8_t *rewind_buf;
+// Only the most recently pushed state (the top state) is kept in full. For the
+// states before it, the rewind buffer holds deltas: the XOR of each state with
+// the state before it, run-length encoded. Since XOR is its own inverse, the
+// previous state is recovered by applying the top state's delta to it, and so
+// on back in time. Most of the state stays the same between frames, so the
+// deltas are usually a small fraction of the state size.
+//
+// The deltas go into a ring buffer of bytes. The oldest states are dropped
+// when it fills up, or once the rewind depth is reached.
+
+// Maximum rewind depth
+unsigned const rewind_seconds = 5*60;
+// Size of the ring buffer with the deltas
+size_t const rewind_buf_size = 32*1024*1024;
+
+static THREAD_LOCAL uint8_t *rewind_buf;
+// Offset in rewind_buf where the next delta goes
+static THREAD_LOCAL size_t rewind_buf_head;
+
+// The top state, plus a buffer for the new state in push_state(), with their
+// snapshot IDs
+static THREAD_LOCAL uint8_t *top_state;
+static THREAD_LOCAL uint8_t *new_state;
+static THREAD_LOCAL uint64_t top_state_id;
+static THREAD_LOCAL uint64_t new_state_id;
+// Holds the delta being encoded. Large enough for the worst case.
+static THREAD_LOCAL uint8_t *delta_buf;
+
+// Per-frame data, in ring buffers indexed by rewind_buf_i (the top state) and
+// the frames before it.
+//
 // frame_len[n] is the length of frame n in CPU ticks, which is used to cleanly
 // reverse audio. The length varies since we always process finished frames at
 // instruction boundaries to simplify things, and since actual frames vary in
-// length by +-1 PPU tick on NTSC. It would also be possible to store the
-// length directly in the rewind buffer together with the frame's data.
-static unsigned *frame_len;
-static unsigned rewind_buf_i;
-static unsigned n_rewind_frames;
-static unsigned n_recorded_frames;
+// length by +-1 PPU tick on NTSC.
+static THREAD_LOCAL unsigned *frame_len;
+// delta_pos[n] is the offset in rewind_buf of the delta that takes state n
+// back to state n - 1. Unused for the oldest state.
+static THREAD_LOCAL size_t   *delta_pos;
+static THREAD_LOCAL unsigned rewind_buf_i;
+static THREAD_LOCAL unsigned n_rewind_frames;
+static THREAD_LOCAL unsigned n_recorded_frames;
 
-bool is_backwards_frame;
+THREAD_LOCAL bool is_backwards_frame;
 
 #endif
 
+THREAD_LOCAL Dirty_pages dirty_pages[N_DIRTY_REGIONS];
+
+// ID of the most recent snapshot. IDs start from 1.
+static THREAD_LOCAL uint64_t last_snapshot_id;
+
+// Set during save_snapshot() and load_snapshot(). transfer_pages() copies
+// whole regions otherwise.
+static THREAD_LOCAL bool in_snapshot_transfer;
+// ID of the snapshot in the buffer being transferred to/from, or 0 if unknown
+static THREAD_LOCAL uint64_t transfer_buf_id;
+// Start of the state being transferred. Used to find the offsets of the
+// regions.
+static THREAD_LOCAL uint8_t *transfer_start;
+
 template<bool calculating_size, bool is_save>
-static size_t transfer_system_state(uint8_t *buf) {
-    uint8_t *tmp = buf;
+size_t transfer_system_state(uint8_t *buf) {
+    uint8_t *tmp = transfer_start = buf;
+
+    #define END_SUBSYSTEM(ss) if (calculating_size) subsystem_end[ss] = buf - tmp;
 
     transfer_apu_state<calculating_size, is_save>(buf);
+    END_SUBSYSTEM(SS_APU)
     transfer_cpu_state<calculating_size, is_save>(buf);
+    END_SUBSYSTEM(SS_CPU)
     transfer_ppu_state<calculating_size, is_save>(buf);
+    END_SUBSYSTEM(SS_PPU)
     transfer_controller_state<calculating_size, is_save>(buf);
+    END_SUBSYSTEM(SS_CONTROLLER)
     transfer_input_state<calculating_size, is_save>(buf);
+    END_SUBSYSTEM(SS_INPUT)
 
     if (calculating_size)
         mapper_fns.state_size(buf);
@@ -57,29 +136,352 @@ static size_t transfer_system_state(uint8_t *buf) {
         else
             mapper_fns.load_state(buf);
     }
+    END_SUBSYSTEM(SS_MAPPER)
+
+    #undef END_SUBSYSTEM
 
     // Return size of state in bytes
     return buf - tmp;
 }
 
 //
-// Save states
+// Dirty-page tracking
+//
+
+static bool page_is_dirty(Dirty_pages const &d, size_t page) {
+    return d.bits[page/64] & (UINT64_C(1) << (page%64));
+}
+
+static void mark_region_dirty(Dirty_pages &d) {
+    for (size_t i = 0; i < d.n_pages; ++i)
+        d.bits[i/64] |= UINT64_C(1) << (i%64);
+}
+
+void mark_all_pages_dirty() {
+    for (unsigned r = 0; r < N_DIRTY_REGIONS; ++r)
+        mark_region_dirty(dirty_pages[r]);
+}
+
+// Zero page and the stack ($0000-$01FF) aren't tracked
+static void mark_untracked_pages_dirty() {
+    dirty_pages[DIRTY_RAM].bits[0] |= 3;
+}
+
+uint64_t const *get_dirty_pages(Dirty_region region, size_t &n_pages) {
+    mark_untracked_pages_dirty();
+    n_pages = dirty_pages[region].n_pages;
+    return dirty_pages[region].bits;
+}
+
+// True if page 'page' of 'd' needs to be copied to update the buffer (when
+// saving) or memory (when loading)
+template<bool is_save>
+static bool page_needs_copy(Dirty_pages const &d, size_t page) {
+    return d.last_dirty[page] > transfer_buf_id ||
+           (!is_save && page_is_dirty(d, page));
+}
+
+template<bool calculating_size, bool is_save>
+void transfer_pages(uint8_t *mem, size_t len, Dirty_region region, uint8_t *&buf) {
+    if (calculating_size)
+        dirty_pages[region].state_offset = buf - transfer_start;
+
+    if (calculating_size || !in_snapshot_transfer || transfer_buf_id == 0) {
+        TRANSFER_P(mem, len)
+        if (!calculating_size && !is_save && in_snapshot_transfer)
+            // We don't know what was there before
+            mark_region_dirty(dirty_pages[region]);
+        return;
+    }
+
+    Dirty_pages &d = dirty_pages[region];
+    assert(d.n_pages*dirty_page_size == len);
+
+    // When saving, pages dirty since the last snapshot have already been
+    // folded into last_dirty by save_snapshot()
+    for (size_t i = 0; i < d.n_pages;) {
+        if (!page_needs_copy<is_save>(d, i)) {
+            ++i;
+            continue;
+        }
+
+        // Copy runs of pages with a single memcpy()
+        size_t end = i + 1;
+        while (end < d.n_pages && page_needs_copy<is_save>(d, end))
+            ++end;
+
+        size_t const offset = dirty_page_size*i;
+        size_t const run_len = dirty_page_size*(end - i);
+        if (is_save)
+            memcpy(buf + offset, mem + offset, run_len);
+        else {
+            memcpy(mem + offset, buf + offset, run_len);
+            // The pages now differ from what later snapshots have
+            for (; i < end; ++i)
+                mark_page_dirty(region, dirty_page_size*i);
+        }
+        i = end;
+    }
+
+    buf += len;
+}
+
+uint64_t save_snapshot(uint8_t *buf, uint64_t buf_id) {
+    ++last_snapshot_id;
+
+    mark_untracked_pages_dirty();
+
+    // Record which pages were dirty in this snapshot and start over
+    for (unsigned r = 0; r < N_DIRTY_REGIONS; ++r) {
+        Dirty_pages &d = dirty_pages[r];
+        for (size_t w = 0; w < (d.n_pages + 63)/64; ++w) {
+            for (uint64_t bits = d.bits[w]; bits; bits &= bits - 1)
+                d.last_dirty[64*w + __builtin_ctzll(bits)] = last_snapshot_id;
+            d.bits[w] = 0;
+        }
+    }
+
+    in_snapshot_transfer = true;
+    transfer_buf_id = buf_id;
+    transfer_system_state<false, true>(buf);
+    in_snapshot_transfer = false;
+
+    return last_snapshot_id;
+}
+
+void load_snapshot(uint8_t *buf, uint64_t buf_id) {
+    mark_untracked_pages_dirty();
+
+    in_snapshot_transfer = true;
+    transfer_buf_id = buf_id;
+    transfer_system_state<false, false>(buf);
+    in_snapshot_transfer = false;
+}
+
+static void init_dirty_pages(Dirty_region region, size_t len) {
+    Dirty_pages &d = dirty_pages[region];
+    d.n_pages = len >> dirty_page_shift;
+    // Regions are at most a few hundred pages. The + 1s avoid empty arrays.
+    unsigned const n_pages = d.n_pages;
+    fail_if(!(d.bits = alloc_array_init<uint64_t>(n_pages/64 + 1, 0)) ||
+            !(d.last_dirty = alloc_array_init<uint64_t>(n_pages + 1, 0)),
+      "failed to allocate dirty-page tracking data for %u pages", n_pages);
+}
+
+//
+// Save state files
+//
+// All integers are little-endian.
+//
+//   Header:
+//     "NESSTATE"      Magic
+//     <u32>           Format version (state_file_version)
+//     <u32>           Mapper number
+//     <16 bytes>      MD5 digest of the PRG ROM
+//     <u32>           Number of chunks
 //
+//   Chunk, one per subsystem:
+//     <4 bytes>       Tag (see subsystem_tags)
+//     <u32>           Size of the subsystem's state
+//     <u32>           Size of the data that follows. If it differs from the
+//                     size of the state, the data is compressed (see lz.h).
+//     <data>
+//
+// Files are loaded by mapping them into memory and decompressing each chunk
+// straight into the state buffer.
+
+static char const state_file_magic[8] =
+  { 'N', 'E', 'S', 'S', 'T', 'A', 'T', 'E' };
+
+// Needs to be bumped whenever the layout of a subsystem's state changes, as
+// states are loaded with a plain copy
+uint32_t const state_file_version = 1;
+
+// Set to false to store chunks uncompressed
+bool const compress_state_files = true;
+
+size_t const state_file_header_size = 8 + 4 + 4 + 16 + 4;
+size_t const chunk_header_size = 4 + 4 + 4;
+
+static size_t subsystem_start(unsigned ss) {
+    return ss == 0 ? 0 : subsystem_end[ss - 1];
+}
+
+uint8_t *save_state_to_buf(size_t &size) {
+    // The state buffer usually holds the previous save, so only changed
+    // memory pages need to be copied
+    state_id = save_snapshot(state, state_id);
+
+    size_t max_file_size = state_file_header_size;
+    for (unsigned ss = 0; ss < N_SUBSYSTEMS; ++ss)
+        max_file_size += chunk_header_size +
+          lz_max_compressed_size(subsystem_end[ss] - subsystem_start(ss));
+
+    uint8_t *const file_buf = new (std::nothrow) uint8_t[max_file_size];
+    if (!file_buf) {
+        fprintf(stderr, "Failed to allocate %zu-byte buffer for save state\n",
+                max_file_size);
+        return 0;
+    }
+
+    uint8_t *p = file_buf;
+    memcpy(p, state_file_magic, 8);
+    p = put_u32(p + 8, state_file_version);
+    p = put_u32(p, mapper_nr);
+    memcpy(p, prg_md5, 16);
+    p = put_u32(p + 16, N_SUBSYSTEMS);
+
+    for (unsigned ss = 0; ss < N_SUBSYSTEMS; ++ss) {
+        uint8_t const *const data = state + subsystem_start(ss);
+        size_t const size = subsystem_end[ss] - subsystem_start(ss);
+
+        memcpy(p, subsystem_tags[ss], 4);
+        p = put_u32(p + 4, size);
+        uint8_t *const stored_size_p = p;
+        p += 4;
+
+        size_t stored_size = size;
+        if (compress_state_files) {
+            stored_size = lz_compress(data, size, p);
+            if (stored_size >= size)
+                // Didn't help. Store it as is.
+                stored_size = size;
+        }
+        if (stored_size == size)
+            memcpy(p, data, size);
+        put_u32(stored_size_p, stored_size);
+        p += stored_size;
+    }
+
+    size = p - file_buf;
+    return file_buf;
+}
+
+bool save_state_file(char const *filename) {
+    size_t file_size;
+    uint8_t *file_buf = save_state_to_buf(file_size);
+    if (!file_buf)
+        return false;
+
+    bool const ok = write_file_safely(filename, file_buf, file_size);
+    if (!ok)
+        fprintf(stderr, "Failed to save state to '%s': %s\n", filename,
+                strerror(errno));
+
+    free_array_set_null(file_buf);
 
-void save_state() {
-    transfer_system_state<false, true>(state);
-    has_save = true;
+    return ok;
 }
 
-void load_state() {
-    if (has_save) {
-        // Clear rewind
+// Checks the header and decompresses the chunks of the 'size'-byte save state
+// file 'file' into the state buffer. Returns an error message, or null if
+// successful.
+static char const *read_state_file(uint8_t const *file, size_t size) {
+    // Whatever was in the state buffer is gone after this
+    state_id = 0;
+
+    uint8_t const *const end = file + size;
+
+    if (size < state_file_header_size || memcmp(file, state_file_magic, 8))
+        return "not a save state file";
+    if (get_u32(file + 8) != state_file_version)
+        return "saved by an incompatible version of the emulator";
+    if (get_u32(file + 12) != mapper_nr || memcmp(file + 16, prg_md5, 16))
+        return "saved for a different ROM";
+    if (get_u32(file + 32) != N_SUBSYSTEMS)
+        return "unexpected number of chunks";
+
+    uint8_t const *p = file + state_file_header_size;
+    for (unsigned ss = 0; ss < N_SUBSYSTEMS; ++ss) {
+        if (size_t(end - p) < chunk_header_size)
+            return "truncated";
+
+        size_t const size = subsystem_end[ss] - subsystem_start(ss);
+        if (memcmp(p, subsystem_tags[ss], 4) || get_u32(p + 4) != size)
+            return "unexpected chunk (incompatible version?)";
+        size_t const stored_size = get_u32(p + 8);
+        p += chunk_header_size;
+        if (size_t(end - p) < stored_size)
+            return "truncated";
+
+        uint8_t *const dst = state + subsystem_start(ss);
+        if (stored_size == size)
+            memcpy(dst, p, size);
+        else if (!lz_decompress(p, stored_size, dst, size))
+            return "corrupt compressed data";
+        p += stored_size;
+    }
+
+    return 0;
+}
+
+bool load_state_file(char const *filename) {
+    int const fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to open '%s': %s\n", filename, strerror(errno));
+        return false;
+    }
+
+    char const *error = 0;
+    struct stat st;
+    void *file = MAP_FAILED;
+    if (fstat(fd, &st) == -1 ||
+        (file = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+        error = strerror(errno);
+    close(fd);
+
+    if (!error) {
+        error = load_state_from_buf((uint8_t const*)file, st.st_size);
+        munmap(file, st.st_size);
+    }
+
+    if (error) {
+        fprintf(stderr, "Failed to load state from '%s': %s\n", filename, error);
+        return false;
+    }
+
+    return true;
+}
+
+char const *load_state_from_buf(uint8_t const *buf, size_t size) {
+    char const *const error = read_state_file(buf, size);
+    if (error)
+        return error;
+
+    // Clear rewind
 #ifdef INCLUDE_REWIND
-	    n_recorded_frames = 0;
+    n_recorded_frames = 0;
 #endif
 
-        transfer_system_state<false, false>(state);
-    }
+    load_snapshot(state, 0);
+
+    return 0;
+}
+
+// Returns the filename for save state slot 'slot'. The caller frees it.
+static char *slot_filename(unsigned slot) {
+    char *const filename = new (std::nothrow) char[strlen(rom_filename) + 16];
+    fail_if(!filename, "failed to allocate memory for save state filename");
+    sprintf(filename, "%s.state%u", rom_filename, slot);
+    return filename;
+}
+
+bool save_state(unsigned slot) {
+    char *filename = slot_filename(slot);
+    bool const ok = save_state_file(filename);
+    if (ok)
+        printf("Saved state to slot %u ('%s')\n", slot, filename);
+    free_array_set_null(filename);
+    return ok;
+}
+
+bool load_state(unsigned slot) {
+    char *filename = slot_filename(slot);
+    bool const ok = load_state_file(filename);
+    if (ok)
+        printf("Loaded state from slot %u ('%s')\n", slot, filename);
+    free_array_set_null(filename);
+    return ok;
 }
 
 #ifdef INCLUDE_REWIND
@@ -93,26 +495,184 @@ unsigned get_frame_len() {
     return frame_len[rewind_buf_i];
 }
 
-// Saves the current state to the rewind buffer. New states overwrite old if
-// the buffer becomes full.
+//
+// Delta encoding
+//
+// A delta is a sequence of (<zero bytes>, <literal bytes>) runs covering the
+// state, with the lengths as LEB128 varints and the literal (XORed) bytes
+// following their length. Gaps of a few zero bytes are kept in the literal
+// runs, which is cheaper than starting a new run.
+
+// Gaps of zero bytes shorter than this don't end a literal run
+size_t const min_zero_run = 4;
+
+// Worst-case size of an encoded delta for a state of 'len' bytes: a single
+// literal run, with two varints of at most 10 bytes each
+static size_t max_delta_size(size_t len) {
+    return len + 20;
+}
+
+static uint8_t *put_varint(uint8_t *out, size_t n) {
+    for (; n >= 0x80; n >>= 7)
+        *out++ = n | 0x80;
+    *out++ = n;
+    return out;
+}
+
+static uint8_t const *get_varint(uint8_t const *in, size_t &n) {
+    n = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+    do {
+        byte = *in++;
+        n |= (size_t)(byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return in;
+}
+
+// Returns the number of bytes from 'i' up to the next byte where 'a' and 'b'
+// differ (or 'len')
+static size_t equal_run(uint8_t const *a, uint8_t const *b, size_t i, size_t len) {
+    size_t const start = i;
+    // Compare a word at a time while we can
+    for (; i + 8 <= len; i += 8) {
+        uint64_t wa, wb;
+        memcpy(&wa, a + i, 8);
+        memcpy(&wb, b + i, 8);
+        if (wa != wb)
+            break;
+    }
+    while (i < len && a[i] == b[i])
+        ++i;
+    return i - start;
+}
+
+// Encodes the XOR of the 'len'-byte buffers 'a' and 'b' into 'out'. Returns
+// the size of the encoded delta.
+static size_t encode_delta(uint8_t const *a, uint8_t const *b, size_t len,
+                           uint8_t *out) {
+    uint8_t *const out_start = out;
+
+    for (size_t i = 0; i < len;) {
+        size_t const n_zero = equal_run(a, b, i, len);
+        i += n_zero;
+
+        // Extend the literal run until a long enough zero run (or the end)
+        size_t lit_end = i;
+        while (lit_end < len) {
+            if (a[lit_end] != b[lit_end]) {
+                ++lit_end;
+                continue;
+            }
+            size_t const gap = equal_run(a, b, lit_end, len);
+            if (gap >= min_zero_run || lit_end + gap == len)
+                break;
+            lit_end += gap;
+        }
+
+        out = put_varint(out, n_zero);
+        out = put_varint(out, lit_end - i);
+        for (; i < lit_end; ++i)
+            *out++ = a[i] ^ b[i];
+    }
+
+    return out - out_start;
+}
+
+// XORs the delta in 'delta' into the 'len'-byte buffer 'buf'
+static void apply_delta(uint8_t *buf, uint8_t const *delta, size_t len) {
+    for (size_t i = 0; i < len;) {
+        size_t n_zero, n_lit;
+        delta = get_varint(delta, n_zero);
+        delta = get_varint(delta, n_lit);
+        i += n_zero;
+        assert(i + n_lit <= len);
+        for (size_t const end = i + n_lit; i < end; ++i)
+            buf[i] ^= *delta++;
+    }
+}
+
+//
+// Rewind buffer management
+//
+
+// Returns the index of the frame 'n' frames before the top state
+static unsigned frame_before_top(unsigned n) {
+    return (rewind_buf_i + n_rewind_frames - n) % n_rewind_frames;
+}
+
+// Returns the offset in rewind_buf where a delta of 'size' bytes can be stored,
+// dropping the oldest states as needed to make room
+static size_t alloc_delta(size_t size) {
+    for (;;) {
+        // All states but the oldest and the new top state (whose delta this
+        // is) have a delta
+        if (n_recorded_frames <= 2)
+            return 0;
+
+        // Offset of the oldest delta still in use, belonging to the second
+        // oldest state. The ones in use extend from it to rewind_buf_head,
+        // possibly wrapping around. They never end exactly at it.
+        size_t const tail = delta_pos[frame_before_top(n_recorded_frames - 2)];
+
+        if (rewind_buf_head > tail) {
+            if (rewind_buf_size - rewind_buf_head >= size)
+                return rewind_buf_head;
+            if (size < tail)
+                // Wrap around, leaving the end of the buffer unused
+                return 0;
+        }
+        else
+            if (size < tail - rewind_buf_head)
+                return rewind_buf_head;
+
+        // Drop the oldest state
+        --n_recorded_frames;
+    }
+}
+
+// Saves the current state to the rewind buffer. Old states are dropped if the
+// buffer becomes full.
 static void push_state() {
-    if (n_recorded_frames < n_rewind_frames)
-        ++n_recorded_frames;
+    new_state_id = save_snapshot(new_state, new_state_id);
+
+    if (n_recorded_frames == n_rewind_frames)
+        // Make room for the new frame's data by dropping the oldest state
+        --n_recorded_frames;
 
     rewind_buf_i = (rewind_buf_i + 1) % n_rewind_frames;
-    transfer_system_state<false, true>(rewind_buf + state_size*rewind_buf_i);
+    ++n_recorded_frames;
+
+    if (n_recorded_frames > 1) {
+        size_t const size =
+          encode_delta(new_state, top_state, state_size, delta_buf);
+        size_t const pos = alloc_delta(size);
+        memcpy(rewind_buf + pos, delta_buf, size);
+        delta_pos[rewind_buf_i] = pos;
+        rewind_buf_head = pos + size;
+    }
+
+    swap(top_state, new_state);
+    swap(top_state_id, new_state_id);
 }
 
-// Removes the most recently pushed state from the rewind buffer
+// Removes the most recently pushed state from the rewind buffer, making the
+// state before it the top state
 static void pop_state() {
-    assert(n_recorded_frames > 0);
+    assert(n_recorded_frames > 1);
+    apply_delta(top_state, rewind_buf + delta_pos[rewind_buf_i], state_size);
+    // No longer any particular snapshot
+    top_state_id = 0;
+    // Free the delta
+    rewind_buf_head = delta_pos[rewind_buf_i];
     rewind_buf_i = (rewind_buf_i == 0) ? n_rewind_frames - 1 : rewind_buf_i - 1;
     --n_recorded_frames;
 }
 
 // Loads the most recently pushed state from the rewind buffer
 static void load_top_state() {
-    transfer_system_state<false, false>(rewind_buf + state_size*rewind_buf_i);
+    load_snapshot(top_state, top_state_id);
 }
 
 static void handle_forwards_frame() {
@@ -158,33 +718,112 @@ void init_save_states_for_rom() {
     n_rewind_frames = rewind_seconds*ppu_fps;
 #endif
 
+    init_dirty_pages(DIRTY_RAM, 0x800);
+    init_dirty_pages(DIRTY_WRAM, wram_base ? 0x2000*wram_8k_banks : 0);
+    init_dirty_pages(DIRTY_CHR_RAM, chr_is_ram ? 0x2000*chr_8k_banks : 0);
+    init_dirty_pages(DIRTY_CIRAM, mirroring == FOUR_SCREEN ? 0x1000 : 0x800);
+    mark_all_pages_dirty();
+    last_snapshot_id = 0;
+
+    // Also sets subsystem_end
     state_size = transfer_system_state<true, false>(0);
-#ifdef INCLUDE_REWIND
-    size_t const rewind_buf_size = state_size*n_rewind_frames;
-#endif
 #ifndef RUN_TESTS
     printf("save state size: %zu bytes\n",
            state_size);
 #endif
     fail_if(!(state = new (std::nothrow) uint8_t[state_size]),
       "failed to allocate %zu-byte buffer for save state", state_size);
+    state_id = 0;
 #ifdef INCLUDE_REWIND
+    // Some slack beyond a single delta is needed for rewinding to make sense
+    fail_if(rewind_buf_size < 4*max_delta_size(state_size),
+      "the %zu-byte rewind buffer is too small for %zu-byte save states",
+      rewind_buf_size, state_size);
     fail_if(!(rewind_buf = new (std::nothrow) uint8_t[rewind_buf_size]),
       "failed to allocate %zu-byte rewind buffer", rewind_buf_size);
+    fail_if(!(top_state = new (std::nothrow) uint8_t[state_size]) ||
+            !(new_state = new (std::nothrow) uint8_t[state_size]),
+      "failed to allocate %zu-byte buffers for rewind states", state_size);
+    fail_if(!(delta_buf = new (std::nothrow) uint8_t[max_delta_size(state_size)]),
+      "failed to allocate %zu-byte buffer for rewind deltas",
+      max_delta_size(state_size));
     fail_if(!(frame_len = new (std::nothrow) unsigned[n_rewind_frames]),
       "failed to allocate %zu-byte buffer for frame lengths",
       sizeof(unsigned)*n_rewind_frames);
+    fail_if(!(delta_pos = new (std::nothrow) size_t[n_rewind_frames]),
+      "failed to allocate %zu-byte buffer for delta positions",
+      sizeof(size_t)*n_rewind_frames);
 
+    top_state_id = new_state_id = 0;
+    rewind_buf_head = 0;
     rewind_buf_i = 0;
+    n_recorded_frames = 0;
+    is_backwards_frame = false;
 #endif
 }
 
 void deinit_save_states_for_rom() {
+    for (unsigned r = 0; r < N_DIRTY_REGIONS; ++r) {
+        free_array_set_null(dirty_pages[r].bits);
+        free_array_set_null(dirty_pages[r].last_dirty);
+    }
     free_array_set_null(state);
 #ifdef INCLUDE_REWIND
     free_array_set_null(rewind_buf);
+    free_array_set_null(top_state);
+    free_array_set_null(new_state);
+    free_array_set_null(delta_buf);
     free_array_set_null(frame_len);
+    free_array_set_null(delta_pos);
     n_recorded_frames = 0;
 #endif
-    has_save = false;
+    state_id = 0;
+}
+
+template<bool calculating_size, bool is_save>
+void transfer_save_states_context(uint8_t *&buf) {
+    TRANSFER(dirty_pages)
+    TRANSFER(last_snapshot_id)
+    TRANSFER(state)
+    TRANSFER(state_id)
+    TRANSFER(state_size)
+    TRANSFER(subsystem_end)
+#ifdef INCLUDE_REWIND
+    TRANSFER(rewind_buf)
+    TRANSFER(rewind_buf_head)
+    TRANSFER(top_state)
+    TRANSFER(new_state)
+    TRANSFER(top_state_id)
+    TRANSFER(new_state_id)
+    TRANSFER(delta_buf)
+    TRANSFER(frame_len)
+    TRANSFER(delta_pos)
+    TRANSFER(rewind_buf_i)
+    TRANSFER(n_rewind_frames)
+    TRANSFER(n_recorded_frames)
+    TRANSFER(is_backwards_frame)
+#endif
 }
+
+// Explicit instantiations
+
+// Calculating state size
+template size_t transfer_system_state<true, false>(uint8_t*);
+// Saving state to buffer
+template size_t transfer_system_state<false, true>(uint8_t*);
+// Loading state from buffer
+template size_t transfer_system_state<false, false>(uint8_t*);
+
+// Calculating state size
+template void transfer_pages<true, false>(uint8_t*, size_t, Dirty_region, uint8_t*&);
+// Saving state to buffer
+template void transfer_pages<false, true>(uint8_t*, size_t, Dirty_region, uint8_t*&);
+// Loading state from buffer
+template void transfer_pages<false, false>(uint8_t*, size_t, Dirty_region, uint8_t*&);
+
+// Calculating context size
+template void transfer_save_states_context<true, false>(uint8_t*&);
+// Saving context to buffer
+template void transfer_save_states_context<false, true>(uint8_t*&);
+// Loading context from buffer
+template void transfer_save_states_context<false, false>(uint8_t*&);
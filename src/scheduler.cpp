@@ -0,0 +1,107 @@
+#include "common.h"
+
+#include "apu.h"
+#include "cpu.h"
+#include "ppu.h"
+#include "scheduler.h"
+
+// There are only a few kinds of events, each scheduled at most once, so a
+// plain array with the earliest cycle of each kind cached beats a priority
+// queue here
+
+THREAD_LOCAL uint64_t next_event_cycle     = UINT64_MAX;
+THREAD_LOCAL uint64_t next_cpu_event_cycle = UINT64_MAX;
+
+static THREAD_LOCAL uint64_t event_cycles[N_EVENTS] =
+  { UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX,
+    UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX,
+    UINT64_MAX };
+
+static uint64_t earliest_event_cycle(unsigned first, unsigned end) {
+    uint64_t res = UINT64_MAX;
+    for (unsigned i = first; i < end; ++i)
+        res = min(res, event_cycles[i]);
+    return res;
+}
+
+void schedule_event(Event event, uint64_t cycle) {
+    if (event < FIRST_CPU_EVENT) {
+        // Sync events for this cycle or earlier are handled on the next one
+        event_cycles[event] = max(cycle, cpu_cycle + 1);
+        next_event_cycle = earliest_event_cycle(0, FIRST_CPU_EVENT);
+    }
+    else {
+        event_cycles[event] = cycle;
+        next_cpu_event_cycle = earliest_event_cycle(FIRST_CPU_EVENT, N_EVENTS);
+    }
+}
+
+void cancel_event(Event event) {
+    schedule_event(event, UINT64_MAX);
+}
+
+uint64_t event_cycle(Event event) {
+    return event_cycles[event];
+}
+
+static void handle_event(Event event) {
+    switch (event) {
+    case EVENT_PPU_FRAME_END:
+    case EVENT_PPU_VBLANK:
+    case EVENT_MAPPER_SYNC:
+        sync_ppu();
+        break;
+
+    case EVENT_FRAME_IRQ:
+    case EVENT_DMC_DMA:
+    case EVENT_APU_SYNC:
+        sync_apu();
+        break;
+
+    default: UNREACHABLE
+    }
+}
+
+void run_due_events() {
+    // Handlers reschedule events and might tick() and recurse (e.g. DMC
+    // sample fetches during sync_apu()), so look for the first due event
+    // anew each time
+    while (next_event_cycle <= cpu_cycle) {
+        unsigned event = 0;
+        while (event_cycles[event] != next_event_cycle)
+            ++event;
+        cancel_event((Event)event);
+        handle_event((Event)event);
+    }
+}
+
+Event first_due_cpu_event() {
+    if (next_cpu_event_cycle > cpu_cycle)
+        return N_EVENTS;
+
+    unsigned event = FIRST_CPU_EVENT;
+    while (event_cycles[event] > cpu_cycle)
+        ++event;
+    return (Event)event;
+}
+
+void clear_events() {
+    init_array(event_cycles, (uint64_t)UINT64_MAX);
+    next_event_cycle = next_cpu_event_cycle = UINT64_MAX;
+}
+
+template<bool calculating_size, bool is_save>
+void transfer_scheduler_context(uint8_t *&buf) {
+    TRANSFER(event_cycles)
+    TRANSFER(next_event_cycle)
+    TRANSFER(next_cpu_event_cycle)
+}
+
+// Explicit instantiations
+
+// Calculating context size
+template void transfer_scheduler_context<true, false>(uint8_t*&);
+// Saving context to buffer
+template void transfer_scheduler_context<false, true>(uint8_t*&);
+// Loading context from buffer
+template void transfer_scheduler_context<false, false>(uint8_t*&);
@@ -4,14 +4,18 @@
 #include "audio.h"
 #include "cpu.h"
 #include "input.h"
+#include "input_movie.h"
+#include "mapper.h"
 #ifdef RECORD_MOVIE
 #  include "movie.h"
 #endif
+#include "rom.h"
 #include "save_states.h"
 #include "sdl_backend.h"
 #ifdef RUN_TESTS
 #  include "test.h"
 #endif
+#include "timing.h"
 
 #include "dbg.h"
 #include "dbgfont.xpm"
@@ -24,10 +28,6 @@
 // Video
 //
 
-#define NES_PPU_W 282 //including the padding
-#define NES_PPU_H 240
-#define NES_PPU_OFFSET 15
-
 #define SCREENW 320
 #define SCREENH 240
 
@@ -64,23 +64,44 @@ SDL_Rect boxify() {
 // a very long time (to the tune of only managing 30 FPS with everything
 // removed but render calls when the translucent Ubuntu menu is open, and often
 // less than 60 with Firefox open too). This in turn slows down emulation and
-// messes up audio. To get around it, we upload frames in the SDL thread and
-// keep a back buffer for drawing into from the emulation thread while the
-// frame is being uploaded (a kind of manual triple buffering). If the frame
-// doesn't upload in time for the next frame, we drop the new frame. This gives
-// us automatic frame skipping in general.
+// messes up audio. To get around it, we upload frames in the SDL thread.
+//
+// The frames are handed over with triple buffering. The emulation thread draws
+// into the back buffer and the SDL thread uploads from the front buffer. The
+// third buffer sits in a mailbox between them, and each thread swaps its
+// buffer with the one in the mailbox: the emulation thread to post a finished
+// frame, and the SDL thread to pick up the newest one. The swaps are atomic, so
+// neither thread ever waits on the other for a buffer. If the SDL thread falls
+// behind, the frame in the mailbox gets replaced by a newer one before it's
+// picked up. That gives us automatic frame skipping in general.
 //
 // TODO: This could probably be optimized to eliminate some copying and format
 // conversions.
 
+static Uint32 render_buffers[3][NES_PPU_H*NES_PPU_W];
 
-static Uint32 *front_buffer;
+// Index of the buffer in the mailbox, ORed with mailbox_has_new_frame if it
+// holds a frame the SDL thread hasn't picked up yet
+static unsigned mailbox;
+unsigned const mailbox_has_new_frame = 4;
+
+// Owned by the emulation thread and the SDL thread, respectively
 static Uint32 *back_buffer;
+static Uint32 *front_buffer;
+static unsigned back_buffer_i;
+static unsigned front_buffer_i;
+
+// Posted once per frame posted to the mailbox. The SDL thread waits on it.
+static SDL_sem *frame_posted_sem;
 
-static SDL_mutex *frame_lock;
-static SDL_cond  *frame_available_cond;
-static bool ready_to_draw_new_frame;
-static bool frame_available;
+// Frame presentation statistics, printed on exit. Frames count as dropped if
+// they get replaced in the mailbox before the SDL thread picks them up, and as
+// duplicated for each display refresh (estimated from the frame rate) that
+// passes without a new frame while running at normal speed.
+static unsigned long frames_presented;
+static unsigned long frames_dropped;    // Emulation thread
+static unsigned long frames_duplicated; // SDL thread
+static double        last_frame_present_time;
 
 bool show_debugger;
 
@@ -208,25 +229,78 @@ void put_pixel(int x, unsigned y, uint32_t color) {
   back_buffer[NES_PPU_W*y + (x + NES_PPU_OFFSET)] = color;
 }
 
+void put_pixels(int x, unsigned y, uint32_t const *colors, unsigned n) {
+  assert(x >= -NES_PPU_OFFSET);
+  assert(x + (int)n <= NES_PPU_W - NES_PPU_OFFSET);
+  assert(y < NES_PPU_H);
+
+  memcpy(back_buffer + NES_PPU_W*y + (x + NES_PPU_OFFSET), colors,
+         sizeof(uint32_t)*n);
+}
+
+// If true, only some frames are presented while fast-forwarding: every
+// speed_multiplier'th frame, or at unlimited speed, one frame per normal frame
+// period. The PPU skips the pixels for the others. Otherwise, the frames that
+// come in while the SDL thread is busy are dropped.
+static bool const skip_frames_while_fast_forwarding = true;
+
+static unsigned frames_till_present;
+static double   last_present_time;
+
+// Set by want_frame() for the frame in progress
+static bool presenting_frame = true;
+
+bool want_frame() {
+#ifdef RECORD_MOVIE
+  // Every frame goes into the movie
+  return true;
+#endif
+
+  presenting_frame = true;
+  if (speed_multiplier != 1 && skip_frames_while_fast_forwarding) {
+    if (speed_multiplier == 0) {
+      double const now = get_seconds();
+      if (now - last_present_time < 1.0/ppu_fps)
+        presenting_frame = false;
+      else
+        last_present_time = now;
+    }
+    else {
+      if (frames_till_present > 0) {
+        --frames_till_present;
+        presenting_frame = false;
+      }
+      else
+        frames_till_present = speed_multiplier - 1;
+    }
+  }
+
+  return presenting_frame;
+}
+
 void draw_frame() {
 #ifdef RECORD_MOVIE
   add_movie_video_frame(back_buffer);
 #endif
 
-  // Signal to the SDL thread that the frame has ended
-
-  SDL_LockMutex(frame_lock);
-  // Drop the new frame if the old one is still being rendered. This also
-  // means that we drop event processing for one frame, but it's probably not
-  // a huge deal.
-  if (ready_to_draw_new_frame) {
-    frame_available = true;
-    swap(back_buffer, front_buffer);
-    SDL_CondSignal(frame_available_cond);
-  } else {
-    printf("dropping frame\n");
-  }
-  SDL_UnlockMutex(frame_lock);
+  if (!presenting_frame)
+    return;
+
+  // Post the frame to the mailbox, and continue drawing into the buffer that
+  // was there. The release makes the frame visible to the SDL thread, and the
+  // acquire makes sure it's done uploading from the buffer we get back.
+  unsigned const prev_mailbox =
+    __atomic_exchange_n(&mailbox, back_buffer_i | mailbox_has_new_frame,
+                        __ATOMIC_ACQ_REL);
+  back_buffer_i = prev_mailbox & ~mailbox_has_new_frame;
+  back_buffer   = render_buffers[back_buffer_i];
+
+  if (prev_mailbox & mailbox_has_new_frame)
+    // The SDL thread never got to the previous frame. This also means that we
+    // drop event processing for one frame, but it's probably not a huge deal.
+    ++frames_dropped;
+
+  SDL_SemPost(frame_posted_sem);
 }
 
 //
@@ -242,9 +316,6 @@ static void audio_callback(void*, Uint8 *stream, int len) {
   read_samples((int16_t*)stream, len/sizeof(int16_t));
 }
 
-void lock_audio() { SDL_LockAudioDevice(audio_device_id); }
-void unlock_audio() { SDL_UnlockAudioDevice(audio_device_id); }
-
 bool audio_pb = 1;
 int audio_pause(bool value) {
 
@@ -265,6 +336,25 @@ int audio_pause(bool value) {
 
   int lastdbgkey = 0;
 
+  // Current save state slot
+  static unsigned state_slot;
+
+  // Starts recording an input movie from the current state into
+  // "<ROM filename>.movie", or stops recording
+  static void toggle_movie_recording() {
+    if (movie_mode == MOVIE_RECORDING) {
+      stop_movie();
+      return;
+    }
+
+    char *filename = new (std::nothrow) char[strlen(rom_filename) + 7];
+    fail_if(!filename, "failed to allocate memory for movie filename");
+    sprintf(filename, "%s.movie", rom_filename);
+    start_movie_recording(filename, false);
+    printf("Recording input movie to '%s'\n", filename);
+    free_array_set_null(filename);
+  }
+
 #define KEY_PRESSED(i) ( (keys[i]) & (!keys_lf[i]) )
 #define KEY_RELEASED(i) ( (!keys[i]) & (keys_lf[i]) )
 
@@ -276,12 +366,23 @@ int audio_pause(bool value) {
 
   SDL_mutex   *event_lock;
 
+  // Set on the SDL thread when the window is closed. Events must be posted
+  // from the emulation thread, so handle_ui_keys() ends emulation from there.
+  // Protected by event_lock.
+  static bool quit_requested;
+
+  void lock_input() { SDL_LockMutex(event_lock); }
+  void unlock_input() { SDL_UnlockMutex(event_lock); }
+
   // Runs from emulation thread
   void handle_ui_keys() {
     SDL_LockMutex(event_lock);
 
-    if (keys[SDL_SCANCODE_ESCAPE]) 
+    if (keys[SDL_SCANCODE_ESCAPE]) {
+      // Write out the movie if recording
+      stop_movie();
       exit(0);
+    }
 #ifdef ENABLE_CORRUPTION
     if (KEY_PRESSED(SDL_SCANCODE_F3)) {
       corrupt_chance += 0x1000; printf("New corrupt chance is %u\n", corrupt_chance); }
@@ -295,20 +396,56 @@ int audio_pause(bool value) {
       set_debugger_vis(show_debugger);
     }
 
-    if (keys[SDL_SCANCODE_F5])
-      save_state();
-    else if (keys[SDL_SCANCODE_F8])
-      load_state();
+    // Fast-forward while the key is held. F6 cycles through the speeds.
+    if (KEY_PRESSED(SDL_SCANCODE_F6)) {
+      fast_forward_speed = fast_forward_speed == 2 ? 4 : fast_forward_speed == 4 ? 0 : 2;
+      if (fast_forward_speed)
+        printf("Fast-forward speed is %ux\n", fast_forward_speed);
+      else
+        puts("Fast-forward speed is unlimited");
+    }
+    // Also read by update_present_stats() on the rendering thread
+    __atomic_store_n(&speed_multiplier,
+                     keys[SDL_SCANCODE_GRAVE] ? fast_forward_speed : 1,
+                     __ATOMIC_RELAXED);
+
+    if (KEY_PRESSED(SDL_SCANCODE_F7))
+      toggle_movie_recording();
+
+    // Loading a state or rewinding puts the inputs of a movie out of sync
+    bool const leaving_movie = KEY_PRESSED(SDL_SCANCODE_F8)
+#ifdef INCLUDE_REWIND
+      || keys[SDL_SCANCODE_BACKSPACE]
+#endif
+      ;
+    if (leaving_movie && movie_mode != MOVIE_OFF) {
+      puts("Stopping input movie");
+      stop_movie();
+    }
+
+    // F5 and F8 save and load the state in the current slot. F9 selects the
+    // next slot.
+    if (KEY_PRESSED(SDL_SCANCODE_F9)) {
+      state_slot = (state_slot + 1) % n_state_slots;
+      printf("Save state slot is %u\n", state_slot);
+    }
+    if (KEY_PRESSED(SDL_SCANCODE_F5))
+      save_state(state_slot);
+    else if (KEY_PRESSED(SDL_SCANCODE_F8))
+      load_state(state_slot);
 #ifdef INCLUDE_REWIND
     handle_rewind(keys[SDL_SCANCODE_BACKSPACE]);
 #endif
     if (reset_pushed)
       soft_reset();
+    if (quit_requested)
+      end_emulation();
 
     SDL_UnlockMutex(event_lock);
     if (keys_size) memcpy(keys_lf, keys, keys_size * sizeof(Uint8));
   }
 
+// Set from both threads
 static bool pending_sdl_thread_exit;
 
 static bool parse_inputs(SDL_Event event, struct input_bind* bind, bool* input) {
@@ -414,8 +551,8 @@ static void process_events_sub(SDL_Event event) {
       }
       break;
     case SDL_QUIT:
-      end_emulation();
-      pending_sdl_thread_exit = true;
+      quit_requested = true;
+      __atomic_store_n(&pending_sdl_thread_exit, true, __ATOMIC_RELEASE);
 #ifdef RUN_TESTS
       end_testing = true;
 #endif
@@ -500,21 +637,59 @@ static void draw_actual_frame(void) {
       "failed to clear screen: %s", SDL_GetError());
 }
 
+// Swaps the front buffer with the buffer in the mailbox if it holds a new
+// frame. Returns true if it did.
+static bool pick_up_new_frame() {
+  // Only this thread clears mailbox_has_new_frame, so it stays set until the
+  // exchange below
+  if (!(__atomic_load_n(&mailbox, __ATOMIC_ACQUIRE) & mailbox_has_new_frame))
+    return false;
+
+  front_buffer_i =
+    __atomic_exchange_n(&mailbox, front_buffer_i, __ATOMIC_ACQ_REL) &
+    ~mailbox_has_new_frame;
+  front_buffer = render_buffers[front_buffer_i];
+
+  return true;
+}
+
+static void update_present_stats() {
+  double const now = get_seconds();
+
+  // Longer gaps are pauses (or loading) rather than jitter
+  double const max_jitter_gap = 0.5;
+
+  if (frames_presented > 0 &&
+      __atomic_load_n(&speed_multiplier, __ATOMIC_RELAXED) == 1) {
+    double const gap = now - last_frame_present_time;
+    if (gap < max_jitter_gap) {
+      // Number of display refreshes (at the NES frame rate) that the previous
+      // frame stayed up for
+      unsigned long const refreshes = (unsigned long)(gap*ppu_fps + 0.5);
+      if (refreshes > 1)
+        frames_duplicated += refreshes - 1;
+    }
+  }
+
+  last_frame_present_time = now;
+  ++frames_presented;
+}
+
 void sdl_thread() {
   for (;;) {
 
     // Wait for the emulation thread to signal that a frame has completed
 
-    SDL_LockMutex(frame_lock);
-    ready_to_draw_new_frame = true;
-    while (!frame_available && !pending_sdl_thread_exit)
-      SDL_CondWait(frame_available_cond, frame_lock);
-    if (pending_sdl_thread_exit) {
-      SDL_UnlockMutex(frame_lock);
+    if (__atomic_load_n(&pending_sdl_thread_exit, __ATOMIC_ACQUIRE))
       return;
-    }
-    frame_available = ready_to_draw_new_frame = false;
-    SDL_UnlockMutex(frame_lock);
+    SDL_SemWait(frame_posted_sem);
+    if (__atomic_load_n(&pending_sdl_thread_exit, __ATOMIC_ACQUIRE))
+      return;
+
+    // The frames behind any extra posts were dropped in favor of the one we
+    // picked up earlier
+    if (!pick_up_new_frame())
+      continue;
 
     // Process events and calculate controller input state (which might
     // need left+right/up+down elimination)
@@ -524,14 +699,13 @@ void sdl_thread() {
     // Draw the new frame
 
     draw_actual_frame();
+    update_present_stats();
   }
 }
 
 void exit_sdl_thread() {
-  SDL_LockMutex(frame_lock);
-  pending_sdl_thread_exit = true;
-  SDL_CondSignal(frame_available_cond);
-  SDL_UnlockMutex(frame_lock);
+  __atomic_store_n(&pending_sdl_thread_exit, true, __ATOMIC_RELEASE);
+  SDL_SemPost(frame_posted_sem);
 }
 
 //
@@ -625,9 +799,11 @@ void init_sdl() {
 
   printf("dbg_font is %u %d %d %d\n",format, access, w, h);
 
-  static Uint32 render_buffers[2][NES_PPU_H*NES_PPU_W];
-  back_buffer  = render_buffers[0];
-  front_buffer = render_buffers[1];
+  back_buffer_i  = 0;
+  mailbox        = 1;
+  front_buffer_i = 2;
+  back_buffer    = render_buffers[back_buffer_i];
+  front_buffer   = render_buffers[front_buffer_i];
 
   // Audio
 
@@ -664,10 +840,8 @@ void init_sdl() {
   fail_if(!(event_lock = SDL_CreateMutex()),
       "failed to create event mutex: %s", SDL_GetError());
 
-  fail_if(!(frame_lock = SDL_CreateMutex()),
-      "failed to create frame mutex: %s", SDL_GetError());
-  fail_if(!(frame_available_cond = SDL_CreateCond()),
-      "failed to create frame condition variable: %s", SDL_GetError());
+  fail_if(!(frame_posted_sem = SDL_CreateSemaphore(0)),
+      "failed to create frame semaphore: %s", SDL_GetError());
 }
 
 void sdldbg_scroll(void) {
@@ -903,8 +1077,10 @@ void deinit_sdl() {
 
   SDL_DestroyMutex(event_lock);
 
-  SDL_DestroyMutex(frame_lock);
-  SDL_DestroyCond(frame_available_cond);
+  SDL_DestroySemaphore(frame_posted_sem);
+
+  printf("Frames: %lu presented, %lu dropped, %lu duplicated\n",
+         frames_presented, frames_dropped, frames_duplicated);
 
   SDL_CloseAudioDevice(audio_device_id); // Prolly not needed, but play it safe
   SDL_Quit();
@@ -0,0 +1,225 @@
+#include "common.h"
+
+#include "apu.h"
+#include "cpu.h"
+#include "ppu.h"
+#include "save_states.h"
+#include "state_hash.h"
+
+THREAD_LOCAL bool hashing_frames;
+
+// Snapshot of the state as of the last digest, brought up to date with
+// save_snapshot() for each new digest
+static THREAD_LOCAL uint8_t *hash_state;
+static THREAD_LOCAL size_t   hash_state_size;
+static THREAD_LOCAL uint64_t hash_state_id;
+
+// Hash of each page of each dirty-page region, as of the last digest
+static THREAD_LOCAL uint64_t *page_hashes[N_DIRTY_REGIONS];
+
+// Digests are written here if non-null
+static THREAD_LOCAL FILE *hash_log;
+
+// Reference digests to compare against, if any
+static THREAD_LOCAL uint64_t *ref_digests;
+static THREAD_LOCAL size_t    n_ref_digests;
+static THREAD_LOCAL bool      diverged;
+
+// Number of frames hashed so far
+static THREAD_LOCAL size_t    n_hashed_frames;
+
+uint64_t const hash_seed = UINT64_C(0x9E3779B97F4A7C15);
+
+// Mixes a word at a time into 'hash'. Not cryptographic, but several times
+// faster than FNV-1a, which goes a byte at a time.
+static uint64_t hash_bytes(uint64_t hash, uint8_t const *data, size_t len) {
+    for (; len >= 8; data += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        hash = (hash ^ word)*hash_seed;
+        hash ^= hash >> 29;
+    }
+    for (; len > 0; ++data, --len)
+        hash = (hash ^ *data)*hash_seed;
+
+    return hash ^ (hash >> 32);
+}
+
+uint64_t state_digest() {
+    assert(hash_state);
+
+    // Catch-up mode might have owed PPU dots and APU cycles
+    sync_ppu();
+    sync_apu();
+
+    uint64_t const prev_id = hash_state_id;
+    hash_state_id = save_snapshot(hash_state, prev_id);
+
+    // The regions appear in the state in the same order as in Dirty_region.
+    // The bytes between them are few and get hashed every time.
+    uint64_t hash = hash_seed;
+    size_t pos = 0;
+    for (unsigned r = 0; r < N_DIRTY_REGIONS; ++r) {
+        Dirty_pages const &d = dirty_pages[r];
+        if (d.n_pages == 0)
+            continue;
+
+        assert(d.state_offset >= pos);
+        hash = hash_bytes(hash, hash_state + pos, d.state_offset - pos);
+
+        uint8_t const *const region = hash_state + d.state_offset;
+        for (size_t i = 0; i < d.n_pages; ++i) {
+            // The pages that save_snapshot() just copied
+            if (prev_id == 0 || d.last_dirty[i] > prev_id)
+                page_hashes[r][i] = hash_bytes(hash_seed,
+                  region + dirty_page_size*i, dirty_page_size);
+            hash = (hash ^ page_hashes[r][i])*hash_seed;
+        }
+
+        pos = d.state_offset + dirty_page_size*d.n_pages;
+    }
+
+    return hash_bytes(hash, hash_state + pos, hash_state_size - pos);
+}
+
+void init_state_hash_for_rom() {
+    // Whatever is here belongs to another console (see emulator.h), which
+    // frees it
+    hashing_frames = false;
+    hash_state = 0;
+    hash_state_size = 0;
+    hash_state_id = 0;
+    for (unsigned r = 0; r < N_DIRTY_REGIONS; ++r)
+        page_hashes[r] = 0;
+    hash_log = 0;
+    ref_digests = 0;
+    n_ref_digests = 0;
+    diverged = false;
+    n_hashed_frames = 0;
+}
+
+// Reads the reference digests from 'filename'
+static void load_ref_digests(char const *filename) {
+    size_t size;
+    uint8_t *file_buf = get_file_buffer(filename, size);
+
+    // Upper bound on the number of digests
+    size_t max_digests = 1;
+    for (size_t i = 0; i < size; ++i)
+        if (file_buf[i] == '\n')
+            ++max_digests;
+    fail_if(!(ref_digests = new (std::nothrow) uint64_t[max_digests]),
+      "failed to allocate buffer for %zu reference digests", max_digests);
+
+    char const *p = (char const*)file_buf;
+    char const *const end = p + size;
+    n_ref_digests = 0;
+    while (p < end) {
+        char const *const line_end = (char const*)memchr(p, '\n', end - p);
+        size_t const line_len = (line_end ? line_end : end) - p;
+        // Lines hold 16 hex digits, possibly followed by a '\r'
+        if (line_len != 0) {
+            char digits[17];
+            fail_if(line_len < 16 || line_len > 17,
+              "invalid digest on line %zu of '%s'", n_ref_digests + 1, filename);
+            memcpy(digits, p, 16);
+            digits[16] = '\0';
+            char *digits_end;
+            ref_digests[n_ref_digests++] = strtoull(digits, &digits_end, 16);
+            fail_if(*digits_end != '\0',
+              "invalid digest on line %zu of '%s'", n_ref_digests, filename);
+        }
+        p += line_len + 1;
+    }
+
+    free_array_set_null(file_buf);
+}
+
+void start_state_hashing(char const *log_filename, char const *ref_filename) {
+    stop_state_hashing();
+
+    hash_state_size = transfer_system_state<true, false>(0);
+    fail_if(!(hash_state = new (std::nothrow) uint8_t[hash_state_size]),
+      "failed to allocate %zu-byte buffer for state hashing", hash_state_size);
+    hash_state_id = 0;
+    for (unsigned r = 0; r < N_DIRTY_REGIONS; ++r)
+        // The + 1 avoids empty arrays
+        fail_if(!(page_hashes[r] =
+                    new (std::nothrow) uint64_t[dirty_pages[r].n_pages + 1]),
+          "failed to allocate page hashes for state hashing");
+
+    if (log_filename)
+        errno_fail_if(!(hash_log = fopen(log_filename, "w")),
+          "failed to open '%s' for writing state digests", log_filename);
+    if (ref_filename)
+        load_ref_digests(ref_filename);
+
+    diverged = false;
+    n_hashed_frames = 0;
+    hashing_frames = log_filename || ref_filename;
+}
+
+bool stop_state_hashing() {
+    bool const matched = !diverged;
+
+    if (hash_log) {
+        if (fclose(hash_log) == EOF)
+            fprintf(stderr, "Failed to write state digests: %s\n",
+                    strerror(errno));
+        hash_log = 0;
+    }
+    if (ref_digests && !diverged)
+        printf("State matched the reference for %zu frames\n",
+               min(n_hashed_frames, n_ref_digests));
+
+    hashing_frames = false;
+    free_array_set_null(hash_state);
+    for (unsigned r = 0; r < N_DIRTY_REGIONS; ++r)
+        free_array_set_null(page_hashes[r]);
+    free_array_set_null(ref_digests);
+    n_ref_digests = 0;
+    diverged = false;
+
+    return matched;
+}
+
+void hash_frame_state() {
+    uint64_t const digest = state_digest();
+
+    if (hash_log)
+        fprintf(hash_log, "%016" PRIx64 "\n", digest);
+
+    if (n_hashed_frames < n_ref_digests && !diverged &&
+        digest != ref_digests[n_hashed_frames]) {
+        fprintf(stderr, "State diverged from the reference at frame %zu "
+                        "(expected %016" PRIx64 ", got %016" PRIx64 ")\n",
+                n_hashed_frames + 1, ref_digests[n_hashed_frames], digest);
+        diverged = true;
+        end_emulation();
+    }
+
+    ++n_hashed_frames;
+}
+
+template<bool calculating_size, bool is_save>
+void transfer_state_hash_context(uint8_t *&buf) {
+    TRANSFER(hashing_frames)
+    TRANSFER(hash_state)
+    TRANSFER(hash_state_size)
+    TRANSFER(hash_state_id)
+    TRANSFER(page_hashes)
+    TRANSFER(hash_log)
+    TRANSFER(ref_digests)
+    TRANSFER(n_ref_digests)
+    TRANSFER(diverged)
+    TRANSFER(n_hashed_frames)
+}
+
+// Explicit instantiations
+
+// Calculating context size
+template void transfer_state_hash_context<true, false>(uint8_t*&);
+// Saving context to buffer
+template void transfer_state_hash_context<false, true>(uint8_t*&);
+// Loading context from buffer
+template void transfer_state_hash_context<false, false>(uint8_t*&);
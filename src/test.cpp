@@ -3,7 +3,9 @@
 #include "cpu.h"
 #include "mapper.h"
 #include "rom.h"
-#include "sdl_backend.h"
+#ifndef HEADLESS
+#  include "sdl_backend.h"
+#endif
 
 bool end_testing;
 
@@ -18,13 +20,116 @@ void report_status_and_end_test(uint8_t status, char const *msg) {
     end_emulation();
 }
 
-static void run_test(char const *file) {
-    filename = file;
+static void run_test(char const *file, char const *name) {
+    filename = name;
     load_rom(file, false);
     run();
     unload_rom();
 }
 
+static void run_test(char const *file) {
+    run_test(file, file);
+}
+
+// Runs a test ROM that is built in memory rather than read from tests/. The
+// ROM is written to a temporary file for load_rom().
+static void run_generated_test(char const *name, uint8_t const *rom, size_t size) {
+    char tmp_filename[] = "/tmp/nesalizer-test-XXXXXX";
+    int const fd = mkstemp(tmp_filename);
+    errno_fail_if(fd == -1, "failed to create temporary file for '%s'", name);
+    close(fd);
+    errno_fail_if(!write_file_safely(tmp_filename, rom, size),
+                  "failed to write '%s' to '%s'", name, tmp_filename);
+    run_test(tmp_filename, name);
+    remove(tmp_filename);
+}
+
+//
+// Generated test ROMs
+//
+
+// MMC3 (mapper 4), 16 KB PRG, 8 KB CHR. The code is in the last 8 KB bank,
+// which is fixed at $E000.
+static uint8_t const mmc3_test_header[16] =
+  { 'N', 'E', 'S', 0x1A, 1, 1, 0x40, 0 };
+
+// Clocks the MMC3 scanline counter with A12 rises from $2007 reads while
+// rendering is disabled. Sixteen reads starting from $0FF0 leave v (and the
+// PPU address bus) at $1000. With the IRQ latch at 0, the rise should raise
+// the IRQ right away. Catch-up mode has to sync the PPU for it, as there are
+// no rendering fetches to predict.
+static uint8_t const mmc3_2007_a12_code[] = {
+  // reset:
+  0x78,             // $E000  SEI
+  0xA2, 0xFF,       // $E001  LDX #$FF
+  0x9A,             // $E003  TXS
+  0xA9, 0x40,       // $E004  LDA #$40
+  0x8D, 0x17, 0x40, // $E006  STA $4017  ; No APU frame IRQ
+  0x2C, 0x02, 0x20, // $E009  BIT $2002  ; Wait for the PPU to warm up
+  0x10, 0xFB,       // $E00C  BPL $E009
+  0x2C, 0x02, 0x20, // $E00E  BIT $2002
+  0x10, 0xFB,       // $E011  BPL $E00E
+  0xA9, 0x00,       // $E013  LDA #$00
+  0x8D, 0x01, 0x20, // $E015  STA $2001  ; Rendering off
+  0x8D, 0x10, 0x00, // $E018  STA $0010  ; IRQ count
+  0x8D, 0x00, 0xC0, // $E01B  STA $C000  ; IRQ latch
+  0x8D, 0x01, 0xC0, // $E01E  STA $C001  ; Reload the counter
+  0x8D, 0x01, 0xE0, // $E021  STA $E001  ; Enable the IRQ
+  0xA9, 0x0F,       // $E024  LDA #$0F
+  0x8D, 0x06, 0x20, // $E026  STA $2006
+  0xA9, 0xF0,       // $E029  LDA #$F0
+  0x8D, 0x06, 0x20, // $E02B  STA $2006  ; v = $0FF0
+  0xA2, 0x10,       // $E02E  LDX #$10
+  0x58,             // $E030  CLI
+  0xAD, 0x07, 0x20, // $E031  LDA $2007
+  0xCA,             // $E034  DEX
+  0xD0, 0xFA,       // $E035  BNE $E031
+  0xEA,             // $E037  NOP        ; Time for the IRQ to be taken
+  0xEA,             // $E038  NOP
+  0xEA,             // $E039  NOP
+  0xEA,             // $E03A  NOP
+  0x78,             // $E03B  SEI
+  0xAD, 0x10, 0x00, // $E03C  LDA $0010
+  0xF0, 0x0B,       // $E03F  BEQ $E04C
+  0xA9, 0x00,       // $E041  LDA #$00   ; Passed
+  0x8D, 0x04, 0x60, // $E043  STA $6004
+  0x8D, 0x00, 0x60, // $E046  STA $6000
+  0x4C, 0x49, 0xE0, // $E049  JMP $E049
+  0xA2, 0x00,       // $E04C  LDX #$00   ; Failed. Copy the message.
+  0xBD, 0x68, 0xE0, // $E04E  LDA $E068,X
+  0x9D, 0x04, 0x60, // $E051  STA $6004,X
+  0xF0, 0x03,       // $E054  BEQ $E059
+  0xE8,             // $E056  INX
+  0xD0, 0xF5,       // $E057  BNE $E04E
+  0xA9, 0x01,       // $E059  LDA #$01
+  0x8D, 0x00, 0x60, // $E05B  STA $6000
+  0x4C, 0x5E, 0xE0, // $E05E  JMP $E05E
+  // irq:
+  0xEE, 0x10, 0x00, // $E061  INC $0010
+  0x8D, 0x00, 0xE0, // $E064  STA $E000  ; Acknowledge
+  // nmi:
+  0x40,             // $E067  RTI
+  // $E068: Failure message
+  'I', 'R', 'Q', ' ', 'n', 'o', 't', ' ', 'r', 'a', 'i', 's', 'e', 'd', ' ',
+  'b', 'y', ' ', 'A', '1', '2', ' ', 'r', 'i', 's', 'e', ' ', 'f', 'r', 'o',
+  'm', ' ', '$', '2', '0', '0', '7', ' ', 'r', 'e', 'a', 'd', 0 };
+
+static void run_mmc3_2007_a12_test() {
+    static uint8_t rom[16 + 0x4000 + 0x2000];
+
+    memcpy(rom, mmc3_test_header, sizeof mmc3_test_header);
+    uint8_t *const prg = rom + 16;
+    memset(prg, 0xFF, 0x4000);
+    memcpy(prg + 0x2000, mmc3_2007_a12_code, sizeof mmc3_2007_a12_code);
+    // NMI, RESET, and IRQ vectors
+    static uint8_t const vectors[] = { 0x67, 0xE0, 0x00, 0xE0, 0x61, 0xE0 };
+    memcpy(prg + 0x3FFA, vectors, sizeof vectors);
+    // CHR
+    memset(prg + 0x4000, 0, 0x2000);
+
+    run_generated_test("mmc3_2007_a12 (generated)", rom, sizeof rom);
+}
+
 void run_tests() {
     // These can't be automated as easily:
     //   cpu_dummy_reads
@@ -93,6 +198,7 @@ void run_tests() {
     RUN_TEST("tests/mmc3_test_2/rom_singles/5-MMC3.nes");
     // Old-style behavior. Not yet implemented.
     //RUN_TEST("tests/mmc3_test_2/rom_singles/6-MMC3_alt.nes");
+    run_mmc3_2007_a12_test(); if (end_testing) goto end;
 
     putchar('\n');
 
@@ -151,5 +257,9 @@ void run_tests() {
     #undef RUN_TEST
 
 end:
+    // Headless builds have no rendering thread to stop
+#ifndef HEADLESS
     exit_sdl_thread();
+#endif
+    return;
 }
@@ -4,9 +4,12 @@
 #include "rom.h"
 #include "timing.h"
 
-double cpu_clock_rate;
-double ppu_clock_rate;
-double ppu_fps;
+THREAD_LOCAL double cpu_clock_rate;
+THREAD_LOCAL double ppu_clock_rate;
+THREAD_LOCAL double ppu_fps;
+
+unsigned speed_multiplier = 1;
+unsigned fast_forward_speed = 4;
 
 void init_timing_for_rom() {
     if (is_pal) {
@@ -29,7 +32,7 @@ void init_timing_for_rom() {
 // scheduling.
 
 // Used for main loop synchronization
-static timespec clock_previous;
+static THREAD_LOCAL timespec clock_previous;
 
 static void add_to_timespec(timespec &ts, long nano_secs) {
     long const new_nanos = ts.tv_nsec + nano_secs;
@@ -37,13 +40,28 @@ static void add_to_timespec(timespec &ts, long nano_secs) {
     ts.tv_nsec = new_nanos%1000000000l;
 }
 
+double get_seconds() {
+    timespec ts;
+    errno_fail_if(clock_gettime(CLOCK_MONOTONIC, &ts) == -1,
+      "failed to fetch timestamp from clock_gettime()");
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
 void init_timing() {
     errno_fail_if(clock_gettime(CLOCK_MONOTONIC, &clock_previous) == -1,
       "failed to fetch initial synchronization timestamp from clock_gettime()");
 }
 
 void sleep_till_end_of_frame() {
-    add_to_timespec(clock_previous, 1e9/ppu_fps);
+    if (speed_multiplier == 0) {
+        // Unlimited speed. Keep the timestamp current so that pacing picks up
+        // from here when the speed goes back to normal.
+        errno_fail_if(clock_gettime(CLOCK_MONOTONIC, &clock_previous) == -1,
+          "failed to fetch synchronization timestamp from clock_gettime()");
+        return;
+    }
+
+    add_to_timespec(clock_previous, 1e9/(ppu_fps*speed_multiplier));
 again:
     int const res =
       clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &clock_previous, 0);